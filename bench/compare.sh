@@ -0,0 +1,32 @@
+#!/bin/sh
+# Compare single row inserts of bench/insert.sql between two revisions of
+# the library, e.g.
+#   bench/compare.sh 2aa1e1b~1 2aa1e1b
+# pg_config, pg_ctl, psql and pgbench of the server must be in PATH, PGDATA
+# must point to its cluster, which is restarted to load each build. Runs one
+# client by default, so the average latency is the time of an insert.
+set -e
+
+clients=${CLIENTS:-1}
+duration=${DURATION:-60}
+top=$(git rev-parse --show-toplevel)
+
+for rev in "$@"; do
+	tree=$(mktemp -d)
+	git -C "$top" worktree add -q --detach "$tree" "$rev"
+	make -s -C "$tree" install >/dev/null
+	pg_ctl restart -w -l "${TMPDIR:-/tmp}/bm_bench_server.log" >/dev/null
+
+	psql -q -X -v ON_ERROR_STOP=1 \
+		-c 'DROP EXTENSION IF EXISTS bitmap CASCADE' \
+		-c 'CREATE EXTENSION bitmap' \
+		-c 'DROP TABLE IF EXISTS bm_bench' \
+		-c 'CREATE TABLE bm_bench (i int4, pad text)' \
+		-c 'CREATE INDEX bm_bench_idx ON bm_bench USING bitmap (i)'
+
+	echo "$rev ($(git -C "$top" rev-parse --short "$rev"))"
+	pgbench -n -f "$top/bench/insert.sql" -c "$clients" -j "$clients" -T "$duration" |
+		grep -E 'latency average|^tps'
+
+	git -C "$top" worktree remove --force "$tree"
+done
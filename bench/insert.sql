@@ -0,0 +1,7 @@
+-- Single row inserts into a bitmap indexed column, run with
+--   pgbench -n -f bench/insert.sql -c 8 -j 8 -T 60
+-- after
+--   CREATE TABLE bm_bench (i int4, pad text);
+--   CREATE INDEX bm_bench_idx ON bm_bench USING bitmap (i);
+\set v random(1, 100)
+INSERT INTO bm_bench VALUES (:v, 'x');
@@ -0,0 +1,85 @@
+/* bitmap--1.0--1.1.sql */
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION bitmap UPDATE TO '1.1'" to load this file. \quit
+
+-- Range operators and hash support functions of the operator classes
+
+ALTER OPERATOR FAMILY int2_ops USING bitmap ADD
+    OPERATOR        2       < (int2, int2),
+    OPERATOR        3       <= (int2, int2),
+    OPERATOR        4       >= (int2, int2),
+    OPERATOR        5       > (int2, int2),
+    FUNCTION        2       (int2, int2) hashint2(int2);
+
+ALTER OPERATOR FAMILY int4_ops USING bitmap ADD
+    OPERATOR        2       < (int4, int4),
+    OPERATOR        3       <= (int4, int4),
+    OPERATOR        4       >= (int4, int4),
+    OPERATOR        5       > (int4, int4),
+    FUNCTION        2       (int4, int4) hashint4(int4);
+
+ALTER OPERATOR FAMILY int8_ops USING bitmap ADD
+    OPERATOR        2       < (int8, int8),
+    OPERATOR        3       <= (int8, int8),
+    OPERATOR        4       >= (int8, int8),
+    OPERATOR        5       > (int8, int8),
+    FUNCTION        2       (int8, int8) hashint8(int8);
+
+ALTER OPERATOR FAMILY float4_ops USING bitmap ADD
+    OPERATOR        2       < (float4, float4),
+    OPERATOR        3       <= (float4, float4),
+    OPERATOR        4       >= (float4, float4),
+    OPERATOR        5       > (float4, float4),
+    FUNCTION        2       (float4, float4) hashfloat4(float4);
+
+ALTER OPERATOR FAMILY float8_ops USING bitmap ADD
+    OPERATOR        2       < (float8, float8),
+    OPERATOR        3       <= (float8, float8),
+    OPERATOR        4       >= (float8, float8),
+    OPERATOR        5       > (float8, float8),
+    FUNCTION        2       (float8, float8) hashfloat8(float8);
+
+ALTER OPERATOR FAMILY timestamp_ops USING bitmap ADD
+    OPERATOR        2       < (timestamp, timestamp),
+    OPERATOR        3       <= (timestamp, timestamp),
+    OPERATOR        4       >= (timestamp, timestamp),
+    OPERATOR        5       > (timestamp, timestamp),
+    FUNCTION        2       (timestamp, timestamp) timestamp_hash(timestamp);
+
+ALTER OPERATOR FAMILY timestamptz_ops USING bitmap ADD
+    OPERATOR        2       < (timestamptz, timestamptz),
+    OPERATOR        3       <= (timestamptz, timestamptz),
+    OPERATOR        4       >= (timestamptz, timestamptz),
+    OPERATOR        5       > (timestamptz, timestamptz),
+    FUNCTION        2       (timestamptz, timestamptz) timestamp_hash(timestamp);
+
+ALTER OPERATOR FAMILY inet_ops USING bitmap ADD
+    FUNCTION        2       (inet, inet) hashinet(inet);
+
+ALTER OPERATOR FAMILY cidr_ops USING bitmap ADD
+    FUNCTION        2       (cidr, cidr) hashinet(inet);
+
+ALTER OPERATOR FAMILY text_ops USING bitmap ADD
+    FUNCTION        2       (text, text) hashtext(text);
+
+ALTER OPERATOR FAMILY varchar_ops USING bitmap ADD
+    FUNCTION        2       (varchar, varchar) hashtext(text);
+
+-- Page inspection shows the run and container of bitmap tuples
+DROP FUNCTION bm_indexp(text, int8);
+
+CREATE FUNCTION bm_indexp(IN relname text, IN blkno int8,
+    OUT index int4,
+    OUT heap_blk int4,
+    OUT run int4,
+    OUT container text,
+    OUT bitmap text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'bm_indexp'
+LANGUAGE C STRICT PARALLEL SAFE;
+
+CREATE FUNCTION bm_pending_flush(IN index regclass)
+RETURNS int8
+AS 'MODULE_PATHNAME', 'bm_pending_flush'
+LANGUAGE C STRICT;
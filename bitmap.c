@@ -1,5 +1,6 @@
 #include <postgres.h>
 
+#include <float.h>
 #include <fmgr.h>
 #include <string.h>
 #include <storage/bufmgr.h>
@@ -9,6 +10,9 @@
 #include <commands/vacuum.h>
 #include <access/generic_xlog.h>
 #include <nodes/execnodes.h>
+#include <port/pg_bitutils.h>
+#include <utils/datum.h>
+#include <utils/guc.h>
 #include <utils/memutils.h>
 
 #include "bitmap.h"
@@ -29,12 +33,48 @@ void
 _PG_init(void)
 {
 	bm_relopt_kind = add_reloption_kind();
+	add_real_reloption(bm_relopt_kind, "bin_width",
+					   "Width of the bins numeric columns are indexed in",
+					   0, 0, DBL_MAX, AccessExclusiveLock);
+	add_enum_reloption(bm_relopt_kind, "bin_unit", "Unit timestamp columns are truncated to",
+					   bm_bin_units, BITMAP_BIN_NONE,
+					   gettext_noop("Valid values are \"none\", \"second\", \"minute\", \"hour\", \"day\", \"week\", \"month\" and \"year\"."),
+					   AccessExclusiveLock);
+	add_bool_reloption(bm_relopt_kind, "sliced",
+					   "Index bit slices of the value ordinals instead of a chain per value",
+					   false, AccessExclusiveLock);
+	add_int_reloption(bm_relopt_kind, "segment_blocks",
+					  "Number of heap blocks whose bitmaps of all values share a chain",
+					  0, 0, BITMAP_MAX_SEGMENT_BLOCKS, AccessExclusiveLock);
+	add_int_reloption(bm_relopt_kind, "stripes",
+					  "Number of chains the heap tuples of a value are spread over",
+					  1, 1, BITMAP_MAX_STRIPES, AccessExclusiveLock);
+	add_int_reloption(bm_relopt_kind, "extent_pages",
+					  "Number of consecutive pages a bitmap chain reserves at once",
+					  1, 1, BITMAP_MAX_EXTENT_PAGES, AccessExclusiveLock);
+	add_bool_reloption(bm_relopt_kind, "fastupdate",
+					   "Add inserted heap tuples to a pending list merged in batches",
+					   false, AccessExclusiveLock);
+	add_int_reloption(bm_relopt_kind, "pending_list_limit",
+					  "Size in kB of the pending list at which inserts merge it",
+					  4096, 64, MAX_KILOBYTES, AccessExclusiveLock);
+	bm_xlog_init();
+	bm_shared_init();
 }
 
 bytea *
 bmoptions(Datum reloptions, bool validate)
 {
-	static const relopt_parse_elt tab[] = {{}, {}};
+	static const relopt_parse_elt tab[] = {
+		{"bin_width", RELOPT_TYPE_REAL, offsetof(BitmapOptions, binWidth)},
+		{"bin_unit", RELOPT_TYPE_ENUM, offsetof(BitmapOptions, binUnit)},
+		{"sliced", RELOPT_TYPE_BOOL, offsetof(BitmapOptions, sliced)},
+		{"segment_blocks", RELOPT_TYPE_INT, offsetof(BitmapOptions, segmentBlocks)},
+		{"stripes", RELOPT_TYPE_INT, offsetof(BitmapOptions, stripes)},
+		{"extent_pages", RELOPT_TYPE_INT, offsetof(BitmapOptions, extentPages)},
+		{"fastupdate", RELOPT_TYPE_BOOL, offsetof(BitmapOptions, fastupdate)},
+		{"pending_list_limit", RELOPT_TYPE_INT, offsetof(BitmapOptions, pendingListLimit)},
+	};
 
 	return (bytea *) build_reloptions(reloptions, validate,
 									  bm_relopt_kind,
@@ -42,76 +82,738 @@ bmoptions(Datum reloptions, bool validate)
 									  tab, lengthof(tab));
 }
 
-static BlockNumber
-bm_insert_tuple(Relation index, BlockNumber startBlk, ItemPointer ctid)
+/*
+ * Add a bitmap tuple to a chain page if it has room. The page is probed
+ * under share lock and only locked exclusively, and its WAL record started,
+ * when the tuple may fit. nextBlk is set to the page following it. ordered
+ * tells whether the page is the last one and holds no later heap block, so
+ * that the tuple may go to a page appended after it. Appends skip pages
+ * that are not ordered.
+ */
+static bool
+bm_insert_on_page(Relation index, Buffer headbuf, BlockNumber blkno,
+				  BitmapTuple *tup, bool append, BlockNumber *nextBlk,
+				  bool *ordered)
 {
-	Buffer		buffer = InvalidBuffer;
-	Buffer		nbuffer = InvalidBuffer;
-	BitmapTuple *tup = bitmap_form_tuple(ctid);
+	Buffer		buffer = headbuf;
 	Page		page;
 	BitmapPageOpaque opaque;
-	BlockNumber blkno = startBlk;
 	GenericXLogState *gxstate;
-	bool inserted;
+	bool		done = false;
+	bool		inserted;
 
-	/* insert bitmap tuple from the first block */
-	while (blkno != InvalidBlockNumber)
+	if (blkno != BufferGetBlockNumber(headbuf))
 	{
 		buffer = ReadBuffer(index, blkno);
+		LockBuffer(buffer, BUFFER_LOCK_SHARE);
+	}
+
+	page = BufferGetPage(buffer);
+	opaque = BitmapPageGetOpaque(page);
+	*nextBlk = opaque->nextBlk;
+	*ordered = opaque->nextBlk == InvalidBlockNumber &&
+		(opaque->maxoff == 0 ||
+		 ((BitmapTuple *) (PageGetContents(page) +
+						   BitmapPageGetSlots(page)[opaque->maxoff - 1]))->heapblk <= tup->heapblk);
+
+	/* do not salvage recently vacuumed page, not cleaned up yet */
+	if ((append && !*ordered) || !bm_page_may_add(page, tup))
+	{
+		if (buffer != headbuf)
+			UnlockReleaseBuffer(buffer);
+		return false;
+	}
+
+	/* the page may change while unlocked, the insert checks it again */
+	if (buffer != headbuf)
+	{
+		LockBuffer(buffer, BUFFER_LOCK_UNLOCK);
 		LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+	}
 
+	if (bm_xlog_enabled(index))
+		done = bm_xlog_add_tup(buffer, tup);
+	else
+	{
 		gxstate = GenericXLogStart(index);
 		page = GenericXLogRegisterBuffer(gxstate, buffer, 0);
-
-		/*
-		 * TODO: we insert index tuple when there's page have space, it can
-		 * result storing mulitple index tuples for the same heap block in
-		 * different index blocks due to we remove index tuple on vacuum. we
-		 * don't have enough metrics to decide if we need to optimize on this
-		 * or not.
-		 */
-
-		/* do not salvage recently vacuumed page, not cleaned up yet */
-		/* update existing index tuple or insert new */
 		if (!BitmapPageDeleted(page) && bm_page_add_tup(page, tup, &inserted))
 		{
 			GenericXLogFinish(gxstate);
-			UnlockReleaseBuffer(buffer);
-			return startBlk;
+			done = true;
 		}
+		else
+			GenericXLogAbort(gxstate);
+	}
+
+	/* vacuum may have split the page */
+	*nextBlk = BitmapPageGetOpaque(BufferGetPage(buffer))->nextBlk;
+	if (buffer != headbuf)
+		UnlockReleaseBuffer(buffer);
+
+	return done;
+}
 
-		opaque = BitmapPageGetOpaque(page);
-		blkno = opaque->nextBlk;
+/*
+ * Add a bitmap tuple to a new page appended after the last page of a chain,
+ * recorded in the first page as its last. The page comes from the extent
+ * of the chain. Returns the new page.
+ */
+static BlockNumber
+bm_insert_new_page(Relation index, Buffer headbuf, BlockNumber lastBlk,
+				   BitmapTuple *tup)
+{
+	Buffer		buffer = headbuf;
+	Buffer		nbuffer;
+	Page		page;
+	BitmapPageOpaque headopaque;
+	BlockNumber blkno;
+	BlockNumber extentBlk;
+	uint16		extentLeft;
+	GenericXLogState *gxstate;
+	bool		inserted;
+
+	if (lastBlk != BufferGetBlockNumber(headbuf))
+	{
+		buffer = ReadBuffer(index, lastBlk);
+		LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+	}
 
-		GenericXLogAbort(gxstate);
-		/* keep last buffer active for linking new buffer page */
-		if (blkno != InvalidBlockNumber)
+	/* vacuum may have split the last page since it was probed */
+	while ((blkno = BitmapPageGetOpaque(BufferGetPage(buffer))->nextBlk) != InvalidBlockNumber)
+	{
+		if (buffer != headbuf)
 			UnlockReleaseBuffer(buffer);
+		buffer = ReadBuffer(index, blkno);
+		LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
 	}
 
-	nbuffer = bm_newbuffer_locked(index);
+	headopaque = BitmapPageGetOpaque(BufferGetPage(headbuf));
+	extentBlk = headopaque->extentBlk;
+	extentLeft = headopaque->extentLeft;
+	nbuffer = bm_extent_newbuffer(index, &extentBlk, &extentLeft);
 	blkno = BufferGetBlockNumber(nbuffer);
 
+	if (bm_xlog_enabled(index))
+		bm_xlog_new_page(headbuf, buffer, nbuffer, extentBlk, extentLeft, tup);
+	else
+	{
+		gxstate = GenericXLogStart(index);
+		headopaque = BitmapPageGetOpaque(GenericXLogRegisterBuffer(gxstate, headbuf, 0));
+		headopaque->extentBlk = extentBlk;
+		headopaque->extentLeft = extentLeft;
+		headopaque->tailBlk = blkno;
+
+		page = GenericXLogRegisterBuffer(gxstate, nbuffer, GENERIC_XLOG_FULL_IMAGE);
+		bm_init_page(page, BITMAP_PAGE_INDEX);
+
+		if (!bm_page_add_tup(page, tup, &inserted))
+			elog(ERROR, "insert bitmap tuple failed on new page");
+
+		page = GenericXLogRegisterBuffer(gxstate, buffer, 0);
+		BitmapPageGetOpaque(page)->nextBlk = blkno;
+
+		GenericXLogFinish(gxstate);
+	}
+	UnlockReleaseBuffer(nbuffer);
+	if (buffer != headbuf)
+		UnlockReleaseBuffer(buffer);
+
+	return blkno;
+}
+
+/*
+ * Add a bitmap tuple to a chain. The first page of the chain stays locked
+ * throughout, which orders inserts into the chain and protects its skip
+ * directory and last page. Heap blocks mostly come in order, so the last
+ * page is tried first and a full one gets a new page after it. Tuples for
+ * earlier heap blocks enter chains with a skip directory at the page of
+ * their heap block and walk others from their first page, a page is added
+ * at the end when none has room. Long walks build a skip directory.
+ */
+static void
+bm_insert_tuple(Relation index, BlockNumber startBlk, BitmapTuple *tup)
+{
+	Buffer		headbuf;
+	Page		headpage;
+	BlockNumber blkno;
+	BlockNumber lastBlk = InvalidBlockNumber;
+	BlockNumber skipBlk = InvalidBlockNumber;
+	int			npages = 0;
+	bool		done = false;
+	bool		ordered = false;
+
+	headbuf = ReadBuffer(index, startBlk);
+	LockBuffer(headbuf, BUFFER_LOCK_EXCLUSIVE);
+	headpage = BufferGetPage(headbuf);
+
+	/* a vacuumed first page goes away with its directory and last page */
+	if (!BitmapPageDeleted(headpage))
+	{
+		skipBlk = BitmapPageGetOpaque(headpage)->skipBlk;
+		blkno = BitmapPageGetOpaque(headpage)->tailBlk;
+		if (blkno == InvalidBlockNumber)
+			blkno = startBlk;
+
+		/* the recorded last page is followed in case vacuum split it */
+		while (!done && blkno != InvalidBlockNumber)
+		{
+			lastBlk = blkno;
+			done = bm_insert_on_page(index, headbuf, blkno, tup, true,
+									 &blkno, &ordered);
+		}
+
+		if (!done && ordered)
+		{
+			blkno = bm_insert_new_page(index, headbuf, lastBlk, tup);
+			done = true;
+		}
+		else
+			blkno = lastBlk;
+	}
+
+	if (!done)
+	{
+		blkno = startBlk;
+		if (skipBlk != InvalidBlockNumber)
+			blkno = bm_skip_find(index, skipBlk, tup->heapblk);
+
+		while (!done && blkno != InvalidBlockNumber)
+		{
+			lastBlk = blkno;
+			npages++;
+			done = bm_insert_on_page(index, headbuf, blkno, tup, false,
+									 &blkno, &ordered);
+		}
+
+		if (done)
+			blkno = lastBlk;
+		else
+		{
+			blkno = bm_insert_new_page(index, headbuf, lastBlk, tup);
+			npages++;
+		}
+	}
+
+	if (skipBlk != InvalidBlockNumber)
+		bm_skip_cover(index, skipBlk, blkno, tup->heapblk);
+
+	/* long chains walked from their first page get a skip directory */
+	if (skipBlk == InvalidBlockNumber && npages >= BITMAP_SKIP_MIN_PAGES &&
+		!BitmapPageDeleted(headpage))
+		bm_skip_build(index, headbuf, InvalidBlockNumber);
+
+	UnlockReleaseBuffer(headbuf);
+}
+
+/*
+ * Get the first page of a new chain, registered and initialized in a WAL
+ * record. It keeps the rest of the extent it comes from.
+ */
+static Buffer
+bm_new_chain(Relation index, GenericXLogState *gxstate, Page *page)
+{
+	BlockNumber extentBlk = InvalidBlockNumber;
+	uint16		extentLeft = 0;
+	Buffer		buffer;
+
+	buffer = bm_extent_newbuffer(index, &extentBlk, &extentLeft);
+	*page = GenericXLogRegisterBuffer(gxstate, buffer, GENERIC_XLOG_FULL_IMAGE);
+	bm_init_page(*page, BITMAP_PAGE_INDEX);
+	BitmapPageGetOpaque(*page)->extentBlk = extentBlk;
+	BitmapPageGetOpaque(*page)->extentLeft = extentLeft;
+
+	return buffer;
+}
+
+/*
+ * Start the bitmap chain of a value with the given tuple and publish its
+ * first page in the directory, or its stripe page on striped indexes. The
+ * meta page is locked before checking the directory entry, so concurrent
+ * inserts of a new value don't create two chains. Sets startBlk to the
+ * chain head if the value got a chain in the meantime, to InvalidBlockNumber
+ * once the tuple is in the new chain. Returns false if vacuum reclaimed the
+ * ordinal, which blocks on the meta page lock as well.
+ */
+static bool
+bm_start_chain(Relation index, int valindex, uint16 version, BitmapTuple *tup,
+			   BlockNumber *startBlk)
+{
+	Buffer		metabuf,
+				dirbuf,
+				nbuffer,
+				sbuffer = InvalidBuffer;
+	Page		page,
+				dirpage;
+	BitmapMetaPageData *meta;
+	BitmapDirEntry *entry;
+	GenericXLogState *gxstate;
+	BlockNumber headBlk;
+	int			dirno = valindex / BITMAP_DIR_ENTRIES;
+	bool		inserted;
+
+	metabuf = ReadBuffer(index, BITMAP_METAPAGE_BLKNO);
+	LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
+	meta = BitmapPageGetMeta(BufferGetPage(metabuf));
+
+	/*
+	 * Ordinals whose chain was never started, by aborted inserts, leave
+	 * directory pages missing before this one.
+	 */
+	while (meta->ndirpages <= dirno)
+	{
+		gxstate = GenericXLogStart(index);
+		meta = BitmapPageGetMeta(GenericXLogRegisterBuffer(gxstate, metabuf, 0));
+
+		dirbuf = bm_newbuffer_locked(index);
+		bm_init_dir(GenericXLogRegisterBuffer(gxstate, dirbuf, GENERIC_XLOG_FULL_IMAGE));
+		meta->dirBlk[meta->ndirpages++] = BufferGetBlockNumber(dirbuf);
+
+		GenericXLogFinish(gxstate);
+		UnlockReleaseBuffer(dirbuf);
+		meta = BitmapPageGetMeta(BufferGetPage(metabuf));
+	}
+
+	dirbuf = ReadBuffer(index, meta->dirBlk[dirno]);
+	LockBuffer(dirbuf, BUFFER_LOCK_EXCLUSIVE);
+	entry = &BitmapPageGetDir(BufferGetPage(dirbuf))[valindex % BITMAP_DIR_ENTRIES];
+
+	if (entry->version != version || (entry->flags & BITMAP_DIR_FREE))
+	{
+		UnlockReleaseBuffer(dirbuf);
+		UnlockReleaseBuffer(metabuf);
+		return false;
+	}
+
+	if (entry->startBlk != InvalidBlockNumber)
+	{
+		*startBlk = entry->startBlk;
+		bm_shared_set_head(index, valindex, version, *startBlk);
+		UnlockReleaseBuffer(dirbuf);
+		UnlockReleaseBuffer(metabuf);
+		return true;
+	}
+
 	gxstate = GenericXLogStart(index);
-	page = GenericXLogRegisterBuffer(gxstate, nbuffer, GENERIC_XLOG_FULL_IMAGE);
-	bm_init_page(page, BITMAP_PAGE_INDEX);
+	meta = BitmapPageGetMeta(GenericXLogRegisterBuffer(gxstate, metabuf, 0));
+	dirpage = GenericXLogRegisterBuffer(gxstate, dirbuf, 0);
+
+	nbuffer = bm_new_chain(index, gxstate, &page);
 
 	if (!bm_page_add_tup(page, tup, &inserted))
 		elog(ERROR, "insert bitmap tuple failed on new page");
+	headBlk = BufferGetBlockNumber(nbuffer);
 
-	if (buffer != InvalidBuffer)
+	/* the new chain is the first of the stripe of the heap block */
+	if (bm_striped(index))
 	{
-		page = GenericXLogRegisterBuffer(gxstate, buffer, 0);
-		opaque = BitmapPageGetOpaque(page);
-		opaque->nextBlk = blkno;
+		sbuffer = bm_newbuffer_locked(index);
+		page = GenericXLogRegisterBuffer(gxstate, sbuffer, GENERIC_XLOG_FULL_IMAGE);
+		bm_init_stripes(page, bm_dict_get_cache(index)->nstripes);
+		BitmapPageGetStripes(page)[bm_stripe_no(index, tup->heapblk)] = headBlk;
+		headBlk = BufferGetBlockNumber(sbuffer);
 	}
 
+	BitmapPageGetDir(dirpage)[valindex % BITMAP_DIR_ENTRIES].startBlk = headBlk;
+	meta->ndistinct += 1;
+
 	GenericXLogFinish(gxstate);
+	bm_shared_set_head(index, valindex, version, headBlk);
+	*startBlk = InvalidBlockNumber;
 	UnlockReleaseBuffer(nbuffer);
-	if (buffer != InvalidBuffer)
-		UnlockReleaseBuffer(buffer);
+	if (sbuffer != InvalidBuffer)
+		UnlockReleaseBuffer(sbuffer);
+	UnlockReleaseBuffer(dirbuf);
+	UnlockReleaseBuffer(metabuf);
 
-	return startBlk == InvalidBlockNumber ? blkno : startBlk;
+	return true;
+}
+
+/*
+ * Start the chain of a slice with the given tuple, unless a concurrent
+ * insert did. Slice heads are kept on the meta page, locked exclusively
+ * before checking the head. Returns false if the slice has a chain, which
+ * is returned in startBlk.
+ */
+static bool
+bm_start_slice(Relation index, int slice, BitmapTuple *tup, BlockNumber *startBlk)
+{
+	Buffer		metabuf,
+				nbuffer;
+	Page		page;
+	BitmapMetaPageData *meta;
+	GenericXLogState *gxstate;
+	bool		inserted;
+
+	metabuf = ReadBuffer(index, BITMAP_METAPAGE_BLKNO);
+	LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
+	meta = BitmapPageGetMeta(BufferGetPage(metabuf));
+
+	if (meta->sliceBlk[slice] != InvalidBlockNumber)
+	{
+		*startBlk = meta->sliceBlk[slice];
+		UnlockReleaseBuffer(metabuf);
+		return false;
+	}
+
+	gxstate = GenericXLogStart(index);
+	meta = BitmapPageGetMeta(GenericXLogRegisterBuffer(gxstate, metabuf, 0));
+
+	nbuffer = bm_new_chain(index, gxstate, &page);
+
+	if (!bm_page_add_tup(page, tup, &inserted))
+		elog(ERROR, "insert bitmap tuple failed on new page");
+
+	meta->sliceBlk[slice] = BufferGetBlockNumber(nbuffer);
+
+	GenericXLogFinish(gxstate);
+	UnlockReleaseBuffer(nbuffer);
+	UnlockReleaseBuffer(metabuf);
+
+	return true;
+}
+
+/*
+ * Start the chain of a segment with the given tuple, unless a concurrent
+ * insert did. Directory pages up to that of the segment are added first,
+ * segments are not started in order. Returns false if the segment has a
+ * chain, which is returned in startBlk.
+ */
+static bool
+bm_start_segment(Relation index, int segno, BitmapTuple *tup, BlockNumber *startBlk)
+{
+	Buffer		metabuf,
+				dirbuf,
+				nbuffer;
+	Page		page;
+	BitmapMetaPageData *meta;
+	BitmapDirEntry *entry;
+	GenericXLogState *gxstate;
+	int			dirno = segno / BITMAP_DIR_ENTRIES;
+	bool		inserted;
+
+	metabuf = ReadBuffer(index, BITMAP_METAPAGE_BLKNO);
+	LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
+	meta = BitmapPageGetMeta(BufferGetPage(metabuf));
+
+	while (meta->ndirpages <= dirno)
+	{
+		gxstate = GenericXLogStart(index);
+		meta = BitmapPageGetMeta(GenericXLogRegisterBuffer(gxstate, metabuf, 0));
+
+		dirbuf = bm_newbuffer_locked(index);
+		bm_init_dir(GenericXLogRegisterBuffer(gxstate, dirbuf, GENERIC_XLOG_FULL_IMAGE));
+		meta->dirBlk[meta->ndirpages++] = BufferGetBlockNumber(dirbuf);
+
+		GenericXLogFinish(gxstate);
+		UnlockReleaseBuffer(dirbuf);
+		meta = BitmapPageGetMeta(BufferGetPage(metabuf));
+	}
+
+	dirbuf = ReadBuffer(index, meta->dirBlk[dirno]);
+	LockBuffer(dirbuf, BUFFER_LOCK_EXCLUSIVE);
+	entry = &BitmapPageGetDir(BufferGetPage(dirbuf))[segno % BITMAP_DIR_ENTRIES];
+
+	if (entry->startBlk != InvalidBlockNumber)
+	{
+		*startBlk = entry->startBlk;
+		bm_shared_set_head(index, segno, entry->version, *startBlk);
+		UnlockReleaseBuffer(dirbuf);
+		UnlockReleaseBuffer(metabuf);
+		return false;
+	}
+
+	gxstate = GenericXLogStart(index);
+	entry = &BitmapPageGetDir(GenericXLogRegisterBuffer(gxstate, dirbuf, 0))
+		[segno % BITMAP_DIR_ENTRIES];
+
+	nbuffer = bm_new_chain(index, gxstate, &page);
+
+	if (!bm_page_add_tup(page, tup, &inserted))
+		elog(ERROR, "insert bitmap tuple failed on new page");
+
+	entry->startBlk = BufferGetBlockNumber(nbuffer);
+
+	GenericXLogFinish(gxstate);
+	bm_shared_set_head(index, segno, entry->version, BufferGetBlockNumber(nbuffer));
+	UnlockReleaseBuffer(nbuffer);
+	UnlockReleaseBuffer(dirbuf);
+	UnlockReleaseBuffer(metabuf);
+
+	return true;
+}
+
+/* add a bitmap tuple to the chain of its segment, keyed with its ordinal */
+static void
+bm_insert_segment(Relation index, int valindex, BitmapTuple *tup)
+{
+	int			segno = bm_segment_no(index, tup->heapblk);
+	BitmapTuple *keyed = palloc(BITMAP_TUPLE_MAX_SIZE);
+	uint8		offsets[MAX_HEAP_TUPLE_PER_PAGE];
+	int			n = bm_tuple_offsets(tup, offsets);
+	BlockNumber startBlk;
+
+	bm_tuple_encode(tup->heapblk, valindex, offsets, n, keyed);
+
+	/* segments are never reclaimed, their version stays zero */
+	bm_get_start_blk(index, segno, 0, &startBlk);
+	if (startBlk != InvalidBlockNumber || !bm_start_segment(index, segno, keyed, &startBlk))
+		bm_insert_tuple(index, startBlk, keyed);
+	pfree(keyed);
+}
+
+/*
+ * Add a heap tuple to the stripe of its heap block. A stripe without a chain
+ * is started with the tuple unless a concurrent insert did, the stripe page
+ * is locked exclusively before checking its head again.
+ */
+static void
+bm_insert_stripe(Relation index, BlockNumber stripeBlk, BitmapTuple *tup)
+{
+	int			stripe = bm_stripe_no(index, tup->heapblk);
+	Buffer		sbuffer,
+				nbuffer;
+	Page		page;
+	BlockNumber *stripes;
+	BlockNumber startBlk;
+	GenericXLogState *gxstate;
+	bool		inserted;
+
+	sbuffer = ReadBuffer(index, stripeBlk);
+	LockBuffer(sbuffer, BUFFER_LOCK_SHARE);
+	startBlk = BitmapPageGetStripes(BufferGetPage(sbuffer))[stripe];
+
+	if (startBlk == InvalidBlockNumber)
+	{
+		LockBuffer(sbuffer, BUFFER_LOCK_UNLOCK);
+		LockBuffer(sbuffer, BUFFER_LOCK_EXCLUSIVE);
+		startBlk = BitmapPageGetStripes(BufferGetPage(sbuffer))[stripe];
+	}
+
+	if (startBlk != InvalidBlockNumber)
+	{
+		UnlockReleaseBuffer(sbuffer);
+		bm_insert_tuple(index, startBlk, tup);
+		return;
+	}
+
+	gxstate = GenericXLogStart(index);
+	stripes = BitmapPageGetStripes(GenericXLogRegisterBuffer(gxstate, sbuffer, 0));
+
+	nbuffer = bm_new_chain(index, gxstate, &page);
+	stripes[stripe] = BufferGetBlockNumber(nbuffer);
+
+	if (!bm_page_add_tup(page, tup, &inserted))
+		elog(ERROR, "insert bitmap tuple failed on new page");
+
+	GenericXLogFinish(gxstate);
+	UnlockReleaseBuffer(nbuffer);
+	UnlockReleaseBuffer(sbuffer);
+}
+
+/* add a heap tuple to the slices of the bits set in the code of its ordinal */
+static void
+bm_insert_sliced(Relation index, int valindex, BitmapTuple *tup)
+{
+	BlockNumber heads[BITMAP_SLICES];
+	uint32		code = BitmapSliceCode(valindex);
+
+	bm_get_slice_heads(index, heads);
+
+	for (int k = 0; code != 0; k++, code >>= 1)
+	{
+		if ((code & 1) &&
+			(heads[k] != InvalidBlockNumber || !bm_start_slice(index, k, tup, &heads[k])))
+			bm_insert_tuple(index, heads[k], tup);
+	}
+}
+
+/*
+ * Add a bitmap tuple to the chain of a value, or to its slices or segment.
+ * value page addresses contention of inserting same values. index value
+ * does not exists or exist but no index tuples due to deletion, start a new
+ * chain unless a concurrent insertion did. Returns false if vacuum reclaimed
+ * the ordinal since the caller got its version.
+ */
+bool
+bm_insert_value(Relation index, int valindex, uint16 version, BitmapTuple *tup)
+{
+	BlockNumber startBlk;
+
+	if (bm_sliced(index))
+	{
+		bm_insert_sliced(index, valindex, tup);
+		return true;
+	}
+
+	if (bm_segmented(index))
+	{
+		bm_insert_segment(index, valindex, tup);
+		return true;
+	}
+
+	if (!bm_get_start_blk(index, valindex, version, &startBlk) ||
+		(startBlk == InvalidBlockNumber &&
+		 !bm_start_chain(index, valindex, version, tup, &startBlk)))
+		return false;
+
+	if (startBlk == InvalidBlockNumber)
+		return true;
+
+	if (bm_striped(index))
+		bm_insert_stripe(index, startBlk, tup);
+	else
+		bm_insert_tuple(index, startBlk, tup);
+
+	return true;
+}
+
+/* insert states of the backend, scans of their index flush them */
+static BitmapState *bm_insert_states = NULL;
+
+/* unlink an insert state, once flushed at the end of the statement or freed */
+static void
+bm_insert_forget_state(void *arg)
+{
+	for (BitmapState **prev = &bm_insert_states; *prev != NULL; prev = &(*prev)->next)
+	{
+		if (*prev == (BitmapState *) arg)
+		{
+			*prev = ((BitmapState *) arg)->next;
+			break;
+		}
+	}
+}
+
+/*
+ * Add the buffered heap tuples to the chains of their values, one bitmap
+ * tuple per value. A value whose ordinal vacuum reclaimed since it was
+ * buffered is looked up again.
+ */
+static void
+bm_insert_flush(BitmapState *state)
+{
+	Relation	index = state->index;
+	MemoryContext oldCxt;
+	BitmapTuple *tup;
+
+	if (state->nvalues == 0)
+		return;
+
+	oldCxt = MemoryContextSwitchTo(state->tmpCxt);
+	tup = palloc(BITMAP_TUPLE_MAX_SIZE);
+
+	for (int i = 0; i < state->nvalues; i++)
+	{
+		BitmapInsertValue *val = &state->values[i];
+		uint8		offsets[MAX_HEAP_TUPLE_PER_PAGE];
+		int			n = 0;
+
+		for (int j = 0; j < MAX_BITS_32; j++)
+		{
+			bits32		bits = val->bm[j];
+
+			while (bits)
+			{
+				offsets[n++] = j * 32 + pg_rightmost_one_pos32(bits);
+				bits &= bits - 1;
+			}
+		}
+
+		bm_tuple_encode(state->heapblk, BITMAP_NO_KEY, offsets, n, tup);
+		while (!bm_insert_value(index, val->valindex, val->version, tup))
+		{
+			/* ordinal was reclaimed by vacuum after it was cached */
+			bm_dict_forget(index, val->attno, val->value, val->isnull);
+			val->valindex = bm_dict_lookup(index, val->attno, val->value, val->isnull,
+										   true, &val->version);
+		}
+	}
+
+	MemoryContextSwitchTo(oldCxt);
+
+	state->nvalues = 0;
+	state->maxvalues = 0;
+	state->values = NULL;
+	state->heapblk = InvalidBlockNumber;
+	MemoryContextReset(state->bufCxt);
+}
+
+/* flush the heap tuples the statements of the backend buffered for an index */
+void
+bm_insert_flush_index(Relation index)
+{
+	for (BitmapState *state = bm_insert_states; state != NULL; state = state->next)
+	{
+		if (RelationGetRelid(state->index) == RelationGetRelid(index))
+		{
+			bm_insert_flush(state);
+			MemoryContextReset(state->tmpCxt);
+		}
+	}
+}
+
+/* buffer a heap tuple under its value in every column */
+static void
+bm_insert_buffer(BitmapState *state, Datum *values, bool *isnull, ItemPointer ht_ctid)
+{
+	Relation	index = state->index;
+	BlockNumber heapblk = ItemPointerGetBlockNumber(ht_ctid);
+	int			offset = ItemPointerGetOffsetNumber(ht_ctid) - 1;
+
+	if (heapblk != state->heapblk)
+	{
+		bm_insert_flush(state);
+		state->heapblk = heapblk;
+	}
+
+	for (int attno = 1; attno <= IndexRelationGetNumberOfKeyAttributes(index); attno++)
+	{
+		Form_pg_attribute att = TupleDescAttr(RelationGetDescr(index), attno - 1);
+		bool		null = isnull[attno - 1];
+		Datum		value = null ? (Datum) 0 :
+			bm_bin_value(index, attno, values[attno - 1]);
+		BitmapInsertValue *val = NULL;
+		uint16		version;
+		int			valindex = bm_dict_lookup(index, attno, value, null, true, &version);
+
+		for (int i = state->nvalues - 1; i >= 0 && val == NULL; i--)
+		{
+			if (state->values[i].valindex == valindex && state->values[i].version == version)
+				val = &state->values[i];
+		}
+
+		if (val == NULL)
+		{
+			/* the array goes with the buffer, so work_mem bounds it too */
+			if (state->values == NULL)
+			{
+				state->maxvalues = 16;
+				state->values = MemoryContextAlloc(state->bufCxt,
+												   sizeof(BitmapInsertValue) * state->maxvalues);
+			}
+			else if (state->nvalues == state->maxvalues)
+			{
+				state->maxvalues *= 2;
+				state->values = repalloc(state->values,
+										 sizeof(BitmapInsertValue) * state->maxvalues);
+			}
+
+			val = &state->values[state->nvalues++];
+			memset(val, 0, sizeof(BitmapInsertValue));
+			val->attno = attno;
+			val->isnull = null;
+			val->value = null ? (Datum) 0 :
+				datumCopy(value, att->attbyval, att->attlen);
+			val->valindex = valindex;
+			val->version = version;
+		}
+
+		val->bm[offset / 32] |= 0x1 << (offset % 32);
+	}
+
+	if (MemoryContextMemAllocated(state->bufCxt, false) >= work_mem * 1024L)
+		bm_insert_flush(state);
 }
 
 bool
@@ -121,12 +823,6 @@ bminsert(Relation index, Datum *values, bool *isnull, ItemPointer ht_ctid,
 {
 	BitmapState *state = (BitmapState *) indexInfo->ii_AmCache;
 	MemoryContext oldCxt;
-	BitmapMetaPageData *metadata;
-	BlockNumber startBlk;
-	Buffer		buffer;
-	Page		page;
-	int			valindex = -1;
-	GenericXLogState *gxstate;
 
 	if (state == NULL)
 	{
@@ -134,43 +830,30 @@ bminsert(Relation index, Datum *values, bool *isnull, ItemPointer ht_ctid,
 		state = palloc0(sizeof(BitmapState));
 		state->tmpCxt = AllocSetContextCreate(CurrentMemoryContext, "bitmap insert context",
 											  ALLOCSET_DEFAULT_SIZES);
+		state->bufCxt = AllocSetContextCreate(CurrentMemoryContext, "bitmap insert buffer",
+											  ALLOCSET_DEFAULT_SIZES);
+		state->index = index;
+		state->heapblk = InvalidBlockNumber;
+		state->forget.func = bm_insert_forget_state;
+		state->forget.arg = state;
+		MemoryContextRegisterResetCallback(indexInfo->ii_Context, &state->forget);
+		state->next = bm_insert_states;
+		bm_insert_states = state;
 		indexInfo->ii_AmCache = (void *) state;
 		MemoryContextSwitchTo(oldCxt);
 	}
 
 	oldCxt = MemoryContextSwitchTo(state->tmpCxt);
 
-	/* value page addresses contention of inserting same values */
-	valindex = bm_insert_val(index, values, isnull);
-	metadata = bm_get_meta(index);
-	startBlk = metadata->startBlk[valindex];
-	state->startBlk = bm_insert_tuple(index, startBlk, ht_ctid);
-
-	/*
-	 * index value does not exists or exist but no index tuples due to
-	 * deletion we need to increase distinct value in either case
-	 */
-	if (startBlk == InvalidBlockNumber)
+	if (bm_fastupdate(index))
+		bm_pending_insert(index, values, isnull, ht_ctid);
+	else
 	{
-		gxstate = GenericXLogStart(index);
-		buffer = ReadBuffer(index, BITMAP_METAPAGE_BLKNO);
-		LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
-		page = GenericXLogRegisterBuffer(gxstate, buffer, 0);
-		metadata = BitmapPageGetMeta(page);
-
-		/* meta data already being updated by concurrent insertion */
-		if (metadata->startBlk[valindex] != InvalidBlockNumber)
-		{
-			GenericXLogAbort(gxstate);
-		}
-		else
-		{
-			metadata->ndistinct += 1;
-			metadata->startBlk[valindex] = state->startBlk;
-			GenericXLogFinish(gxstate);
-		}
-
-		UnlockReleaseBuffer(buffer);
+		bm_insert_buffer(state, values, isnull, ht_ctid);
+#if PG_VERSION_NUM < 170000
+		/* nothing would flush the buffer at the end of the statement */
+		bm_insert_flush(state);
+#endif
 	}
 
 	MemoryContextSwitchTo(oldCxt);
@@ -179,76 +862,62 @@ bminsert(Relation index, Datum *values, bool *isnull, ItemPointer ht_ctid,
 	return false;
 }
 
+#if PG_VERSION_NUM >= 170000
+/* flush the heap tuples the statement buffered */
+void
+bminsertcleanup(Relation index, IndexInfo *indexInfo)
+{
+	BitmapState *state = (BitmapState *) indexInfo->ii_AmCache;
+
+	if (state == NULL)
+		return;
+
+	bm_insert_flush(state);
+	MemoryContextReset(state->tmpCxt);
+	bm_insert_forget_state(state);
+}
+#endif
+
 static void
 bmBuildCallback(Relation index, ItemPointer tid, Datum *values,
 				bool *isnull, bool tupleIsAlive, void *state)
 {
 	BitmapBuildState *buildstate = (BitmapBuildState *) state;
 	MemoryContext oldCtx;
-	BitmapPageOpaque opaque;
-	BitmapTuple *btup;
-	BlockNumber blkno;
-	Page		bufpage;
-	Page		page,
-				prevpage;
-	Buffer		buffer,
-				pbuffer = InvalidBuffer;
-	GenericXLogState *gxstate;
 	int			valindex;
-	bool        inserted;
+	uint16		version;
 
 	oldCtx = MemoryContextSwitchTo(buildstate->tmpCtx);
 
-	valindex = bm_insert_val(index, values, isnull);
-	if (valindex == buildstate->ndistinct)
+	/* a heap tuple counts once however many columns are indexed */
+	for (int attno = 1; attno <= IndexRelationGetNumberOfKeyAttributes(index); attno++)
 	{
-		buildstate->ndistinct++;
-	}
+		Datum		value = isnull[attno - 1] ? (Datum) 0 :
+			bm_bin_value(index, attno, values[attno - 1]);
 
-	if (!buildstate->blocks[valindex])
-	{
-		buildstate->blocks[valindex] = (PGAlignedBlock *) palloc0(BLCKSZ);
-		bm_init_page((Page) buildstate->blocks[valindex], BITMAP_PAGE_INDEX);
-	}
-
-	btup = bitmap_form_tuple(tid);
-	bufpage = (Page) buildstate->blocks[valindex];
-
-	if (!bm_page_add_tup(bufpage, btup, &inserted))
-	{
-		gxstate = GenericXLogStart(index);
-		buffer = bm_newbuffer_locked(index);
-		blkno = BufferGetBlockNumber(buffer);
-		page = GenericXLogRegisterBuffer(gxstate, buffer, GENERIC_XLOG_FULL_IMAGE);
-
-		if (buildstate->startBlks[valindex] == InvalidBlockNumber)
-			buildstate->startBlks[valindex] = blkno;
+		valindex = bm_dict_lookup(index, attno, value, isnull[attno - 1],
+								  true, &version);
 
-		/* set next block number in previous block page */
-		if (buildstate->prevBlks[valindex] != InvalidBlockNumber)
+		/* slices and segments take the place of values as chains */
+		if (bm_sliced(index))
 		{
-			pbuffer = ReadBuffer(index, buildstate->prevBlks[valindex]);
-			LockBuffer(pbuffer, BUFFER_LOCK_EXCLUSIVE);
-			prevpage = GenericXLogRegisterBuffer(gxstate, pbuffer, 0);
-			opaque = BitmapPageGetOpaque(prevpage);
-			opaque->nextBlk = blkno;
-		}
-		buildstate->prevBlks[valindex] = blkno;
+			uint32		code = BitmapSliceCode(valindex);
 
-		memcpy(page, bufpage, BLCKSZ);
-		GenericXLogFinish(gxstate);
-		UnlockReleaseBuffer(buffer);
-		if (pbuffer != InvalidBuffer)
-			UnlockReleaseBuffer(pbuffer);
-
-		bm_init_page(bufpage, BITMAP_PAGE_INDEX);
-		if (!bm_page_add_tup(bufpage, btup, &inserted))
-			elog(ERROR, "could not add new tuple to empty page");
+			for (int k = 0; code != 0; k++, code >>= 1)
+			{
+				if (code & 1)
+					bm_sort_add(buildstate, k, BITMAP_NO_KEY, tid);
+			}
+		}
+		else if (bm_segmented(index))
+			bm_sort_add(buildstate,
+						bm_segment_no(index, ItemPointerGetBlockNumber(tid)),
+						valindex, tid);
+		else
+			bm_sort_add(buildstate, valindex, BITMAP_NO_KEY, tid);
 	}
 
-	if (inserted) {
-		buildstate->indtuples++;
-	}
+	buildstate->indtuples++;
 
 	MemoryContextSwitchTo(oldCtx);
 }
@@ -260,50 +929,39 @@ bmbuild(Relation heap, Relation index,
 	IndexBuildResult *result;
 	double		reltuples;
 	BitmapBuildState buildstate;
-	Buffer		buffer;
-	Page		metapage;
-	BitmapMetaPageData *metadata;
-	GenericXLogState *gxstate;
+	BlockNumber *startBlks;
 
 	if (RelationGetNumberOfBlocks(index) != 0)
 		elog(ERROR, "index \"%s\" already contains data",
 			 RelationGetRelationName(index));
 
-	gxstate = GenericXLogStart(index);
+	bm_dict_reset(index);
+	bm_shared_forget(index);
 
-	/* Initialize the meta page */
+	/* Initialize the meta page, value page and directory page */
 	bm_init_metapage(index, MAIN_FORKNUM);
-	buffer = ReadBuffer(index, BITMAP_METAPAGE_BLKNO);
-	LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
-	metapage = GenericXLogRegisterBuffer(gxstate, buffer, 0);
-	metadata = BitmapPageGetMeta(metapage);
-
-	/* Init value page */
 	bm_init_valuepage(index, MAIN_FORKNUM);
+	bm_init_dirpage(index, MAIN_FORKNUM);
 
 	/* Initialize the build state */
 	memset(&buildstate, 0, sizeof(buildstate));
 	buildstate.tmpCtx = AllocSetContextCreate(CurrentMemoryContext,
 											  "Bitmap build temporary context",
 											  ALLOCSET_DEFAULT_SIZES);
-	buildstate.blocks = palloc0(sizeof(PGAlignedBlock *) * MAX_DISTINCT);
-	buildstate.startBlks = palloc0(sizeof(BlockNumber) * MAX_DISTINCT);
-	buildstate.prevBlks = palloc0(sizeof(BlockNumber) * MAX_DISTINCT);
-	memset(buildstate.startBlks, 0xFF, sizeof(BlockNumber) * MAX_DISTINCT);
-	memset(buildstate.prevBlks, 0xFF, sizeof(BlockNumber) * MAX_DISTINCT);
+	bm_sort_begin(&buildstate);
 
 	/* Do the heap scan */
 	reltuples = table_index_build_scan(heap, index, indexInfo, true, true,
 									   bmBuildCallback, (void *) &buildstate,
 									   NULL);
 
-	bm_flush_cached(index, &buildstate);
-
-	metadata->ndistinct = buildstate.ndistinct;
-	memcpy(metadata->startBlk, buildstate.startBlks, sizeof(BlockNumber) * buildstate.ndistinct);
-
-	GenericXLogFinish(gxstate);
-	UnlockReleaseBuffer(buffer);
+	startBlks = bm_sort_build(index, &buildstate);
+	if (bm_striped(index))
+		bm_build_stripes(index, startBlks, buildstate.ndistinct);
+	if (bm_sliced(index))
+		bm_build_slices(index, startBlks, buildstate.ndistinct);
+	else
+		bm_build_dir(index, startBlks, buildstate.ndistinct);
 
 	result = (IndexBuildResult *) palloc(sizeof(IndexBuildResult));
 	result->heap_tuples = reltuples;
@@ -317,8 +975,10 @@ bmbuild(Relation heap, Relation index,
 void
 bmbuildempty(Relation index)
 {
+	bm_shared_forget(index);
 	bm_init_metapage(index, INIT_FORKNUM);
 	bm_init_valuepage(index, INIT_FORKNUM);
+	bm_init_dirpage(index, INIT_FORKNUM);
 }
 
 
@@ -330,14 +990,14 @@ bmhandler(PG_FUNCTION_ARGS)
 	IndexAmRoutine *amroutine = makeNode(IndexAmRoutine);
 
 	amroutine->amstrategies = BITMAP_NSTRATEGIES;
-	amroutine->amsupport = 1;
+	amroutine->amsupport = BITMAP_NPROC;
 	amroutine->amoptsprocnum = 0;
 	amroutine->amcanorder = false;
 	amroutine->amcanorderbyop = false;
 	amroutine->amcanbackward = false;
 	amroutine->amcanunique = false;
 	amroutine->amcanmulticol = true;
-	amroutine->amoptionalkey = false;
+	amroutine->amoptionalkey = true;
 	amroutine->amsearcharray = false;
 	amroutine->amsearchnulls = true;
 	amroutine->amstorage = false;
@@ -345,7 +1005,7 @@ bmhandler(PG_FUNCTION_ARGS)
 	amroutine->ampredlocks = false;
 	amroutine->amcanparallel = false;
 	amroutine->amcaninclude = false;
-	amroutine->amusemaintenanceworkmem = false;
+	amroutine->amusemaintenanceworkmem = true;
 	amroutine->amparallelvacuumoptions =
 		VACUUM_OPTION_PARALLEL_BULKDEL | VACUUM_OPTION_PARALLEL_CLEANUP;
 	amroutine->amkeytype = InvalidOid;
@@ -353,6 +1013,9 @@ bmhandler(PG_FUNCTION_ARGS)
 	amroutine->ambuild = bmbuild;
 	amroutine->ambuildempty = bmbuildempty;
 	amroutine->aminsert = bminsert;
+#if PG_VERSION_NUM >= 170000
+	amroutine->aminsertcleanup = bminsertcleanup;
+#endif
 	amroutine->ambulkdelete = bmbulkdelete;
 	amroutine->amvacuumcleanup = bmvacuumcleanup;
 	amroutine->amcanreturn = NULL;
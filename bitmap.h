@@ -5,6 +5,7 @@
 #include <time.h>
 #include <common/relpath.h>
 #include <access/amapi.h>
+#include <access/reloptions.h>
 #include <access/itup.h>
 #include <nodes/pathnodes.h>
 #include <nodes/execnodes.h>
@@ -12,38 +13,214 @@
 
 #define BITMAP_MAGIC_NUMBER  0xDABC9876
 
-#define BITMAP_NSTRATEGIES 1
+// page format, indexes built in another one must be rebuilt
+#define BITMAP_FORMAT_VERSION 2
+
+#define BITMAP_EQUAL_STRATEGY 1
+#define BITMAP_LESS_STRATEGY 2
+#define BITMAP_LESS_EQUAL_STRATEGY 3
+#define BITMAP_GREATER_EQUAL_STRATEGY 4
+#define BITMAP_GREATER_STRATEGY 5
+#define BITMAP_NSTRATEGIES 5
 #define BITMAP_EQUAL_PROC 1
+#define BITMAP_HASH_PROC 2
+#define BITMAP_NPROC 2
 
 #define BITMAP_METAPAGE_BLKNO 0
 #define BITMAP_VALPAGE_START_BLKNO 1
+#define BITMAP_DIRPAGE_START_BLKNO 2
+
+// number of hash bucket pages addressable from the meta page
+#define BITMAP_MAX_BUCKETS 512
 
-#define MAX_DISTINCT ((BLCKSZ \
+// number of directory pages addressable from the meta page
+#define BITMAP_MAX_DIRPAGES ((BLCKSZ \
     -MAXALIGN(SizeOfPageHeaderData) \
     -MAXALIGN(sizeof(struct BitmapPageSpecData)) \
-    -MAXALIGN(offsetof(BitmapMetaPageData, startBlk)) \
+    -MAXALIGN(offsetof(BitmapMetaPageData, dirBlk)) \
   ) / sizeof(BlockNumber))
 
+// number of chain heads stored in a directory page
+#define BITMAP_DIR_ENTRIES ((BLCKSZ \
+    -MAXALIGN(SizeOfPageHeaderData) \
+    -MAXALIGN(sizeof(struct BitmapPageSpecData)) \
+  ) / sizeof(BitmapDirEntry))
+
+#define MAX_DISTINCT (BITMAP_MAX_DIRPAGES * BITMAP_DIR_ENTRIES)
+
+/*
+ * Sliced indexes keep no chain per value. A heap tuple goes to the chain of
+ * slice k when bit k of its ordinal plus one is set, so that every indexed
+ * heap tuple is in some slice and a value matches the heap tuples in the
+ * slices of its set bits and in none of the others.
+ */
+#define BITMAP_SLICES 32
+#define BitmapSliceCode(valindex) ((uint32) (valindex) + 1)
+
+/*
+ * Segmented indexes keep the bitmaps of all values for segBlocks heap blocks
+ * in one chain, addressed from the directory by heapblk / segBlocks. Their
+ * bitmap tuples carry the ordinal of their value.
+ */
+#define BITMAP_MAX_SEGMENT_BLOCKS 1024
+
+/*
+ * Striped indexes split the chain of a value in nstripes chains, a heap
+ * block going to stripe heapblk % nstripes, so that concurrent inserts of a
+ * value lock different pages. The directory entry of a value points to its
+ * stripe page, which holds the first page of each stripe.
+ */
+#define BITMAP_MAX_STRIPES 64
+
+/*
+ * Chains of indexes built with extent_pages get their pages in extents of
+ * that many consecutive blocks, reserved on the first page of the chain,
+ * so that walking a chain reads mostly sequentially.
+ */
+#define BITMAP_MAX_EXTENT_PAGES 64
+
+// value pages an append tries for space freed by vacuum before the last one
+#define BITMAP_VAL_REUSE_PAGES 8
+
+/*
+ * Indexes built with fastupdate append the heap tuples of inserts to a list
+ * of pending pages instead of the chains. Entries are merged into the chains
+ * in batches by vacuum, by bm_pending_flush() or by the insert that finds the
+ * list longer than pendingLimit kB, and scans read them before the chains.
+ */
+typedef struct BitmapPendingEntry
+{
+  int32 valindex; // ordinal of the value
+  uint16 version; // version of the ordinal when the entry was added
+  ItemPointerData tid; // heap tuple
+} BitmapPendingEntry;
+
+#define BITMAP_PENDING_ENTRIES ((BLCKSZ \
+    -MAXALIGN(SizeOfPageHeaderData) \
+    -MAXALIGN(sizeof(struct BitmapPageSpecData)) \
+  ) / sizeof(BitmapPendingEntry))
+
+#define BitmapPageGetPending(page) ((BitmapPendingEntry *) PageGetContents(page))
+
+// dead heap tuples a compact vacuum record may carry for a page
+#define BITMAP_XLOG_MAX_DEAD ((BLCKSZ / 2) / sizeof(ItemPointerData))
+
 typedef struct BitmapMetaPageData
 {
   uint32 magic;
-  uint32 ndistinct; // number of distinct values, automatically increase until max distinct
-  BlockNumber startBlk[FLEXIBLE_ARRAY_MEMBER]; // index page by distinct vals index
+  uint32 version; // BITMAP_FORMAT_VERSION the index was built in
+  uint32 ndistinct; // number of distinct values that have a bitmap chain
+  uint32 nvalues; // number of ordinals handed out, reclaimed ones included
+  BlockNumber valTailBlk; // last value page, values are appended to it
+  uint32 nbuckets; // number of hash buckets, zero without a hashed dictionary
+  uint32 keylen; // width of packed keys in value pages, zero for value tuples
+  uint32 ndirpages; // number of directory pages in use
+  uint32 nfree; // ordinals reclaimed by vacuum and not reused yet
+  uint32 freeDirno; // no directory page before it has a reclaimed ordinal
+  BlockNumber valFreeBlk; // value page vacuum freed space from, InvalidBlockNumber if none
+  double binWidth; // bin width of numeric columns, zero if not binned
+  uint32 binUnit; // truncation unit of timestamp columns, BITMAP_BIN_NONE if not binned
+  uint32 sliced; // heap tuples go to the slices of their ordinals
+  uint32 segBlocks; // heap blocks per segment, zero for a chain per value
+  uint32 nstripes; // chains per value, one unless striped
+  uint32 extentPages; // pages a chain reserves at once
+  uint32 fastupdate; // inserts go to the pending list
+  uint32 pendingLimit; // kB of pending pages an insert merges at
+  BlockNumber pendingHead; // first pending page, InvalidBlockNumber if none
+  BlockNumber pendingTail; // last pending page, entries are appended to it
+  uint32 npendingPages;
+  uint32 npending; // pending entries
+  BlockNumber sliceBlk[BITMAP_SLICES]; // first page of each slice
+  BlockNumber bucketBlk[BITMAP_MAX_BUCKETS]; // first page of each hash bucket
+  BlockNumber dirBlk[FLEXIBLE_ARRAY_MEMBER]; // directory page by value index / BITMAP_DIR_ENTRIES
 } BitmapMetaPageData;
 
 #define BitmapPageGetMeta(page) ((BitmapMetaPageData *) PageGetContents(page))
 
+// values have a bitmap chain of their own in the directory
+#define BitmapMetaValueChains(meta) (!(meta)->sliced && (meta)->segBlocks == 0)
+
+/*
+ * The version of an ordinal is bumped when vacuum reclaims it, so that
+ * backends holding it in their caches notice it now stands for another value.
+ */
+typedef struct BitmapDirEntry
+{
+  BlockNumber startBlk; // first bitmap page of the value
+  uint16 version; // times the ordinal was reclaimed
+  uint16 flags;
+} BitmapDirEntry;
+
+#define BITMAP_DIR_FREE 0x01 // ordinal reclaimed, free for a new value
+
+#define BitmapPageGetDir(page) ((BitmapDirEntry *) PageGetContents(page))
+
+/*
+ * Hashed dictionary entry, used when every key column's operator class has a
+ * hash support function. Buckets are chains of pages holding these entries.
+ */
+typedef struct BitmapHashEntry
+{
+  uint32 hash;
+  uint32 valindex; // ordinal of the value
+  ItemPointerData valtid; // value tuple in the value pages
+  uint16 version; // version of the ordinal when the value got it
+} BitmapHashEntry;
+
+#define BITMAP_BUCKET_ENTRIES ((BLCKSZ \
+    -MAXALIGN(SizeOfPageHeaderData) \
+    -MAXALIGN(sizeof(struct BitmapPageSpecData)) \
+  ) / sizeof(BitmapHashEntry))
+
+#define BitmapPageGetBucket(page) ((BitmapHashEntry *) PageGetContents(page))
+
+/*
+ * Every key column has a dictionary of its own, all of them sharing the
+ * ordinals, value pages, buckets and directory. A value tuple holds its value
+ * in its column with the other columns NULL and keeps the column number in
+ * t_tid.
+ */
+#define BitmapValTupleGetAttno(itup) ItemPointerGetOffsetNumberNoCheck(&(itup)->t_tid)
+#define BitmapValTupleSetAttno(itup, attno) ItemPointerSetOffsetNumber(&(itup)->t_tid, attno)
+
+/*
+ * Value pages of single column indexes on fixed width by-value types are
+ * dense arrays of keylen wide raw keys. The NULL value is not stored, its
+ * hash entry points at an invalid block.
+ */
+#define BITMAP_PACKED_KEYS(keylen) ((BLCKSZ \
+    -MAXALIGN(SizeOfPageHeaderData) \
+    -MAXALIGN(sizeof(struct BitmapPageSpecData)) \
+  ) / (keylen))
+
+#define BitmapPageGetKeys(page) ((char *) PageGetContents(page))
+
+// keys compared at once by the packed probe kernels
+#define BITMAP_PROBE_GROUP 8
+
+typedef int (*BitmapProbeFunc) (const char *keys, int nkeys, uint64 key);
+
 #define BITMAP_PAGE_META 0x01
 #define BITMAP_PAGE_VALUE 0x02
 #define BITMAP_PAGE_INDEX 0x03
+#define BITMAP_PAGE_DIR 0x04
+#define BITMAP_PAGE_BUCKET 0x05
+#define BITMAP_PAGE_SKIP 0x06
+#define BITMAP_PAGE_STRIPE 0x07
+#define BITMAP_PAGE_PENDING 0x08
 
 #define BITMAP_PAGE_DELETED 0x01
+#define BITMAP_PAGE_SEALED 0x02 // pending page being merged, no more entries
 
 typedef struct BitmapPageSpecData {
   uint16 maxoff;
-  BlockNumber nextBlk;
   uint16 pgtype;
   uint16 flags;
+  uint16 extentLeft; // pages of the extent left from extentBlk on, on the first bitmap page
+  BlockNumber nextBlk;
+  BlockNumber skipBlk; // first skip page of the chain, on the first bitmap page
+  BlockNumber tailBlk; // last page of the chain if known, on the first bitmap page
+  BlockNumber extentBlk; // next page reserved for the chain, on the first bitmap page
 } BitmapPageSpecData;
 
 typedef BitmapPageSpecData *BitmapPageOpaque;
@@ -51,50 +228,235 @@ typedef BitmapPageSpecData *BitmapPageOpaque;
 #define BitmapPageGetOpaque(page)                                           \
   ((BitmapPageOpaque)PageGetSpecialPointer(page))
 
+/*
+ * Chains of BITMAP_SKIP_MIN_PAGES bitmap pages or more get a skip directory,
+ * which keeps the range of heap blocks of each bitmap page so that inserts
+ * go straight to the page of their heap block. Inserts and vacuum lock the
+ * first bitmap page of the chain before its skip pages.
+ */
+#define BITMAP_SKIP_MIN_PAGES 8
+
+typedef struct BitmapSkipEntry
+{
+  BlockNumber blkno; // bitmap page
+  BlockNumber minBlk; // heap blocks of its tuples, minBlk > maxBlk if none
+  BlockNumber maxBlk;
+} BitmapSkipEntry;
+
+#define BITMAP_SKIP_ENTRIES ((BLCKSZ \
+    -MAXALIGN(SizeOfPageHeaderData) \
+    -MAXALIGN(sizeof(struct BitmapPageSpecData)) \
+  ) / sizeof(BitmapSkipEntry))
+
+#define BitmapPageGetSkip(page) ((BitmapSkipEntry *) PageGetContents(page))
+
+#define BitmapPageGetStripes(page) ((BlockNumber *) PageGetContents(page))
+
 #define BitmapPageSetDeleted(page) (BitmapPageGetOpaque(page)->flags |= BITMAP_PAGE_DELETED)
 #define BitmapPageDeleted(page) (BitmapPageGetOpaque(page)->flags & BITMAP_PAGE_DELETED)
 
-typedef struct BitmapOptions {} BitmapOptions;
+/*
+ * Binned indexes store the bin of each value instead of the value, numeric
+ * columns in bins of binWidth and timestamp columns truncated to binUnit.
+ * Options are copied into the meta page when the index is built.
+ */
+#define BITMAP_BIN_NONE 0
+#define BITMAP_BIN_SECOND 1
+#define BITMAP_BIN_MINUTE 2
+#define BITMAP_BIN_HOUR 3
+#define BITMAP_BIN_DAY 4
+#define BITMAP_BIN_WEEK 5
+#define BITMAP_BIN_MONTH 6
+#define BITMAP_BIN_YEAR 7
+
+typedef struct BitmapOptions
+{
+  int32 vl_len_; // varlena header (do not touch directly!)
+  double binWidth;
+  int binUnit;
+  bool sliced;
+  int segmentBlocks;
+  int stripes;
+  int extentPages;
+  bool fastupdate;
+  int pendingListLimit;
+} BitmapOptions;
 
 //  at most 226 tule can be stored in 8K page
 #define MAX_HEAP_TUPLE_PER_PAGE 226
 
 #define MAX_BITS_32 (MAX_HEAP_TUPLE_PER_PAGE/32 + 1)
 
+/*
+ * Bitmap tuples hold the heap tuples of a heap block in the smallest of
+ * four containers: a sorted array of offsets, a bitset, a full marker for
+ * offsets 1 to count, or an inverse array of the offsets missing up to the
+ * last one, preceded by their number. Offsets are stored zero based. A
+ * tuple also stands for the run heap blocks following heapblk when they
+ * hold the same offsets. Tuples vary in size and are packed one after the
+ * other in bitmap pages.
+ */
+#define BITMAP_CONTAINER_ARRAY 0
+#define BITMAP_CONTAINER_BITS 1
+#define BITMAP_CONTAINER_FULL 2
+#define BITMAP_CONTAINER_INVERSE 3
+
+// the tuple starts its data with the ordinal of its value
+#define BITMAP_TUPLE_KEYED 0x80
+#define BITMAP_NO_KEY (-1)
+
+#define BITMAP_BITS_BYTES ((MAX_HEAP_TUPLE_PER_PAGE + 7) / 8)
+
 typedef struct BitmapTuple {
   BlockNumber heapblk;
-  bits32 bm[MAX_BITS_32];
+  uint8 type; // BITMAP_CONTAINER_*
+  uint8 count; // heap tuples in the tuple
+  uint16 run; // following heap blocks with the same offsets
+  uint8 data[FLEXIBLE_ARRAY_MEMBER]; // offsets, missing offsets or bitset
 } BitmapTuple;
 
-#define BitmapPageGetTuple(page, offset) \
-((BitmapTuple *)(PageGetContents(page) + sizeof(struct BitmapTuple) * (offset - 1)))
+#define BitmapTupleType(tup) ((tup)->type & ~BITMAP_TUPLE_KEYED)
+#define BitmapTupleKeyed(tup) (((tup)->type & BITMAP_TUPLE_KEYED) != 0)
+#define BitmapTuplePayload(tup) ((tup)->data + (BitmapTupleKeyed(tup) ? sizeof(int32) : 0))
+#define BitmapTupleKey(tup) \
+  (BitmapTupleKeyed(tup) ? *(int32 *) (tup)->data : BITMAP_NO_KEY)
+
+#define BitmapTupleSize(tup) \
+  INTALIGN(offsetof(BitmapTuple, data) + \
+           (BitmapTupleKeyed(tup) ? sizeof(int32) : 0) + \
+           (BitmapTupleType(tup) == BITMAP_CONTAINER_ARRAY ? (tup)->count : \
+            BitmapTupleType(tup) == BITMAP_CONTAINER_BITS ? BITMAP_BITS_BYTES : \
+            BitmapTupleType(tup) == BITMAP_CONTAINER_INVERSE ? \
+            1 + BitmapTuplePayload(tup)[0] : 0))
+
+#define BITMAP_TUPLE_MAX_SIZE \
+  INTALIGN(offsetof(BitmapTuple, data) + sizeof(int32) + BITMAP_BITS_BYTES)
+
+#define BitmapPageFirstTuple(page) ((BitmapTuple *) PageGetContents(page))
+// starts of the tuples of a bitmap page in their order, below the special space
+#define BitmapPageGetSlots(page) \
+  ((uint16 *) ((char *) (page) + ((PageHeader) (page))->pd_upper))
+#define BitmapTupleNext(tup) ((BitmapTuple *) ((char *) (tup) + BitmapTupleSize(tup)))
+#define BitmapTupleLastBlock(tup) ((tup)->heapblk + (tup)->run)
+#define BITMAP_MAX_RUN PG_UINT16_MAX
+
+/*
+ * Backend-local dictionary cache hung off rd_amcache. Without a hashed
+ * dictionary it holds every value in value page order, otherwise only the
+ * values this backend looked up. Packed indexes keep raw keys in groups of
+ * BITMAP_PROBE_GROUP probed by a kernel chosen for the key width instead of
+ * entries.
+ */
+typedef struct BitmapDictEntry
+{
+  uint32 hash;
+  int32 next; // next entry in the same bucket, -1 terminates
+  int32 valindex; // ordinal of the value
+  uint16 version; // version of the ordinal
+  IndexTuple itup; // copy of the value tuple
+} BitmapDictEntry;
+
+typedef struct BitmapDictCache
+{
+  MemoryContext cxt;
+  bool hashed; // index has a hashed dictionary
+  BlockNumber lastBlk; // last value page read into the cache
+  OffsetNumber lastOff; // last item read on lastBlk
+  int nentries;
+  int maxentries;
+  int32 *buckets;
+  BitmapDictEntry *entries;
+  int keylen; // width of packed keys, zero for entries
+  BitmapProbeFunc probe;
+  int ngroups; // open addressed groups, a power of two
+  int npacked;
+  char *keys; // ngroups * BITMAP_PROBE_GROUP keys
+  int32 *ords; // ordinal of each key
+  uint16 *vers; // version of each ordinal
+  uint8 *counts; // keys used in each group
+  int32 nullindex; // ordinal of the NULL value, -1 if not known
+  uint16 nullversion;
+  int ndirpages; // directory pages known, they never move once allocated
+  BlockNumber *dirBlk;
+  double binWidth; // binning of the index, from the meta page
+  int binUnit;
+  bool sliced; // index keeps bit-slice chains, from the meta page
+  int segBlocks; // heap blocks per segment of segmented indexes
+  int nstripes; // chains per value of striped indexes
+  int extentPages; // pages a chain reserves at once
+  bool fastupdate; // inserts go to the pending list
+} BitmapDictCache;
+
+/*
+ * Inserts of a statement buffer the heap tuples of the heap block being
+ * filled per value, so that the pages of a value are written once per heap
+ * block. The buffer is flushed when the heap block changes, when it holds
+ * work_mem, at the end of the statement and when the backend scans the
+ * index. Without aminsertcleanup, before PostgreSQL 17, every insert flushes.
+ */
+typedef struct BitmapInsertValue
+{
+  int attno;
+  bool isnull;
+  Datum value; // binned column value, copied into bufCxt
+  int32 valindex; // ordinal of the value
+  uint16 version; // version of the ordinal
+  bits32 bm[MAX_BITS_32]; // offsets of the heap tuples
+} BitmapInsertValue;
 
 typedef struct BitmapState
 {
-  uint32 ndistinct;
-  BlockNumber startBlk;
-  BlockNumber *blocks; 
   MemoryContext tmpCxt;
+  Relation index;
+  MemoryContext bufCxt; // buffered values and their copies
+  BlockNumber heapblk; // heap block of the buffered heap tuples
+  int nvalues;
+  int maxvalues;
+  BitmapInsertValue *values;
+  MemoryContextCallback forget; // unlinks the state when its context goes
+  struct BitmapState *next; // next insert state of the backend
 } BitmapState;
 
 typedef struct BitmapBuildState
 {
   int64 indtuples;
-  uint32 ndistinct;
-  BlockNumber *startBlks;
-  BlockNumber *prevBlks;
+  uint32 ndistinct; // chains of values, slices or segments built
   MemoryContext tmpCtx;
-  PGAlignedBlock **blocks;
+  struct Tuplesortstate *sortstate; // bits of the chains, sorted by chain and heap tuple
+  TupleTableSlot *sortslot;
 } BitmapBuildState;
 
+// keys resolved by earlier rescans of a scan
+#define BITMAP_SCAN_KEYS 8
+
+typedef struct BitmapScanKeyEntry
+{
+  AttrNumber attno;
+  bool isnull;
+  Datum value;
+  int32 valindex; // ordinal of the column value
+  uint16 version; // version of the ordinal
+} BitmapScanKeyEntry;
+
 typedef struct BitmapScanOpaqueData
 {
+  bool started; // scan keys are resolved
+  bool recheck; // keys match whole bins, heap tuples are rechecked
   int32 keyIndex;
   Page curPage;
   BlockNumber curBlk;
   OffsetNumber offset;
   OffsetNumber maxoffset;
+  BitmapTuple *curTup; // bitmap tuple at offset in curPage
   int32 htupidx;
+  uint16 runidx; // heap block of curTup being returned, from its heapblk
+  TIDBitmap *tbm; // intersection of the chains of several scan keys
+  TBMIterator *iterator;
+  TBMIterateResult *tbmres;
+  int tbmoff; // next offset of tbmres to return
+  MemoryContext scanCxt; // holds the cached key values and the bitmap
+  int nkeys;
+  BitmapScanKeyEntry keys[BITMAP_SCAN_KEYS]; // most recently used first, kept across rescans
 } BitmapScanOpaqueData;
 
 typedef BitmapScanOpaqueData *BitmapScanOpaque;
@@ -103,6 +465,10 @@ extern bytea *bmoptions(Datum reloptions, bool validate);
 extern bool bminsert(Relation index, Datum *values, bool *isnull, ItemPointer ht_ctid,
              Relation heapRel, IndexUniqueCheck checkUnique,
              bool indexUnchanged, IndexInfo *indexInfo);
+#if PG_VERSION_NUM >= 170000
+extern void bminsertcleanup(Relation index, IndexInfo *indexInfo);
+#endif
+extern void bm_insert_flush_index(Relation index);
 extern IndexBuildResult *bmbuild(Relation heap, Relation index,
                            IndexInfo *indexInfo);
 extern void bmbuildempty(Relation index);
@@ -127,19 +493,121 @@ extern IndexBulkDeleteResult *bmbulkdelete(IndexVacuumInfo *info,
                                     void *callback_state);
 extern IndexBulkDeleteResult *bmvacuumcleanup(IndexVacuumInfo *info, IndexBulkDeleteResult *stats);
 
+extern void bm_page_set_slots(Page page);
 extern bool bm_page_add_tup(Page page, BitmapTuple *tuple, bool *inserted);
-extern int bm_insert_val(Relation index, Datum *values, bool *isnull);
-extern int bm_get_val_index(Relation index, Datum *values, bool *isnull);
+extern bool bm_page_may_add(Page page, BitmapTuple *tuple);
+extern void bm_set_chain_end(Relation index, Buffer headbuf, BlockNumber tailBlk,
+                             BlockNumber extentBlk, uint16 extentLeft);
+extern int bm_append_val(Relation index, Buffer metabuf, int attno, Datum value, bool isnull,
+                         ItemPointer tid, uint16 *version);
 extern Buffer bm_newbuffer_locked(Relation index);
+extern Buffer bm_extent_newbuffer(Relation index, BlockNumber *extentBlk, uint16 *extentLeft);
 extern void bm_init_page(Page page, uint16 pgtype);
 extern void bm_init_metapage(Relation index, ForkNumber fork);
 extern void bm_init_valuepage(Relation index, ForkNumber fork);
-extern void bm_flush_cached(Relation index, BitmapBuildState *state);
+extern void bm_init_dirpage(Relation index, ForkNumber fork);
+extern void bm_init_dir(Page page);
+extern void bm_sort_begin(BitmapBuildState *state);
+extern void bm_sort_add(BitmapBuildState *state, int chain, int32 key, ItemPointer tid);
+extern BlockNumber *bm_sort_build(Relation index, BitmapBuildState *state);
+extern void bm_build_dir(Relation index, BlockNumber *startBlks, uint32 nvalues);
+extern void bm_build_slices(Relation index, BlockNumber *startBlks, int nslices);
+extern void bm_check_meta(Relation index, Page page);
 extern BitmapMetaPageData* bm_get_meta(Relation index);
+extern void bm_read_dir(Relation index, BlockNumber dirBlk, BlockNumber *blocks);
+extern bool bm_get_start_blk(Relation index, int valindex, uint16 version,
+                             BlockNumber *startBlk);
+extern void bm_get_slice_heads(Relation index, BlockNumber *heads);
+
+extern int bm_dict_lookup(Relation index, int attno, Datum value, bool isnull, bool insert,
+                          uint16 *version);
+extern void bm_dict_forget(Relation index, int attno, Datum value, bool isnull);
+extern void bm_dict_reset(Relation index);
+extern BlockNumber bm_dict_dir_blk(Relation index, int dirno);
+extern uint32 bm_dict_hash(Relation index, int attno, Datum value, bool isnull);
+extern BitmapDictCache *bm_dict_get_cache(Relation index);
+
+extern bool bm_hash_supported(Relation index);
+extern int bm_hash_search(Relation index, Buffer metabuf, uint32 hash,
+                          int attno, Datum value, bool isnull, IndexTuple *itup,
+                          uint16 *version);
+extern void bm_hash_add(Relation index, Buffer metabuf, uint32 hash, int valindex,
+                        ItemPointer valtid, uint16 version);
+extern void bm_hash_reclaim(Relation index, Buffer metabuf, bool *reclaim);
+
+
+extern void bm_shared_init(void);
+extern int bm_shared_get_val(Relation index, int attno, Datum value, bool isnull,
+                             uint16 *version);
+extern void bm_shared_set_val(Relation index, int attno, Datum value, bool isnull,
+                              int valindex, uint16 version);
+extern void bm_shared_forget_val(Relation index, int attno, Datum value, bool isnull);
+extern bool bm_shared_get_head(Relation index, int valindex, uint16 version,
+                               BlockNumber *startBlk);
+extern void bm_shared_set_head(Relation index, int valindex, uint16 version,
+                               BlockNumber startBlk);
+extern void bm_shared_forget(Relation index);
+
+extern int bm_packed_keylen(Relation index);
+extern uint64 bm_packed_key(Relation index, Datum value);
+extern Datum bm_packed_datum(int keylen, uint64 key);
+extern uint64 bm_packed_load(const char *src, int keylen);
+extern void bm_packed_store(char *dst, int keylen, uint64 key);
+extern BitmapProbeFunc bm_packed_probe_func(int keylen);
+
+extern relopt_enum_elt_def bm_bin_units[];
+extern bool bm_binned(Relation index, int attno);
+extern Datum bm_bin_value(Relation index, int attno, Datum value);
+
+extern bool bm_segmented(Relation index);
+extern int bm_segment_no(Relation index, BlockNumber heapblk);
+extern void bm_segments_to_tbm(Relation index, int *valindexes, int n, TIDBitmap *tbm,
+                               bool recheck);
+
+extern bool bm_striped(Relation index);
+extern int bm_stripe_no(Relation index, BlockNumber heapblk);
+extern void bm_init_stripes(Page page, int nstripes);
+extern int bm_stripe_heads(Relation index, BlockNumber stripeBlk, BlockNumber *heads);
+extern void bm_build_stripes(Relation index, BlockNumber *startBlks, uint32 nvalues);
+
+extern bool bm_insert_value(Relation index, int valindex, uint16 version, BitmapTuple *tup);
+
+extern bool bm_fastupdate(Relation index);
+extern void bm_pending_insert(Relation index, Datum *values, bool *isnull, ItemPointer tid);
+extern int64 bm_pending_merge(Relation index, bool wait);
+extern void bm_pending_to_tbm(Relation index, int *valindexes, int n, TIDBitmap *tbm,
+                              bool recheck);
+
+extern OffsetNumber bm_vacuum_tuples(Page page, IndexBulkDeleteCallback callback,
+                                     void *callback_state, char *contents, Size *used,
+                                     int *ntups, double *removed, BitmapTuple **left,
+                                     BlockNumber *heapblk);
+extern void bm_vacuum_apply(Page page, char *contents, Size used, int ntups);
+
+extern void bm_xlog_init(void);
+extern bool bm_xlog_enabled(Relation index);
+extern bool bm_xlog_add_tup(Buffer buffer, BitmapTuple *tup);
+extern void bm_xlog_new_page(Buffer headbuf, Buffer lastbuf, Buffer nbuffer,
+                             BlockNumber extentBlk, uint16 extentLeft, BitmapTuple *tup);
+extern void bm_xlog_vacuum(Buffer buffer, char *contents, Size used, int ntups,
+                           ItemPointer dead, int ndead);
+
+extern bool bm_sliced(Relation index);
+extern void bm_slices_to_tbm(Relation index, int valindex, TIDBitmap *tbm, bool recheck);
 
+extern BlockNumber bm_skip_find(Relation index, BlockNumber skipBlk, BlockNumber heapblk);
+extern void bm_skip_cover(Relation index, BlockNumber skipBlk, BlockNumber blkno,
+                          BlockNumber heapblk);
+extern void bm_skip_build(Relation index, Buffer headbuf, BlockNumber oldSkipBlk);
+extern void bm_skip_free(Relation index, BlockNumber skipBlk);
 
-extern BitmapTuple *bitmap_form_tuple(ItemPointer ctid);
-extern bool bm_vals_equal(Relation index, Datum *cmpVals, bool *cmpIsnull, IndexTuple itup);
+extern BitmapTuple *bitmap_form_tuple(ItemPointer ctid, int32 key);
+extern IndexTuple bm_form_val_tuple(Relation index, int attno, Datum value, bool isnull);
+extern bool bm_vals_equal(Relation index, int attno, Datum value, bool isnull, IndexTuple itup);
+extern int bm_tuple_offsets(BitmapTuple *tup, uint8 *offsets);
+extern Size bm_tuple_encode(BlockNumber heapblk, int32 key, uint8 *offsets, int n,
+                            BitmapTuple *tup);
+extern bool bm_tuple_same_offsets(BitmapTuple *a, BitmapTuple *b);
 extern int bm_tuple_to_tids(BitmapTuple *tup, ItemPointer tids);
 extern int bm_tuple_next_htpid(BitmapTuple *tup, ItemPointer tid, int start);
 #endif
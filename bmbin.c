@@ -0,0 +1,109 @@
+#include <postgres.h>
+
+#include <math.h>
+
+#include <catalog/pg_type.h>
+#include <common/int.h>
+#include <utils/builtins.h>
+#include <utils/rel.h>
+#include <utils/timestamp.h>
+
+#include "bitmap.h"
+
+/*
+ * Binned columns. A binned index keeps one dictionary value per bin, so a
+ * continuous column takes as many values as it has bins. Bins are ordered
+ * like their values, a key matches the bins of the values it may match and
+ * the heap tuples are rechecked.
+ */
+
+relopt_enum_elt_def bm_bin_units[] = {
+	{"none", BITMAP_BIN_NONE},
+	{"second", BITMAP_BIN_SECOND},
+	{"minute", BITMAP_BIN_MINUTE},
+	{"hour", BITMAP_BIN_HOUR},
+	{"day", BITMAP_BIN_DAY},
+	{"week", BITMAP_BIN_WEEK},
+	{"month", BITMAP_BIN_MONTH},
+	{"year", BITMAP_BIN_YEAR},
+	{(const char *) NULL}
+};
+
+/* whether values of a column are binned */
+bool
+bm_binned(Relation index, int attno)
+{
+	BitmapDictCache *cache = bm_dict_get_cache(index);
+
+	switch (TupleDescAttr(RelationGetDescr(index), attno - 1)->atttypid)
+	{
+		case INT2OID:
+		case INT4OID:
+		case INT8OID:
+		case FLOAT4OID:
+		case FLOAT8OID:
+			return cache->binWidth > 0;
+		case TIMESTAMPOID:
+		case TIMESTAMPTZOID:
+			return cache->binUnit != BITMAP_BIN_NONE;
+		default:
+			return false;
+	}
+}
+
+/* first value of the bin of an integer, the type minimum if out of range */
+static int64
+bm_bin_int(int64 value, double width, int64 min)
+{
+	int64		w = Max((int64) width, 1);
+	int64		q = value / w;
+	int64		start;
+
+	if (value % w < 0)
+		q--;
+
+	if (pg_mul_s64_overflow(q, w, &start) || start < min)
+		return min;
+
+	return start;
+}
+
+/*
+ * Map a non-null column value to the first value of its bin. Integers use
+ * the integral part of the width, timestamptz values are truncated in UTC
+ * so that bins do not depend on the session time zone.
+ */
+Datum
+bm_bin_value(Relation index, int attno, Datum value)
+{
+	BitmapDictCache *cache = bm_dict_get_cache(index);
+
+	if (!bm_binned(index, attno))
+		return value;
+
+	switch (TupleDescAttr(RelationGetDescr(index), attno - 1)->atttypid)
+	{
+		case INT2OID:
+			return Int16GetDatum((int16) bm_bin_int(DatumGetInt16(value),
+													cache->binWidth, PG_INT16_MIN));
+		case INT4OID:
+			return Int32GetDatum((int32) bm_bin_int(DatumGetInt32(value),
+													cache->binWidth, PG_INT32_MIN));
+		case INT8OID:
+			return Int64GetDatum(bm_bin_int(DatumGetInt64(value),
+											cache->binWidth, PG_INT64_MIN));
+		case FLOAT4OID:
+			return Float4GetDatum((float4) (floor(DatumGetFloat4(value) / cache->binWidth) *
+											cache->binWidth));
+		case FLOAT8OID:
+			return Float8GetDatum(floor(DatumGetFloat8(value) / cache->binWidth) *
+								  cache->binWidth);
+		default:
+			if (TIMESTAMP_NOT_FINITE(DatumGetTimestamp(value)))
+				return value;
+
+			return DirectFunctionCall2(timestamp_trunc,
+									   CStringGetTextDatum(bm_bin_units[cache->binUnit].string_val),
+									   value);
+	}
+}
@@ -0,0 +1,551 @@
+#include <postgres.h>
+
+#include <access/genam.h>
+#include <common/hashfn.h>
+#include <storage/bufmgr.h>
+#include <utils/datum.h>
+#include <utils/memutils.h>
+#include <utils/rel.h>
+
+#include "bitmap.h"
+
+#define BM_DICT_INIT_ENTRIES 64
+#define BM_DICT_INIT_GROUPS 16
+#define BM_DICT_CXT_NAME "bitmap dictionary cache"
+
+/*
+ * Hash a column value consistently with bm_vals_equal: columns with a hash
+ * support function use it, others hash the datum image. The column number
+ * is mixed in as the dictionaries of all columns share the buckets.
+ */
+uint32
+bm_dict_hash(Relation index, int attno, Datum value, bool isnull)
+{
+	Form_pg_attribute att = TupleDescAttr(RelationGetDescr(index), attno - 1);
+	uint32		h;
+
+	if (isnull)
+		h = 0x9e3779b9;
+	else if (OidIsValid(index_getprocid(index, attno, BITMAP_HASH_PROC)))
+		h = DatumGetUInt32(FunctionCall1Coll(index_getprocinfo(index, attno, BITMAP_HASH_PROC),
+											 index->rd_indcollation[attno - 1],
+											 value));
+	else
+		h = datum_image_hash(value, att->attbyval, att->attlen);
+
+	return hash_combine(attno - 1, h);
+}
+
+static inline uint32
+bm_dict_key_hash(uint64 key)
+{
+	return hash_bytes_uint32((uint32) key ^ (uint32) (key >> 32));
+}
+
+static void
+bm_dict_alloc_groups(BitmapDictCache *cache, int ngroups)
+{
+	cache->ngroups = ngroups;
+	cache->npacked = 0;
+	cache->keys = MemoryContextAlloc(cache->cxt,
+									 (Size) ngroups * BITMAP_PROBE_GROUP * cache->keylen);
+	cache->ords = MemoryContextAlloc(cache->cxt,
+									 sizeof(int32) * ngroups * BITMAP_PROBE_GROUP);
+	cache->vers = MemoryContextAlloc(cache->cxt,
+									 sizeof(uint16) * ngroups * BITMAP_PROBE_GROUP);
+	cache->counts = MemoryContextAllocZero(cache->cxt, sizeof(uint8) * ngroups);
+}
+
+/*
+ * Packed keys are open addressed by group, a key goes into the first group
+ * with room from its home group on. Groups are kept at most half full, so a
+ * probe ends at a group that is not full.
+ */
+static void
+bm_dict_add_packed(BitmapDictCache *cache, uint64 key, int valindex, uint16 version)
+{
+	uint32		g;
+	int			i;
+
+	if ((cache->npacked + 1) * 2 > cache->ngroups * BITMAP_PROBE_GROUP)
+	{
+		char	   *keys = cache->keys;
+		int32	   *ords = cache->ords;
+		uint16	   *vers = cache->vers;
+		uint8	   *counts = cache->counts;
+		int			ngroups = cache->ngroups;
+
+		bm_dict_alloc_groups(cache, ngroups * 2);
+		for (g = 0; g < ngroups; g++)
+		{
+			for (i = g * BITMAP_PROBE_GROUP; i < g * BITMAP_PROBE_GROUP + counts[g]; i++)
+				bm_dict_add_packed(cache, bm_packed_load(keys + i * cache->keylen, cache->keylen),
+								   ords[i], vers[i]);
+		}
+
+		pfree(keys);
+		pfree(ords);
+		pfree(vers);
+		pfree(counts);
+	}
+
+	g = bm_dict_key_hash(key) & (cache->ngroups - 1);
+	while (cache->counts[g] == BITMAP_PROBE_GROUP)
+		g = (g + 1) & (cache->ngroups - 1);
+
+	i = g * BITMAP_PROBE_GROUP + cache->counts[g]++;
+	bm_packed_store(cache->keys + i * cache->keylen, cache->keylen, key);
+	cache->ords[i] = valindex;
+	cache->vers[i] = version;
+	cache->npacked++;
+}
+
+static int
+bm_dict_probe_packed(Relation index, BitmapDictCache *cache, Datum value,
+					 bool isnull, uint16 *version)
+{
+	uint64		key;
+	uint32		g;
+	int			i;
+
+	if (isnull)
+	{
+		*version = cache->nullversion;
+		return cache->nullindex;
+	}
+
+	key = bm_packed_key(index, value);
+	g = bm_dict_key_hash(key) & (cache->ngroups - 1);
+
+	for (;;)
+	{
+		i = cache->probe(cache->keys + g * BITMAP_PROBE_GROUP * cache->keylen,
+						 cache->counts[g], key);
+		if (i >= 0)
+		{
+			*version = cache->vers[g * BITMAP_PROBE_GROUP + i];
+			return cache->ords[g * BITMAP_PROBE_GROUP + i];
+		}
+
+		if (cache->counts[g] < BITMAP_PROBE_GROUP)
+			return -1;
+
+		g = (g + 1) & (cache->ngroups - 1);
+	}
+}
+
+BitmapDictCache *
+bm_dict_get_cache(Relation index)
+{
+	BitmapDictCache *cache = (BitmapDictCache *) index->rd_amcache;
+	BitmapMetaPageData *meta;
+	MemoryContext cxt;
+
+	if (cache != NULL)
+		return cache;
+
+	/* checks the page format before anything else reads the index */
+	meta = bm_get_meta(index);
+
+	/*
+	 * Everything lives in a child of rd_indexcxt so that the cache goes away
+	 * with the relcache entry. A relcache reload of an open index only frees
+	 * rd_amcache, the context of the cache it dropped is deleted here.
+	 */
+	for (MemoryContext child = index->rd_indexcxt->firstchild, next; child != NULL; child = next)
+	{
+		next = child->nextchild;
+		if (strcmp(child->name, BM_DICT_CXT_NAME) == 0)
+			MemoryContextDelete(child);
+	}
+	cxt = AllocSetContextCreate(index->rd_indexcxt, BM_DICT_CXT_NAME,
+								ALLOCSET_SMALL_SIZES);
+
+	cache = MemoryContextAllocZero(cxt, sizeof(BitmapDictCache));
+	cache->cxt = cxt;
+	cache->hashed = meta->nbuckets > 0;
+	cache->lastBlk = BITMAP_VALPAGE_START_BLKNO;
+	cache->lastOff = InvalidOffsetNumber;
+	cache->nentries = 0;
+	cache->maxentries = BM_DICT_INIT_ENTRIES;
+	cache->entries = MemoryContextAlloc(cxt, sizeof(BitmapDictEntry) * cache->maxentries);
+	cache->buckets = MemoryContextAlloc(cxt, sizeof(int32) * cache->maxentries);
+	memset(cache->buckets, 0xFF, sizeof(int32) * cache->maxentries);
+
+	/* packed keys are probed by a kernel for their width */
+	cache->keylen = meta->keylen;
+	cache->nullindex = -1;
+	if (cache->keylen > 0)
+	{
+		cache->probe = bm_packed_probe_func(cache->keylen);
+		bm_dict_alloc_groups(cache, BM_DICT_INIT_GROUPS);
+	}
+
+	cache->binWidth = meta->binWidth;
+	cache->binUnit = meta->binUnit;
+	cache->sliced = meta->sliced;
+	cache->segBlocks = meta->segBlocks;
+	cache->nstripes = Max(meta->nstripes, 1);
+	cache->extentPages = Max(meta->extentPages, 1);
+	cache->fastupdate = meta->fastupdate;
+
+	index->rd_amcache = (void *) cache;
+	pfree(meta);
+
+	return cache;
+}
+
+/*
+ * Get the block of a directory page. Directory pages are only ever added, so
+ * block numbers already known stay valid and the meta page is only read for
+ * pages allocated since. Returns InvalidBlockNumber past the last page.
+ */
+BlockNumber
+bm_dict_dir_blk(Relation index, int dirno)
+{
+	BitmapDictCache *cache = bm_dict_get_cache(index);
+	BitmapMetaPageData *meta;
+	Buffer		metabuf;
+
+	if (dirno < cache->ndirpages)
+		return cache->dirBlk[dirno];
+
+	metabuf = ReadBuffer(index, BITMAP_METAPAGE_BLKNO);
+	LockBuffer(metabuf, BUFFER_LOCK_SHARE);
+	meta = BitmapPageGetMeta(BufferGetPage(metabuf));
+
+	if (meta->ndirpages > cache->ndirpages)
+	{
+		if (cache->dirBlk == NULL)
+			cache->dirBlk = MemoryContextAlloc(cache->cxt,
+											   sizeof(BlockNumber) * meta->ndirpages);
+		else
+			cache->dirBlk = repalloc(cache->dirBlk,
+									 sizeof(BlockNumber) * meta->ndirpages);
+		memcpy(cache->dirBlk, meta->dirBlk, sizeof(BlockNumber) * meta->ndirpages);
+		cache->ndirpages = meta->ndirpages;
+	}
+
+	UnlockReleaseBuffer(metabuf);
+
+	return dirno < cache->ndirpages ? cache->dirBlk[dirno] : InvalidBlockNumber;
+}
+
+/*
+ * Drop the dictionary cache of an index whose value pages are recreated,
+ * e.g. by a rebuild after an in-place truncation which does not go through
+ * a relcache flush.
+ */
+void
+bm_dict_reset(Relation index)
+{
+	BitmapDictCache *cache = (BitmapDictCache *) index->rd_amcache;
+
+	if (cache == NULL)
+		return;
+
+	index->rd_amcache = NULL;
+	MemoryContextDelete(cache->cxt);
+}
+
+static void
+bm_dict_add(BitmapDictCache *cache, IndexTuple itup, uint32 hash, int valindex,
+			uint16 version)
+{
+	BitmapDictEntry *entry;
+	int32		bucket;
+
+	if (cache->nentries == cache->maxentries)
+	{
+		/* double the entries and rehash, bucket count follows entry count */
+		cache->maxentries *= 2;
+		cache->entries = repalloc(cache->entries, sizeof(BitmapDictEntry) * cache->maxentries);
+		pfree(cache->buckets);
+		cache->buckets = MemoryContextAlloc(cache->cxt, sizeof(int32) * cache->maxentries);
+		memset(cache->buckets, 0xFF, sizeof(int32) * cache->maxentries);
+
+		for (int i = 0; i < cache->nentries; i++)
+		{
+			bucket = cache->entries[i].hash % cache->maxentries;
+			cache->entries[i].next = cache->buckets[bucket];
+			cache->buckets[bucket] = i;
+		}
+	}
+
+	entry = &cache->entries[cache->nentries];
+	entry->hash = hash;
+	entry->valindex = valindex;
+	entry->version = version;
+	entry->itup = MemoryContextAlloc(cache->cxt, IndexTupleSize(itup));
+	memcpy(entry->itup, itup, IndexTupleSize(itup));
+
+	bucket = entry->hash % cache->maxentries;
+	entry->next = cache->buckets[bucket];
+	cache->buckets[bucket] = cache->nentries;
+	cache->nentries++;
+}
+
+/*
+ * Read value pages the cache has not seen yet. Without hash buckets ordinals
+ * are never reclaimed and values only ever appended, so resuming from the
+ * last position read keeps ordinals in step with the value pages.
+ *
+ * The opclass hash function may accept invalidations, and a relcache reload
+ * frees the cache. Returns false if it did, leaving the caller to get the
+ * cache again.
+ */
+static bool
+bm_dict_load(Relation index, BitmapDictCache *cache)
+{
+	TupleDesc	tupdesc = RelationGetDescr(index);
+	BlockNumber blkno = cache->lastBlk;
+	OffsetNumber off = cache->lastOff;
+	Buffer		buffer;
+	Page		page;
+	OffsetNumber maxoff;
+
+	while (BlockNumberIsValid(blkno))
+	{
+		buffer = ReadBuffer(index, blkno);
+		LockBuffer(buffer, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buffer);
+		maxoff = PageGetMaxOffsetNumber(page);
+
+		Assert(BitmapPageGetOpaque(page)->pgtype == BITMAP_PAGE_VALUE);
+
+		for (off = OffsetNumberNext(off); off <= maxoff; off = OffsetNumberNext(off))
+		{
+			IndexTuple	itup = (IndexTuple) PageGetItem(page, PageGetItemId(page, off));
+			int			attno = BitmapValTupleGetAttno(itup);
+			Datum		value;
+			bool		isnull;
+			uint32		hash;
+
+			value = index_getattr(itup, attno, tupdesc, &isnull);
+			hash = bm_dict_hash(index, attno, value, isnull);
+			if (index->rd_amcache != cache)
+			{
+				UnlockReleaseBuffer(buffer);
+				return false;
+			}
+			bm_dict_add(cache, itup, hash, cache->nentries, 0);
+		}
+
+		cache->lastBlk = blkno;
+		cache->lastOff = maxoff;
+
+		blkno = BitmapPageGetOpaque(page)->nextBlk;
+		off = InvalidOffsetNumber;
+		UnlockReleaseBuffer(buffer);
+	}
+
+	return true;
+}
+
+/*
+ * The opclass comparison may free the cache struct, see bm_dict_load, but
+ * not its entries, which live until the cache is next looked up.
+ */
+static int
+bm_dict_probe(Relation index, BitmapDictCache *cache, uint32 hash,
+			  int attno, Datum value, bool isnull, uint16 *version)
+{
+	BitmapDictEntry *entries = cache->entries;
+	int32		i = cache->buckets[hash % cache->maxentries];
+
+	while (i >= 0)
+	{
+		BitmapDictEntry *entry = &entries[i];
+
+		if (entry->hash == hash && bm_vals_equal(index, attno, value, isnull, entry->itup))
+		{
+			*version = entry->version;
+			return entry->valindex;
+		}
+
+		i = entry->next;
+	}
+
+	return -1;
+}
+
+/* cache the ordinal of values found in or added to the dictionary */
+static void
+bm_dict_remember(Relation index, BitmapDictCache *cache, Datum value,
+				 bool isnull, IndexTuple itup, uint32 hash, int valindex,
+				 uint16 version)
+{
+	if (cache->keylen == 0)
+		bm_dict_add(cache, itup, hash, valindex, version);
+	else if (isnull)
+	{
+		cache->nullindex = valindex;
+		cache->nullversion = version;
+	}
+	else
+		bm_dict_add_packed(cache, bm_packed_key(index, value), valindex, version);
+}
+
+/*
+ * Add a column value missing from the dictionary, unless a concurrent insert
+ * did already. The meta page lock serializes appends. The cache is got again
+ * after the opclass functions ran, a new one cannot be built while the meta
+ * page is locked.
+ */
+static int
+bm_dict_insert(Relation index, uint32 hash, int attno, Datum value, bool isnull,
+			   uint16 *version)
+{
+	BitmapDictCache *cache;
+	Buffer		metabuf;
+	IndexTuple	itup = NULL;
+	ItemPointerData tid;
+	int			valindex;
+	bool		hashed;
+	int			keylen;
+
+	for (;;)
+	{
+		cache = bm_dict_get_cache(index);
+		hashed = cache->hashed;
+		keylen = cache->keylen;
+
+		metabuf = ReadBuffer(index, BITMAP_METAPAGE_BLKNO);
+		LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
+
+		if (hashed || bm_dict_load(index, cache))
+			break;
+		UnlockReleaseBuffer(metabuf);
+	}
+
+	if (hashed)
+		valindex = bm_hash_search(index, metabuf, hash, attno, value, isnull,
+								  keylen > 0 ? NULL : &itup, version);
+	else
+		valindex = bm_dict_probe(index, cache, hash, attno, value, isnull, version);
+
+	if (valindex < 0)
+	{
+		valindex = bm_append_val(index, metabuf, attno, value, isnull, &tid, version);
+		if (hashed)
+		{
+			bm_hash_add(index, metabuf, hash, valindex, &tid, *version);
+			if (keylen == 0)
+				itup = bm_form_val_tuple(index, attno, value, isnull);
+		}
+	}
+
+	UnlockReleaseBuffer(metabuf);
+
+	if (hashed)
+		bm_dict_remember(index, bm_dict_get_cache(index), value, isnull, itup, hash,
+						 valindex, *version);
+	else
+	{
+		while (!bm_dict_load(index, bm_dict_get_cache(index)))
+			;
+	}
+
+	return valindex;
+}
+
+/*
+ * Resolve a column value to its ordinal in the value pages and the version
+ * of the ordinal using the backend-local dictionary cache. On a
+ * cache miss the shared cache is tried, then the hash buckets if the index
+ * has them, otherwise the value pages not read yet. With insert set, a
+ * missing value is added to the dictionary, otherwise -1 is returned.
+ *
+ * Cached ordinals may have been reclaimed by vacuum since, callers check the
+ * version against the directory and call bm_dict_forget if it moved on.
+ *
+ * The opclass functions may accept invalidations that free the cache, so it
+ * is got again after each call to them.
+ */
+int
+bm_dict_lookup(Relation index, int attno, Datum value, bool isnull, bool insert,
+			   uint16 *version)
+{
+	BitmapDictCache *cache = bm_dict_get_cache(index);
+	bool		hashed = cache->hashed;
+	int			keylen = cache->keylen;
+	uint32		hash;
+	Buffer		metabuf;
+	IndexTuple	itup = NULL;
+	int			valindex;
+
+	/* packed keys are probed without calling the opclass hash function */
+	if (keylen > 0)
+	{
+		valindex = bm_dict_probe_packed(index, cache, value, isnull, version);
+		if (valindex >= 0)
+			return valindex;
+
+		hash = bm_dict_hash(index, attno, value, isnull);
+	}
+	else
+	{
+		hash = bm_dict_hash(index, attno, value, isnull);
+		valindex = bm_dict_probe(index, bm_dict_get_cache(index), hash, attno, value,
+								 isnull, version);
+		if (valindex >= 0)
+			return valindex;
+	}
+
+	/*
+	 * An ordinal known to any backend is good until its version moves on.
+	 * The linear cache must stay in value page order and is not fed by it.
+	 */
+	valindex = bm_shared_get_val(index, attno, value, isnull, version);
+	if (valindex >= 0)
+	{
+		if (hashed)
+		{
+			if (keylen == 0)
+				itup = bm_form_val_tuple(index, attno, value, isnull);
+			bm_dict_remember(index, bm_dict_get_cache(index), value, isnull, itup,
+							 hash, valindex, *version);
+		}
+		return valindex;
+	}
+
+	if (hashed)
+	{
+		metabuf = ReadBuffer(index, BITMAP_METAPAGE_BLKNO);
+		LockBuffer(metabuf, BUFFER_LOCK_SHARE);
+		valindex = bm_hash_search(index, metabuf, hash, attno, value, isnull,
+								  keylen > 0 ? NULL : &itup, version);
+		UnlockReleaseBuffer(metabuf);
+
+		if (valindex >= 0)
+			bm_dict_remember(index, bm_dict_get_cache(index), value, isnull, itup,
+							 hash, valindex, *version);
+	}
+	else
+	{
+		/* value may have been added by another backend since the last load */
+		while (!bm_dict_load(index, bm_dict_get_cache(index)))
+			;
+		valindex = bm_dict_probe(index, bm_dict_get_cache(index), hash, attno, value,
+								 isnull, version);
+	}
+
+	if (valindex < 0 && insert)
+		valindex = bm_dict_insert(index, hash, attno, value, isnull, version);
+
+	if (valindex >= 0)
+		bm_shared_set_val(index, attno, value, isnull, valindex, *version);
+
+	return valindex;
+}
+
+/*
+ * Drop cached ordinals after finding one reclaimed by vacuum. Other entries
+ * of the local cache may be stale as well, so all of it goes.
+ */
+void
+bm_dict_forget(Relation index, int attno, Datum value, bool isnull)
+{
+	bm_dict_reset(index);
+	bm_shared_forget_val(index, attno, value, isnull);
+}
@@ -0,0 +1,452 @@
+#include <postgres.h>
+
+#include <access/generic_xlog.h>
+#include <storage/bufmgr.h>
+#include <storage/indexfsm.h>
+#include <utils/rel.h>
+
+#include "bitmap.h"
+
+/*
+ * Hashed value dictionary. Bucket pages map the hash of a value to its
+ * ordinal and to the location of the value tuple, so a value is found by
+ * reading its bucket chain and the value page of each hash match instead of
+ * walking every value page. The meta page holds the bucket heads; searches
+ * keep it share locked and changes exclusively locked, so buckets can be
+ * split without concurrent readers.
+ */
+
+/* every key column has a hash support function */
+bool
+bm_hash_supported(Relation index)
+{
+	for (int i = 1; i <= IndexRelationGetNumberOfKeyAttributes(index); i++)
+	{
+		if (!OidIsValid(index_getprocid(index, i, BITMAP_HASH_PROC)))
+			return false;
+	}
+
+	return true;
+}
+
+static bool
+bm_hash_val_equal(Relation index, int keylen, ItemPointer valtid,
+				  int attno, Datum value, bool isnull, IndexTuple *itup)
+{
+	Buffer		buffer;
+	Page		page;
+	IndexTuple	vtup;
+	bool		equal;
+
+	/* packed NULL value is not stored */
+	if (keylen > 0 && (isnull || !ItemPointerIsValid(valtid)))
+		return isnull && !ItemPointerIsValid(valtid);
+
+	buffer = ReadBuffer(index, ItemPointerGetBlockNumber(valtid));
+	LockBuffer(buffer, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buffer);
+
+	Assert(BitmapPageGetOpaque(page)->pgtype == BITMAP_PAGE_VALUE);
+
+	if (keylen > 0)
+	{
+		char	   *key = BitmapPageGetKeys(page) +
+			(ItemPointerGetOffsetNumber(valtid) - 1) * keylen;
+
+		equal = bm_packed_load(key, keylen) == bm_packed_key(index, value);
+		UnlockReleaseBuffer(buffer);
+
+		return equal;
+	}
+
+	vtup = (IndexTuple) PageGetItem(page,
+									PageGetItemId(page, ItemPointerGetOffsetNumber(valtid)));
+	equal = bm_vals_equal(index, attno, value, isnull, vtup);
+
+	if (equal && itup != NULL)
+	{
+		*itup = palloc(IndexTupleSize(vtup));
+		memcpy(*itup, vtup, IndexTupleSize(vtup));
+	}
+
+	UnlockReleaseBuffer(buffer);
+
+	return equal;
+}
+
+/*
+ * Find the ordinal of a column value and its version through the hash
+ * buckets, -1 if the value is not in the dictionary. The caller holds the
+ * meta page locked. A copy of the value tuple is returned in itup if
+ * requested, packed dictionaries have none.
+ */
+int
+bm_hash_search(Relation index, Buffer metabuf, uint32 hash,
+			   int attno, Datum value, bool isnull, IndexTuple *itup, uint16 *version)
+{
+	BitmapMetaPageData *meta = BitmapPageGetMeta(BufferGetPage(metabuf));
+	BlockNumber blkno;
+	Buffer		buffer;
+	Page		page;
+	BitmapHashEntry *entries;
+	int			valindex = -1;
+
+	Assert(meta->nbuckets > 0);
+	blkno = meta->bucketBlk[hash & (meta->nbuckets - 1)];
+
+	while (valindex < 0 && blkno != InvalidBlockNumber)
+	{
+		buffer = ReadBuffer(index, blkno);
+		LockBuffer(buffer, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buffer);
+		entries = BitmapPageGetBucket(page);
+
+		Assert(BitmapPageGetOpaque(page)->pgtype == BITMAP_PAGE_BUCKET);
+
+		for (int i = 0; i < BitmapPageGetOpaque(page)->maxoff; i++)
+		{
+			if (entries[i].hash == hash &&
+				bm_hash_val_equal(index, meta->keylen, &entries[i].valtid,
+								  attno, value, isnull, itup))
+			{
+				valindex = entries[i].valindex;
+				*version = entries[i].version;
+				break;
+			}
+		}
+
+		blkno = BitmapPageGetOpaque(page)->nextBlk;
+		UnlockReleaseBuffer(buffer);
+	}
+
+	return valindex;
+}
+
+static void
+bm_init_bucket(Page page)
+{
+	bm_init_page(page, BITMAP_PAGE_BUCKET);
+	((PageHeader) page)->pd_lower += sizeof(BitmapHashEntry) * BITMAP_BUCKET_ENTRIES;
+
+	Assert(((PageHeader) page)->pd_lower <= ((PageHeader) page)->pd_upper);
+}
+
+/*
+ * Write entries into a new chain of bucket pages and return its head. Pages
+ * are written from the tail so that each one is linked to an already written
+ * page.
+ */
+static BlockNumber
+bm_hash_write_chain(Relation index, BitmapHashEntry *entries, int nentries)
+{
+	BlockNumber next = InvalidBlockNumber;
+	Buffer		buffer;
+	Page		page;
+	GenericXLogState *state;
+	int			npages = (nentries + BITMAP_BUCKET_ENTRIES - 1) / BITMAP_BUCKET_ENTRIES;
+
+	for (int p = npages - 1; p >= 0; p--)
+	{
+		int			start = p * BITMAP_BUCKET_ENTRIES;
+		int			n = Min(nentries - start, (int) BITMAP_BUCKET_ENTRIES);
+
+		buffer = bm_newbuffer_locked(index);
+		state = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(state, buffer, GENERIC_XLOG_FULL_IMAGE);
+		bm_init_bucket(page);
+
+		memcpy(BitmapPageGetBucket(page), entries + start, sizeof(BitmapHashEntry) * n);
+		BitmapPageGetOpaque(page)->maxoff = n;
+		BitmapPageGetOpaque(page)->nextBlk = next;
+
+		GenericXLogFinish(state);
+		next = BufferGetBlockNumber(buffer);
+		UnlockReleaseBuffer(buffer);
+	}
+
+	return next;
+}
+
+/* mark the pages of a bucket chain deleted and hand them to the FSM */
+static void
+bm_hash_free_chain(Relation index, BlockNumber blkno)
+{
+	Buffer		buffer;
+	Page		page;
+	GenericXLogState *state;
+
+	while (blkno != InvalidBlockNumber)
+	{
+		buffer = ReadBuffer(index, blkno);
+		LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+
+		state = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(state, buffer, 0);
+		BitmapPageSetDeleted(page);
+		GenericXLogFinish(state);
+
+		RecordFreeIndexPage(index, blkno);
+		blkno = BitmapPageGetOpaque(BufferGetPage(buffer))->nextBlk;
+		UnlockReleaseBuffer(buffer);
+	}
+}
+
+/*
+ * Double the number of buckets, moving entries whose next hash bit is set
+ * from bucket b to bucket b + nbuckets. New chains are written before the
+ * meta page points at them, the old ones are freed afterwards.
+ */
+static void
+bm_hash_split(Relation index, Buffer metabuf)
+{
+	BitmapMetaPageData *meta = BitmapPageGetMeta(BufferGetPage(metabuf));
+	uint32		nbuckets = meta->nbuckets;
+	BlockNumber oldBlks[BITMAP_MAX_BUCKETS];
+	BlockNumber newBlks[BITMAP_MAX_BUCKETS];
+	BitmapHashEntry *lower,
+			   *upper;
+	int			maxentries = BITMAP_BUCKET_ENTRIES;
+	GenericXLogState *state;
+
+	lower = palloc(sizeof(BitmapHashEntry) * maxentries);
+	upper = palloc(sizeof(BitmapHashEntry) * maxentries);
+
+	for (uint32 b = 0; b < nbuckets; b++)
+	{
+		BlockNumber blkno = meta->bucketBlk[b];
+		int			nlower = 0,
+					nupper = 0;
+
+		oldBlks[b] = blkno;
+		while (blkno != InvalidBlockNumber)
+		{
+			Buffer		buffer = ReadBuffer(index, blkno);
+			Page		page;
+			BitmapHashEntry *entries;
+
+			LockBuffer(buffer, BUFFER_LOCK_SHARE);
+			page = BufferGetPage(buffer);
+			entries = BitmapPageGetBucket(page);
+
+			for (int i = 0; i < BitmapPageGetOpaque(page)->maxoff; i++)
+			{
+				if (nlower == maxentries || nupper == maxentries)
+				{
+					maxentries *= 2;
+					lower = repalloc(lower, sizeof(BitmapHashEntry) * maxentries);
+					upper = repalloc(upper, sizeof(BitmapHashEntry) * maxentries);
+				}
+
+				if (entries[i].hash & nbuckets)
+					upper[nupper++] = entries[i];
+				else
+					lower[nlower++] = entries[i];
+			}
+
+			blkno = BitmapPageGetOpaque(page)->nextBlk;
+			UnlockReleaseBuffer(buffer);
+		}
+
+		newBlks[b] = bm_hash_write_chain(index, lower, nlower);
+		newBlks[b + nbuckets] = bm_hash_write_chain(index, upper, nupper);
+	}
+
+	state = GenericXLogStart(index);
+	meta = BitmapPageGetMeta(GenericXLogRegisterBuffer(state, metabuf, 0));
+	memcpy(meta->bucketBlk, newBlks, sizeof(BlockNumber) * nbuckets * 2);
+	meta->nbuckets = nbuckets * 2;
+	GenericXLogFinish(state);
+
+	for (uint32 b = 0; b < nbuckets; b++)
+		bm_hash_free_chain(index, oldBlks[b]);
+
+	pfree(lower);
+	pfree(upper);
+}
+
+/*
+ * Add the hash entry of a newly appended value. The caller holds the meta
+ * page exclusively locked. Buckets are doubled once they average half a
+ * page of entries, past BITMAP_MAX_BUCKETS the chains just grow.
+ */
+void
+bm_hash_add(Relation index, Buffer metabuf, uint32 hash, int valindex,
+			ItemPointer valtid, uint16 version)
+{
+	BitmapMetaPageData *meta = BitmapPageGetMeta(BufferGetPage(metabuf));
+	BitmapHashEntry entry;
+	uint32		bucket;
+	BlockNumber blkno;
+	Buffer		buffer = InvalidBuffer;
+	Buffer		nbuffer;
+	Page		page;
+	GenericXLogState *state;
+
+	Assert(meta->nbuckets > 0);
+
+	if (meta->nbuckets < BITMAP_MAX_BUCKETS &&
+		meta->nvalues > meta->nbuckets * (BITMAP_BUCKET_ENTRIES / 2))
+		bm_hash_split(index, metabuf);
+
+	entry.hash = hash;
+	entry.valindex = valindex;
+	entry.valtid = *valtid;
+	entry.version = version;
+
+	bucket = hash & (meta->nbuckets - 1);
+	blkno = meta->bucketBlk[bucket];
+
+	/* append to the first page of the chain with room */
+	while (blkno != InvalidBlockNumber)
+	{
+		buffer = ReadBuffer(index, blkno);
+		LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+		page = BufferGetPage(buffer);
+
+		if (BitmapPageGetOpaque(page)->maxoff < BITMAP_BUCKET_ENTRIES)
+		{
+			state = GenericXLogStart(index);
+			page = GenericXLogRegisterBuffer(state, buffer, 0);
+			BitmapPageGetBucket(page)[BitmapPageGetOpaque(page)->maxoff++] = entry;
+			GenericXLogFinish(state);
+			UnlockReleaseBuffer(buffer);
+			return;
+		}
+
+		blkno = BitmapPageGetOpaque(page)->nextBlk;
+		if (blkno != InvalidBlockNumber)
+			UnlockReleaseBuffer(buffer);
+	}
+
+	/* chain is full or empty, link a new page from its tail or the meta page */
+	nbuffer = bm_newbuffer_locked(index);
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, nbuffer, GENERIC_XLOG_FULL_IMAGE);
+	bm_init_bucket(page);
+	BitmapPageGetBucket(page)[0] = entry;
+	BitmapPageGetOpaque(page)->maxoff = 1;
+
+	if (buffer != InvalidBuffer)
+	{
+		page = GenericXLogRegisterBuffer(state, buffer, 0);
+		BitmapPageGetOpaque(page)->nextBlk = BufferGetBlockNumber(nbuffer);
+	}
+	else
+	{
+		meta = BitmapPageGetMeta(GenericXLogRegisterBuffer(state, metabuf, 0));
+		meta->bucketBlk[bucket] = BufferGetBlockNumber(nbuffer);
+	}
+
+	GenericXLogFinish(state);
+	UnlockReleaseBuffer(nbuffer);
+	if (buffer != InvalidBuffer)
+		UnlockReleaseBuffer(buffer);
+}
+
+static int
+bm_tid_cmp_desc(const void *a, const void *b)
+{
+	return ItemPointerCompare((ItemPointer) b, (ItemPointer) a);
+}
+
+/* remove value tuples of reclaimed ordinals, keeping other offsets stable */
+static void
+bm_hash_delete_vals(Relation index, ItemPointer tids, int ntids)
+{
+	GenericXLogState *state;
+	Buffer		buffer;
+	Page		page;
+	int			i = 0;
+
+	/* descending offsets let each page shrink its line pointer array */
+	qsort(tids, ntids, sizeof(ItemPointerData), bm_tid_cmp_desc);
+
+	while (i < ntids)
+	{
+		BlockNumber blkno = ItemPointerGetBlockNumber(&tids[i]);
+
+		buffer = ReadBuffer(index, blkno);
+		LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+		state = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(state, buffer, 0);
+
+		for (; i < ntids && ItemPointerGetBlockNumber(&tids[i]) == blkno; i++)
+			PageIndexTupleDeleteNoCompact(page, ItemPointerGetOffsetNumber(&tids[i]));
+		/* new value tuples take the unused line pointers */
+		PageSetHasFreeLinePointers(page);
+
+		GenericXLogFinish(state);
+		UnlockReleaseBuffer(buffer);
+	}
+}
+
+/*
+ * Remove the hash entries of ordinals vacuum reclaims, flagged in reclaim,
+ * so that their values are no longer found. Value tuples are deleted too,
+ * packed keys stay in place as they are addressed by position. The caller
+ * holds the meta page exclusively locked.
+ */
+void
+bm_hash_reclaim(Relation index, Buffer metabuf, bool *reclaim)
+{
+	BitmapMetaPageData *meta = BitmapPageGetMeta(BufferGetPage(metabuf));
+	ItemPointer tids = NULL;
+	int			ntids = 0,
+				maxtids = 0;
+
+	for (uint32 b = 0; b < meta->nbuckets; b++)
+	{
+		BlockNumber blkno = meta->bucketBlk[b];
+
+		while (blkno != InvalidBlockNumber)
+		{
+			Buffer		buffer = ReadBuffer(index, blkno);
+			GenericXLogState *state;
+			Page		page;
+			BitmapHashEntry *entries;
+			int			n = 0;
+
+			LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+			state = GenericXLogStart(index);
+			page = GenericXLogRegisterBuffer(state, buffer, 0);
+			entries = BitmapPageGetBucket(page);
+
+			for (int i = 0; i < BitmapPageGetOpaque(page)->maxoff; i++)
+			{
+				if (!reclaim[entries[i].valindex])
+				{
+					entries[n++] = entries[i];
+					continue;
+				}
+
+				if (meta->keylen == 0)
+				{
+					if (ntids == maxtids)
+					{
+						maxtids = Max(maxtids * 2, 64);
+						tids = tids == NULL ?
+							palloc(sizeof(ItemPointerData) * maxtids) :
+							repalloc(tids, sizeof(ItemPointerData) * maxtids);
+					}
+					tids[ntids++] = entries[i].valtid;
+				}
+			}
+
+			blkno = BitmapPageGetOpaque(page)->nextBlk;
+			if (n < BitmapPageGetOpaque(page)->maxoff)
+			{
+				BitmapPageGetOpaque(page)->maxoff = n;
+				GenericXLogFinish(state);
+			}
+			else
+				GenericXLogAbort(state);
+			UnlockReleaseBuffer(buffer);
+		}
+	}
+
+	if (ntids > 0)
+	{
+		bm_hash_delete_vals(index, tids, ntids);
+		pfree(tids);
+	}
+}
@@ -35,6 +35,20 @@ _bm_get_relation_by_name(text *name)
 	return rel;
 }
 
+/* reject pages of another type, whose entries would be read past their end */
+static void
+_bm_check_page(Page page, BlockNumber blkno, uint16 pgtype)
+{
+	if (PageIsNew(page) ||
+		PageGetSpecialSize(page) != MAXALIGN(sizeof(BitmapPageSpecData)) ||
+		BitmapPageGetOpaque(page)->pgtype != pgtype ||
+		BitmapPageDeleted(page))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("block %u is not a %s page", blkno,
+						pgtype == BITMAP_PAGE_VALUE ? "value" : "bitmap")));
+}
+
 PG_FUNCTION_INFO_V1(bm_metap);
 
 /* -------------------------------------
@@ -50,12 +64,15 @@ bm_metap(PG_FUNCTION_ARGS)
 	Relation	rel = _bm_get_relation_by_name(relname);
 	Datum		result;
 	BitmapMetaPageData *meta;
-	Buffer		buffer;
+	BitmapDirEntry *dir;
+	Buffer		buffer,
+				dirbuf;
 	Page		page;
 	HeapTuple	tuple;
 	TupleDesc	tupleDesc;
 	int			max_block_shown = 10;
 	int			i;
+	int			shown;
 	int			j;
 	char	   *values[3];
 	StringInfoData strinfo;
@@ -64,6 +81,7 @@ bm_metap(PG_FUNCTION_ARGS)
 	LockBuffer(buffer, BUFFER_LOCK_SHARE);
 
 	page = BufferGetPage(buffer);
+	bm_check_meta(rel, page);
 	meta = BitmapPageGetMeta(page);
 
 	if (get_call_result_type(fcinfo, NULL, &tupleDesc) != TYPEFUNC_COMPOSITE)
@@ -74,11 +92,37 @@ bm_metap(PG_FUNCTION_ARGS)
 	values[j++] = psprintf("%u", meta->ndistinct);
 
 	initStringInfo(&strinfo);
-	for (i = 0; i < meta->ndistinct && i < max_block_shown; i++)
+	if (meta->sliced)
 	{
-		if (i > 0)
-			appendStringInfoString(&strinfo, ", ");
-		appendStringInfoString(&strinfo, psprintf("%u", meta->startBlk[i]));
+		/* sliced indexes start a chain per slice instead */
+		for (i = 0, shown = 0; i < BITMAP_SLICES; i++)
+		{
+			if (meta->sliceBlk[i] == InvalidBlockNumber)
+				continue;
+
+			if (shown++ > 0)
+				appendStringInfoString(&strinfo, ", ");
+			appendStringInfoString(&strinfo, psprintf("%u", meta->sliceBlk[i]));
+		}
+	}
+	else if (meta->ndistinct > 0)
+	{
+		/* start blocks of the first values are all in the first directory page */
+		dirbuf = ReadBuffer(rel, meta->dirBlk[0]);
+		LockBuffer(dirbuf, BUFFER_LOCK_SHARE);
+		dir = BitmapPageGetDir(BufferGetPage(dirbuf));
+
+		for (i = 0, shown = 0; i < BITMAP_DIR_ENTRIES && shown < max_block_shown; i++)
+		{
+			if (dir[i].startBlk == InvalidBlockNumber)
+				continue;
+
+			if (shown++ > 0)
+				appendStringInfoString(&strinfo, ", ");
+			appendStringInfoString(&strinfo, psprintf("%u", dir[i].startBlk));
+		}
+
+		UnlockReleaseBuffer(dirbuf);
 	}
 	values[j++] = strinfo.data;
 
@@ -99,8 +143,10 @@ struct CrossCallData
 {
 	Page		page;
 	OffsetNumber offset;
+	BitmapTuple *bmtuple;		/* bitmap tuple at offset */
 	TupleDesc	indexTupDesc;
 	TupleDesc	tupd;
+	int			keylen;
 };
 
 
@@ -126,6 +172,7 @@ bm_valuep(PG_FUNCTION_ARGS)
 		Relation	rel;
 		Buffer		buffer;
 		TupleDesc	tupleDesc;
+		BitmapMetaPageData *meta;
 
 		fctx = SRF_FIRSTCALL_INIT();
 		rel = _bm_get_relation_by_name(relname);
@@ -143,10 +190,27 @@ bm_valuep(PG_FUNCTION_ARGS)
 		ccdata = palloc(sizeof(struct CrossCallData));
 		ccdata->page = palloc(BLCKSZ);
 		memcpy(ccdata->page, BufferGetPage(buffer), BLCKSZ);
+		UnlockReleaseBuffer(buffer);
+		_bm_check_page(ccdata->page, blkno, BITMAP_PAGE_VALUE);
 		ccdata->indexTupDesc = CreateTupleDescCopy(RelationGetDescr(rel));
-		fctx->max_calls = PageGetMaxOffsetNumber(ccdata->page);
 
-		UnlockReleaseBuffer(buffer);
+		meta = bm_get_meta(rel);
+		ccdata->keylen = meta->keylen;
+		if (ccdata->keylen > 0)
+			fctx->max_calls = Min(BitmapPageGetOpaque(ccdata->page)->maxoff,
+								  (((PageHeader) ccdata->page)->pd_lower -
+								   (BitmapPageGetKeys(ccdata->page) - ccdata->page)) /
+								  ccdata->keylen);
+		else
+		{
+			/* value tuples of reclaimed ordinals leave unused line pointers */
+			fctx->max_calls = 0;
+			for (OffsetNumber off = FirstOffsetNumber;
+				 off <= PageGetMaxOffsetNumber(ccdata->page); off++)
+				if (ItemIdIsUsed(PageGetItemId(ccdata->page, off)))
+					fctx->max_calls++;
+		}
+
 		relation_close(rel, AccessShareLock);
 
 		if (get_call_result_type(fcinfo, NULL, &tupleDesc) != TYPEFUNC_COMPOSITE)
@@ -165,8 +229,6 @@ bm_valuep(PG_FUNCTION_ARGS)
 
 	if (fctx->call_cntr < fctx->max_calls)
 	{
-		ItemId		itid = PageGetItemId(ccdata->page, ccdata->offset);
-		IndexTuple	idxtuple = (IndexTuple) PageGetItem(ccdata->page, itid);
 		Datum		values[INDEX_MAX_KEYS];
 		bool		isnull[INDEX_MAX_KEYS];
 		Datum		rvalues[2];
@@ -174,10 +236,31 @@ bm_valuep(PG_FUNCTION_ARGS)
 		StringInfoData s;
 		HeapTuple	tuple;
 
+		if (ccdata->keylen == 0)
+		{
+			while (!ItemIdIsUsed(PageGetItemId(ccdata->page, ccdata->offset)))
+				ccdata->offset++;
+		}
+
 		rvalues[0] = UInt16GetDatum(ccdata->offset);
-		ccdata->offset++;
 
-		index_deform_tuple(idxtuple, ccdata->indexTupDesc, values, isnull);
+		if (ccdata->keylen > 0)
+		{
+			char	   *key = BitmapPageGetKeys(ccdata->page) +
+				(ccdata->offset - 1) * ccdata->keylen;
+
+			values[0] = bm_packed_datum(ccdata->keylen,
+										bm_packed_load(key, ccdata->keylen));
+			isnull[0] = false;
+		}
+		else
+		{
+			ItemId		itid = PageGetItemId(ccdata->page, ccdata->offset);
+
+			index_deform_tuple((IndexTuple) PageGetItem(ccdata->page, itid),
+							   ccdata->indexTupDesc, values, isnull);
+		}
+		ccdata->offset++;
 
 		for (int i = 0; i < ccdata->indexTupDesc->natts; i++)
 			if (!isnull[i])
@@ -221,7 +304,7 @@ bm_indexp(PG_FUNCTION_ARGS)
 		fctx = SRF_FIRSTCALL_INIT();
 		rel = _bm_get_relation_by_name(relname);
 
-		if (blkno < BITMAP_VALPAGE_START_BLKNO + 1 || blkno > MaxBlockNumber)
+		if (blkno <= BITMAP_DIRPAGE_START_BLKNO || blkno > MaxBlockNumber)
 			ereport(ERROR,
 					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
 					 errmsg("invalid block number")));
@@ -234,9 +317,10 @@ bm_indexp(PG_FUNCTION_ARGS)
 		ccdata = palloc(sizeof(struct CrossCallData));
 		ccdata->page = palloc(BLCKSZ);
 		memcpy(ccdata->page, BufferGetPage(buffer), BLCKSZ);
+		UnlockReleaseBuffer(buffer);
+		_bm_check_page(ccdata->page, blkno, BITMAP_PAGE_INDEX);
 		fctx->max_calls = BitmapPageGetOpaque(ccdata->page)->maxoff;
 
-		UnlockReleaseBuffer(buffer);
 		relation_close(rel, AccessShareLock);
 
 		if (get_call_result_type(fcinfo, NULL, &tupleDesc) != TYPEFUNC_COMPOSITE)
@@ -245,6 +329,7 @@ bm_indexp(PG_FUNCTION_ARGS)
 		tupleDesc = BlessTupleDesc(tupleDesc);
 		ccdata->tupd = CreateTupleDescCopy(tupleDesc);
 		ccdata->offset = FirstOffsetNumber;
+		ccdata->bmtuple = BitmapPageFirstTuple(ccdata->page);
 		fctx->user_fctx = ccdata;
 
 		MemoryContextSwitchTo(mctx);
@@ -253,24 +338,41 @@ bm_indexp(PG_FUNCTION_ARGS)
 	fctx = SRF_PERCALL_SETUP();
 	ccdata = fctx->user_fctx;
 
-	if (fctx->call_cntr < fctx->max_calls)
+	/* the walk stops at the end of the tuples even if maxoff is off */
+	if (fctx->call_cntr < fctx->max_calls &&
+		(char *) ccdata->bmtuple + offsetof(BitmapTuple, data) <=
+		ccdata->page + ((PageHeader) ccdata->page)->pd_lower &&
+		(char *) BitmapTupleNext(ccdata->bmtuple) <=
+		ccdata->page + ((PageHeader) ccdata->page)->pd_lower)
 	{
-		BitmapTuple *bmtuple = BitmapPageGetTuple(ccdata->page, ccdata->offset);
-		Datum		rvalues[3];
-		bool		rnull[3] = {false, false, false};
+		static const char *const containers[] = {"array", "bits", "full", "inverse"};
+		BitmapTuple *bmtuple = ccdata->bmtuple;
+		Datum		rvalues[5];
+		bool		rnull[5] = {false, false, false, false, false};
 		StringInfoData s;
 		HeapTuple	tuple;
-		int			i;
+		uint8		offsets[MAX_HEAP_TUPLE_PER_PAGE];
+		bits32		bm[MAX_BITS_32] = {0};
+		int			i,
+					n;
 
 		rvalues[0] = UInt16GetDatum(ccdata->offset);
 		rvalues[1] = UInt32GetDatum(bmtuple->heapblk);
+		rvalues[2] = UInt16GetDatum(bmtuple->run);
+		rvalues[3] = PointerGetDatum(cstring_to_text(containers[BitmapTupleType(bmtuple)]));
 		ccdata->offset++;
+		ccdata->bmtuple = BitmapTupleNext(bmtuple);
+
+		/* containers are shown as the bitset they stand for */
+		n = bm_tuple_offsets(bmtuple, offsets);
+		for (i = 0; i < n; i++)
+			bm[offsets[i] / 32] |= 0x1 << (offsets[i] % 32);
 
 		initStringInfo(&s);
 		for (i = 0; i < MAX_BITS_32; i++)
-			appendStringInfo(&s, "%08X ", bmtuple->bm[i]);
+			appendStringInfo(&s, "%08X ", bm[i]);
 
-		rvalues[2] = PointerGetDatum(cstring_to_text(s.data));
+		rvalues[4] = PointerGetDatum(cstring_to_text(s.data));
 		tuple = heap_form_tuple(ccdata->tupd, rvalues, rnull);
 
 		SRF_RETURN_NEXT(fctx, HeapTupleGetDatum(tuple));
@@ -0,0 +1,250 @@
+#include <postgres.h>
+
+#include <catalog/pg_type.h>
+#include <port/pg_bitutils.h>
+#include <utils/float.h>
+#include <utils/rel.h>
+
+#include "bitmap.h"
+
+/* same test as port/simd.h, which is not available before PostgreSQL 16 */
+#if defined(__x86_64__) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define BM_USE_SSE2
+#endif
+
+/*
+ * Packed keys of fixed width by-value types. Keys are the low keylen bytes of
+ * the datum, normalized so that raw equality matches the opclass equality.
+ */
+
+/* key width if the index dictionary can be packed, zero otherwise */
+int
+bm_packed_keylen(Relation index)
+{
+	Form_pg_attribute att;
+
+	if (IndexRelationGetNumberOfKeyAttributes(index) != 1)
+		return 0;
+
+	att = TupleDescAttr(RelationGetDescr(index), 0);
+	switch (att->atttypid)
+	{
+		case INT2OID:
+		case INT4OID:
+		case INT8OID:
+		case FLOAT4OID:
+		case FLOAT8OID:
+		case TIMESTAMPOID:
+		case TIMESTAMPTZOID:
+			/* 8 byte keys are passed by reference on 32 bit builds */
+			if (!att->attbyval)
+				return 0;
+			return att->attlen;
+		default:
+			return 0;
+	}
+}
+
+uint64
+bm_packed_key(Relation index, Datum value)
+{
+	Form_pg_attribute att = TupleDescAttr(RelationGetDescr(index), 0);
+
+	/* float comparison treats all NaNs as equal and -0 as equal to 0 */
+	if (att->atttypid == FLOAT4OID)
+	{
+		float4		f = DatumGetFloat4(value);
+
+		if (isnan(f))
+			value = Float4GetDatum(get_float4_nan());
+		else if (f == 0)
+			value = Float4GetDatum(0);
+	}
+	else if (att->atttypid == FLOAT8OID)
+	{
+		float8		f = DatumGetFloat8(value);
+
+		if (isnan(f))
+			value = Float8GetDatum(get_float8_nan());
+		else if (f == 0)
+			value = Float8GetDatum(0);
+	}
+
+	switch (att->attlen)
+	{
+		case 2:
+			return (uint16) DatumGetInt16(value);
+		case 4:
+			return (uint32) DatumGetInt32(value);
+		default:
+			return (uint64) DatumGetInt64(value);
+	}
+}
+
+Datum
+bm_packed_datum(int keylen, uint64 key)
+{
+	switch (keylen)
+	{
+		case 2:
+			return Int16GetDatum((int16) key);
+		case 4:
+			return Int32GetDatum((int32) key);
+		default:
+			return Int64GetDatum((int64) key);
+	}
+}
+
+uint64
+bm_packed_load(const char *src, int keylen)
+{
+	uint16		k16;
+	uint32		k32;
+	uint64		k64;
+
+	switch (keylen)
+	{
+		case 2:
+			memcpy(&k16, src, sizeof(k16));
+			return k16;
+		case 4:
+			memcpy(&k32, src, sizeof(k32));
+			return k32;
+		default:
+			memcpy(&k64, src, sizeof(k64));
+			return k64;
+	}
+}
+
+void
+bm_packed_store(char *dst, int keylen, uint64 key)
+{
+	uint16		k16 = (uint16) key;
+	uint32		k32 = (uint32) key;
+
+	switch (keylen)
+	{
+		case 2:
+			memcpy(dst, &k16, sizeof(k16));
+			break;
+		case 4:
+			memcpy(dst, &k32, sizeof(k32));
+			break;
+		default:
+			memcpy(dst, &key, sizeof(key));
+			break;
+	}
+}
+
+/*
+ * Probe kernels return the position of key among the first nkeys keys of a
+ * group of BITMAP_PROBE_GROUP keys, -1 if it is not there.
+ */
+static inline int
+bm_probe_result(uint32 mask, int nkeys)
+{
+	mask &= (1U << nkeys) - 1;
+	return mask ? pg_rightmost_one_pos32(mask) : -1;
+}
+
+#ifdef BM_USE_SSE2
+
+static int
+bm_probe_int16(const char *keys, int nkeys, uint64 key)
+{
+	__m128i		k = _mm_set1_epi16((int16) key);
+	__m128i		c = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *) keys), k);
+
+	/* narrow each 16 bit lane to a byte to get one mask bit per key */
+	c = _mm_packs_epi16(c, _mm_setzero_si128());
+	return bm_probe_result(_mm_movemask_epi8(c), nkeys);
+}
+
+static int
+bm_probe_int32(const char *keys, int nkeys, uint64 key)
+{
+	__m128i		k = _mm_set1_epi32((int32) key);
+	uint32		mask = 0;
+
+	for (int i = 0; i < BITMAP_PROBE_GROUP; i += 4)
+	{
+		__m128i		c = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) (keys + i * 4)), k);
+
+		mask |= (uint32) _mm_movemask_ps(_mm_castsi128_ps(c)) << i;
+	}
+
+	return bm_probe_result(mask, nkeys);
+}
+
+static int
+bm_probe_int64(const char *keys, int nkeys, uint64 key)
+{
+	__m128i		k = _mm_set1_epi64x((int64) key);
+	uint32		mask = 0;
+
+	/* SSE2 has no 64 bit compare, both 32 bit halves have to match */
+	for (int i = 0; i < BITMAP_PROBE_GROUP; i += 2)
+	{
+		__m128i		c = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) (keys + i * 8)), k);
+
+		c = _mm_and_si128(c, _mm_shuffle_epi32(c, _MM_SHUFFLE(2, 3, 0, 1)));
+		mask |= (uint32) _mm_movemask_pd(_mm_castsi128_pd(c)) << i;
+	}
+
+	return bm_probe_result(mask, nkeys);
+}
+
+#else
+
+static int
+bm_probe_int16(const char *keys, int nkeys, uint64 key)
+{
+	const uint16 *k = (const uint16 *) keys;
+
+	for (int i = 0; i < nkeys; i++)
+		if (k[i] == (uint16) key)
+			return i;
+
+	return -1;
+}
+
+static int
+bm_probe_int32(const char *keys, int nkeys, uint64 key)
+{
+	const uint32 *k = (const uint32 *) keys;
+
+	for (int i = 0; i < nkeys; i++)
+		if (k[i] == (uint32) key)
+			return i;
+
+	return -1;
+}
+
+static int
+bm_probe_int64(const char *keys, int nkeys, uint64 key)
+{
+	const uint64 *k = (const uint64 *) keys;
+
+	for (int i = 0; i < nkeys; i++)
+		if (k[i] == key)
+			return i;
+
+	return -1;
+}
+
+#endif							/* BM_USE_SSE2 */
+
+BitmapProbeFunc
+bm_packed_probe_func(int keylen)
+{
+	switch (keylen)
+	{
+		case 2:
+			return bm_probe_int16;
+		case 4:
+			return bm_probe_int32;
+		default:
+			return bm_probe_int64;
+	}
+}
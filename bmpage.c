@@ -4,46 +4,318 @@
 #include <storage/indexfsm.h>
 #include <storage/lmgr.h>
 #include <access/generic_xlog.h>
+#include <access/xloginsert.h>
 
 #include "bitmap.h"
 
+/* whether a tuple sorts before a heap block and key */
+#define BM_TUPLE_BEFORE(t, blk, key) \
+	((t)->heapblk < (blk) || ((t)->heapblk == (blk) && BitmapTupleKey(t) < (key)))
+
+/*
+ * Find the first tuple of a bitmap page sorting at or after a heap block and
+ * key, by binary search over the slots. Heap blocks mostly come in order, so
+ * the last tuple is tried first. Returns maxoff if all tuples sort before.
+ */
+static int
+bm_page_search(Page page, BlockNumber blk, int32 key)
+{
+	uint16	   *slots = BitmapPageGetSlots(page);
+	char	   *contents = PageGetContents(page);
+	int			lo = 0,
+				hi = BitmapPageGetOpaque(page)->maxoff;
+
+	if (hi == 0 || BM_TUPLE_BEFORE((BitmapTuple *) (contents + slots[hi - 1]), blk, key))
+		return hi;
+
+	while (lo < hi)
+	{
+		int			mid = (lo + hi) / 2;
+
+		if (BM_TUPLE_BEFORE((BitmapTuple *) (contents + slots[mid]), blk, key))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* rebuild the slots of a bitmap page from its tuples */
+void
+bm_page_set_slots(Page page)
+{
+	PageHeader	phdr = (PageHeader) page;
+	char	   *contents = PageGetContents(page);
+	BitmapTuple *itup = BitmapPageFirstTuple(page);
+	int			maxoff = BitmapPageGetOpaque(page)->maxoff;
+	uint16	   *slots;
+
+	phdr->pd_upper = phdr->pd_special - sizeof(uint16) * maxoff;
+	Assert(phdr->pd_lower <= phdr->pd_upper);
+
+	slots = BitmapPageGetSlots(page);
+	for (int i = 0; i < maxoff; i++, itup = BitmapTupleNext(itup))
+		slots[i] = (char *) itup - contents;
+}
+
+/*
+ * Add the heap tuples of a single block bitmap tuple to a bitmap page.
+ * Tuples are kept sorted by heap block and key, their starts in slots below
+ * the special space, so that the tuple covering the heap block is found by
+ * binary search. They are merged into it, which splits a run around the
+ * block, or inserted in order. A tuple extends the run right before it when
+ * its offsets match. Tuples of segmented indexes only merge with those of
+ * their value and make no runs. Returns false if the page has no room for
+ * them, inserted is set unless they were all in the page already.
+ */
 bool
 bm_page_add_tup(Page page, BitmapTuple * tuple, bool *inserted)
 {
-	BitmapTuple *itup;
-	BitmapPageOpaque opaque;
-	Pointer		ptr;
+	BitmapPageOpaque opaque = BitmapPageGetOpaque(page);
+	PageHeader	phdr = (PageHeader) page;
+	char	   *contents = PageGetContents(page);
+	char	   *end = (char *) page + phdr->pd_lower;
+	uint16	   *slots = BitmapPageGetSlots(page);
+	BitmapTuple *itup = NULL,
+			   *prev = NULL,
+			   *piece;
+	BlockNumber blk = tuple->heapblk;
+	int32		key = BitmapTupleKey(tuple);
+	uint32		buf[3 * BITMAP_TUPLE_MAX_SIZE / sizeof(uint32)];
+	uint8		offsets[MAX_HEAP_TUPLE_PER_PAGE],
+				add[MAX_HEAP_TUPLE_PER_PAGE],
+				merged[MAX_HEAP_TUPLE_PER_PAGE];
+	int			n = 0,
+				nadd,
+				nmerged = 0,
+				npieces = 0,
+				nnew,
+				pos;
+	Size		oldsize = 0,
+				newsize = 0,
+				starts[3];
+	uint16		start;
+	int			delta;
+
+	Assert(tuple->run == 0);
+
+	/* the tuple at pos starts at the block, or the one before covers it */
+	pos = bm_page_search(page, blk, key);
+	if (pos < opaque->maxoff &&
+		((BitmapTuple *) (contents + slots[pos]))->heapblk == blk &&
+		BitmapTupleKey((BitmapTuple *) (contents + slots[pos])) == key)
+		itup = (BitmapTuple *) (contents + slots[pos]);
+	else if (pos > 0)
+	{
+		prev = (BitmapTuple *) (contents + slots[pos - 1]);
+		if (blk <= BitmapTupleLastBlock(prev) && BitmapTupleKey(prev) == key)
+		{
+			itup = prev;
+			pos--;
+		}
+	}
 
-	opaque = BitmapPageGetOpaque(page);
-	for (int i = 1; i <= opaque->maxoff; i++)
+	nadd = bm_tuple_offsets(tuple, add);
+	if (itup != NULL)
 	{
-		itup = BitmapPageGetTuple(page, i);
-		if (itup->heapblk == tuple->heapblk)
+		int			i = 0,
+					j = 0;
+
+		n = bm_tuple_offsets(itup, offsets);
+		while (i < n || j < nadd)
 		{
-			for (int j = 0; j < MAX_BITS_32; j++)
+			if (j == nadd || (i < n && offsets[i] < add[j]))
+				merged[nmerged++] = offsets[i++];
+			else
 			{
-				itup->bm[j] |= tuple->bm[j];
+				if (i < n && offsets[i] == add[j])
+					i++;
+				merged[nmerged++] = add[j++];
 			}
+		}
+
+		if (nmerged == n)
+		{
 			*inserted = false;
 			return true;
 		}
+
+		oldsize = BitmapTupleSize(itup);
+		prev = pos > 0 ? (BitmapTuple *) (contents + slots[pos - 1]) : NULL;
+	}
+	else
+	{
+		memcpy(merged, add, nadd);
+		nmerged = nadd;
+	}
+
+	*inserted = true;
+
+	/* the blocks of a run before and after the merged one keep its offsets */
+	if (itup != NULL && itup->heapblk < blk)
+	{
+		piece = (BitmapTuple *) buf;
+		memcpy(piece, itup, oldsize);
+		piece->run = blk - itup->heapblk - 1;
+		starts[npieces++] = 0;
+		newsize = oldsize;
+	}
+
+	piece = (BitmapTuple *) ((char *) buf + newsize);
+	starts[npieces++] = newsize;
+	newsize += bm_tuple_encode(blk, key, merged, nmerged, piece);
+
+	if (itup != NULL && blk < BitmapTupleLastBlock(itup))
+	{
+		piece = (BitmapTuple *) ((char *) buf + newsize);
+		memcpy(piece, itup, oldsize);
+		piece->heapblk = blk + 1;
+		piece->run = BitmapTupleLastBlock(itup) - blk - 1;
+		starts[npieces++] = newsize;
+		newsize += oldsize;
+	}
+	else if (npieces == 1 && prev != NULL && key == BITMAP_NO_KEY &&
+			 BitmapTupleLastBlock(prev) + 1 == blk && prev->run < BITMAP_MAX_RUN &&
+			 bm_tuple_same_offsets(prev, (BitmapTuple *) buf))
+	{
+		/* a new or completed block continues the run before it */
+		prev->run++;
+		if (itup != NULL)
+		{
+			char	   *next = (char *) itup + oldsize;
+
+			memmove(itup, next, end - next);
+			phdr->pd_lower -= oldsize;
+			memmove(slots + 1, slots, sizeof(uint16) * pos);
+			phdr->pd_upper += sizeof(uint16);
+			slots = BitmapPageGetSlots(page);
+			for (int i = pos; i < opaque->maxoff - 1; i++)
+				slots[i] -= oldsize;
+			opaque->maxoff--;
+		}
+		return true;
 	}
 
-	if (PageGetFreeSpace(page) < sizeof(BitmapTuple))
+	/* pieces replace the merged tuple, or the new one goes at pos */
+	nnew = npieces - (itup != NULL ? 1 : 0);
+	delta = (int) newsize - (int) oldsize;
+	if (delta + (int) (sizeof(uint16) * nnew) > 0 &&
+		PageGetFreeSpace(page) < delta + sizeof(uint16) * nnew)
+	{
+		*inserted = false;
 		return false;
+	}
 
-	opaque->maxoff++;
-	ptr = (Pointer) BitmapPageGetTuple(page, opaque->maxoff);
-	memcpy(ptr, (Pointer) tuple, sizeof(BitmapTuple));
+	start = pos < opaque->maxoff ? slots[pos] : end - contents;
+	if (pos < opaque->maxoff)
+	{
+		char	   *next = contents + start + oldsize;
 
-	/* Adjust maxoff and pd_lower */
-	ptr = (Pointer) BitmapPageGetTuple(page, opaque->maxoff + 1);
-	((PageHeader) page)->pd_lower = ptr - page;
-	*inserted = true;
+		memmove(contents + start + newsize, next, end - next);
+	}
+	memcpy(contents + start, buf, newsize);
+	phdr->pd_lower += delta;
+
+	/* slots after the pieces stay where they are and shift with their tuples */
+	phdr->pd_upper -= sizeof(uint16) * nnew;
+	memmove(BitmapPageGetSlots(page), slots, sizeof(uint16) * pos);
+	slots = BitmapPageGetSlots(page);
+	for (int i = 0; i < npieces; i++)
+		slots[pos + i] = start + starts[i];
+	for (int i = pos + npieces; i < opaque->maxoff + nnew; i++)
+		slots[i] += delta;
+	opaque->maxoff += nnew;
 
 	return true;
 }
 
+/*
+ * Whether a bitmap tuple may be added to a bitmap page, checked under share
+ * lock so that only the page taking the tuple is locked exclusively. It may
+ * still not fit once its run or container grows, bm_page_add_tup tells.
+ */
+bool
+bm_page_may_add(Page page, BitmapTuple * tuple)
+{
+	uint16	   *slots = BitmapPageGetSlots(page);
+	char	   *contents = PageGetContents(page);
+	BitmapTuple *itup;
+	int			pos;
+
+	if (BitmapPageDeleted(page))
+		return false;
+
+	if (PageGetFreeSpace(page) >= BitmapTupleSize(tuple) + sizeof(uint16))
+		return true;
+
+	/* a full page may still hold the heap block already */
+	pos = bm_page_search(page, tuple->heapblk, BitmapTupleKey(tuple));
+	if (pos < BitmapPageGetOpaque(page)->maxoff)
+	{
+		itup = (BitmapTuple *) (contents + slots[pos]);
+		if (itup->heapblk == tuple->heapblk &&
+			BitmapTupleKey(itup) == BitmapTupleKey(tuple))
+			return true;
+	}
+	if (pos > 0)
+	{
+		itup = (BitmapTuple *) (contents + slots[pos - 1]);
+		if (tuple->heapblk <= BitmapTupleLastBlock(itup) &&
+			BitmapTupleKey(itup) == BitmapTupleKey(tuple))
+			return true;
+	}
+
+	return false;
+}
+
+/* record the last page and the extent of a chain in its locked first page */
+void
+bm_set_chain_end(Relation index, Buffer headbuf, BlockNumber tailBlk,
+				 BlockNumber extentBlk, uint16 extentLeft)
+{
+	BitmapPageOpaque opaque = BitmapPageGetOpaque(BufferGetPage(headbuf));
+	GenericXLogState *gxstate;
+
+	if (opaque->tailBlk == tailBlk && opaque->extentLeft == extentLeft &&
+		(extentLeft == 0 || opaque->extentBlk == extentBlk))
+		return;
+
+	gxstate = GenericXLogStart(index);
+	opaque = BitmapPageGetOpaque(GenericXLogRegisterBuffer(gxstate, headbuf, 0));
+	opaque->tailBlk = tailBlk;
+	opaque->extentBlk = extentBlk;
+	opaque->extentLeft = extentLeft;
+	GenericXLogFinish(gxstate);
+}
+
+/*
+ * Check that the index is in the page format of the library. The first
+ * format had no version, it is told by its smaller special space.
+ */
+void
+bm_check_meta(Relation index, Page page)
+{
+	BitmapMetaPageData *meta = BitmapPageGetMeta(page);
+	uint32		version = 1;
+
+	if (meta->magic != BITMAP_MAGIC_NUMBER)
+		ereport(ERROR,
+				(errcode(ERRCODE_INDEX_CORRUPTED),
+				 errmsg("index \"%s\" is not a bitmap index",
+						RelationGetRelationName(index))));
+
+	if (PageGetSpecialSize(page) == MAXALIGN(sizeof(BitmapPageSpecData)))
+		version = meta->version;
+	if (version != BITMAP_FORMAT_VERSION)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("index \"%s\" has bitmap format version %u, expected %u",
+						RelationGetRelationName(index), version,
+						BITMAP_FORMAT_VERSION),
+				 errhint("Rebuild the index with REINDEX.")));
+}
+
 BitmapMetaPageData *
 bm_get_meta(Relation index)
 {
@@ -54,8 +326,9 @@ bm_get_meta(Relation index)
 
 	buffer = ReadBuffer(index, BITMAP_METAPAGE_BLKNO);
 	LockBuffer(buffer, BUFFER_LOCK_SHARE);
+	bm_check_meta(index, BufferGetPage(buffer));
 	meta = BitmapPageGetMeta(BufferGetPage(buffer));
-	size = offsetof(BitmapMetaPageData, startBlk) + sizeof(BlockNumber) * MAX_DISTINCT;
+	size = offsetof(BitmapMetaPageData, dirBlk) + sizeof(BlockNumber) * meta->ndirpages;
 	metacpy = palloc0(size);
 	memcpy(metacpy, meta, size);
 	UnlockReleaseBuffer(buffer);
@@ -63,143 +336,240 @@ bm_get_meta(Relation index)
 	return metacpy;
 }
 
-/* insert index key values into value page, starts from block 1
-   index values are never deleted onced inserted, so the pages only keep extending */
-int
-bm_insert_val(Relation index, Datum *values, bool *isnull)
+/*
+ * Get the first bitmap page of a value through its directory page, unless
+ * the shared cache has it. Only the directory entry is read, the directory
+ * page itself is located through the backend's dictionary cache. Returns
+ * false if vacuum reclaimed the ordinal since the caller got its version.
+ */
+bool
+bm_get_start_blk(Relation index, int valindex, uint16 version, BlockNumber *startBlk)
 {
-	Page		page;
-	OffsetNumber maxoff,
-				off;
-	BlockNumber blkno;
 	Buffer		buffer;
-	Buffer		nbuffer;
-	BitmapPageOpaque opaque;
-	IndexTuple	itup;
-	int			valIndex = 0;
-	GenericXLogState *gxstate;
+	BitmapDirEntry *entry;
+	BlockNumber dirBlk;
+	bool		current;
 
-start:
-	blkno = BITMAP_VALPAGE_START_BLKNO;
-	for (;;)
-	{
-		buffer = ReadBuffer(index, blkno);
-		LockBuffer(buffer, BUFFER_LOCK_SHARE);
-		page = BufferGetPage(buffer);
-		maxoff = PageGetMaxOffsetNumber(page);
-		opaque = BitmapPageGetOpaque(page);
+	/* an empty chain may have been reclaimed, only trust cached heads */
+	if (bm_shared_get_head(index, valindex, version, startBlk) &&
+		*startBlk != InvalidBlockNumber)
+		return true;
 
-		Assert(opaque->pgtype == BITMAP_PAGE_VALUE);
+	*startBlk = InvalidBlockNumber;
+	dirBlk = bm_dict_dir_blk(index, valindex / BITMAP_DIR_ENTRIES);
+	if (dirBlk == InvalidBlockNumber)
+		return true;
 
-		for (off = FirstOffsetNumber; off <= maxoff; off = OffsetNumberNext(off))
-		{
-			ItemId		itid = PageGetItemId(page, off);
-			IndexTuple	idxtuple = (IndexTuple) PageGetItem(page, itid);
+	buffer = ReadBuffer(index, dirBlk);
+	LockBuffer(buffer, BUFFER_LOCK_SHARE);
+	entry = &BitmapPageGetDir(BufferGetPage(buffer))[valindex % BITMAP_DIR_ENTRIES];
+	current = entry->version == version && !(entry->flags & BITMAP_DIR_FREE);
+	if (current)
+	{
+		*startBlk = entry->startBlk;
+		bm_shared_set_head(index, valindex, version, *startBlk);
+	}
+	UnlockReleaseBuffer(buffer);
 
-			if (bm_vals_equal(index, values, isnull, idxtuple))
-			{
-				UnlockReleaseBuffer(buffer);
-				return valIndex;
-			}
+	return current;
+}
 
-			valIndex++;
-		}
+/*
+ * Find a directory entry freed by vacuum and return its page exclusively
+ * locked, the ordinal is returned in valindex. The search starts at the
+ * first directory page vacuum may have freed an entry on.
+ */
+static Buffer
+bm_find_free_ordinal(Relation index, BitmapMetaPageData *meta, int *valindex)
+{
+	for (int dirno = meta->freeDirno; dirno < meta->ndirpages; dirno++)
+	{
+		Buffer		buffer = ReadBuffer(index, meta->dirBlk[dirno]);
+		BitmapDirEntry *dir;
 
-		blkno = opaque->nextBlk;
-		if (blkno == InvalidBlockNumber)
+		LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+		dir = BitmapPageGetDir(BufferGetPage(buffer));
+
+		for (int i = 0; i < BITMAP_DIR_ENTRIES; i++)
 		{
-			break;
+			if (dir[i].flags & BITMAP_DIR_FREE)
+			{
+				*valindex = dirno * BITMAP_DIR_ENTRIES + i;
+				return buffer;
+			}
 		}
 
 		UnlockReleaseBuffer(buffer);
 	}
 
-	if (valIndex == MAX_DISTINCT - 1)
-		elog(WARNING, "max distinct exceeded on bitmap index \"%s\"",
-			 RelationGetRelationName(index));
-
+	elog(ERROR, "bitmap index \"%s\" has no free ordinal", RelationGetRelationName(index));
+	return InvalidBuffer;		/* keep compiler quiet */
+}
 
-	gxstate = GenericXLogStart(index);
-	LockBuffer(buffer, BUFFER_LOCK_UNLOCK);
-	LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
-	page = GenericXLogRegisterBuffer(gxstate, buffer, 0);
+/*
+ * Find room for a value tuple on the value pages vacuum freed space on,
+ * from the page given by the meta page on and at most BITMAP_VAL_REUSE_PAGES
+ * of them, and return the page exclusively locked. The page to start from
+ * next time is returned in freeBlk, InvalidBlockNumber once the last value
+ * page is reached. Returns InvalidBuffer if none of the pages has room.
+ */
+static Buffer
+bm_find_val_space(Relation index, BitmapMetaPageData *meta, Size size,
+				  BlockNumber *freeBlk)
+{
+	BlockNumber blkno = meta->valFreeBlk;
 
-	/*
-	 * contention: new values has been inserted into the page after we upgrade
-	 * to exclusive lock
-	 */
-	if (PageGetMaxOffsetNumber(page) != maxoff)
+	for (int i = 0; i < BITMAP_VAL_REUSE_PAGES && blkno != InvalidBlockNumber &&
+		 blkno != meta->valTailBlk; i++)
 	{
-		valIndex = 0;
-		GenericXLogAbort(gxstate);
-		UnlockReleaseBuffer(buffer);
-		goto start;
-	}
+		Buffer		buffer = ReadBuffer(index, blkno);
+		Page		page;
 
-	itup = index_form_tuple(RelationGetDescr(index), values, isnull);
-	if (PageGetFreeSpace(page) >= (IndexTupleSize(itup) + sizeof(ItemIdData)))
-	{
-		maxoff = PageGetMaxOffsetNumber(page) + 1;
-		if (PageAddItem(page, (Item) itup, IndexTupleSize(itup), maxoff, false, false) != maxoff)
-			elog(ERROR, "failed to add item to index data page");
+		LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+		page = BufferGetPage(buffer);
+		Assert(BitmapPageGetOpaque(page)->pgtype == BITMAP_PAGE_VALUE);
 
-		GenericXLogFinish(gxstate);
+		if (PageGetFreeSpace(page) >= size + sizeof(ItemIdData))
+		{
+			*freeBlk = blkno;
+			return buffer;
+		}
+
+		blkno = BitmapPageGetOpaque(page)->nextBlk;
 		UnlockReleaseBuffer(buffer);
-		return valIndex;
 	}
 
-	nbuffer = bm_newbuffer_locked(index);
-	BitmapPageGetOpaque(page)->nextBlk = BufferGetBlockNumber(nbuffer);
-	page = GenericXLogRegisterBuffer(gxstate, nbuffer, GENERIC_XLOG_FULL_IMAGE);
-	bm_init_page(page, BITMAP_PAGE_VALUE);
-
-	if (PageAddItem(page, (Item) itup, IndexTupleSize(itup), 1, false, false) != FirstOffsetNumber)
-		elog(ERROR, "fail to add index value");
-
-	GenericXLogFinish(gxstate);
-	UnlockReleaseBuffer(buffer);
-	UnlockReleaseBuffer(nbuffer);
-
-	return valIndex;
+	*freeBlk = blkno == meta->valTailBlk ? InvalidBlockNumber : blkno;
+	return InvalidBuffer;
 }
 
+/*
+ * Append a column value to the value pages and return its ordinal and the
+ * version of the ordinal, the location of the new value tuple or packed key
+ * is returned in tid. Ordinals reclaimed by vacuum are handed out again
+ * before new ones, and value tuples fill the space vacuum freed on earlier
+ * pages before the last one. The caller holds the meta page exclusively
+ * locked, which serializes appends and protects the value counts, hints and
+ * last value page kept on it.
+ */
 int
-bm_get_val_index(Relation index, Datum *values, bool *isnull)
+bm_append_val(Relation index, Buffer metabuf, int attno, Datum value, bool isnull,
+			  ItemPointer tid, uint16 *version)
 {
-	BlockNumber blkno = BITMAP_VALPAGE_START_BLKNO;
-	int			idx = 0;
-	Buffer		buffer;
+	BitmapMetaPageData *meta = BitmapPageGetMeta(BufferGetPage(metabuf));
 	Page		page;
-	OffsetNumber maxoff;
-	BitmapPageOpaque opaque;
+	Buffer		buffer = InvalidBuffer;
+	Buffer		nbuffer = InvalidBuffer;
+	Buffer		dirbuf = InvalidBuffer;
+	IndexTuple	itup = NULL;
+	OffsetNumber off;
+	int			valIndex = -1;
+	BlockNumber freeBlk = meta->valFreeBlk;
+	GenericXLogState *gxstate;
 
-	while (BlockNumberIsValid(blkno))
+	if (meta->nfree > 0)
+		dirbuf = bm_find_free_ordinal(index, meta, &valIndex);
+	else if (meta->nvalues >= MAX_DISTINCT)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("bitmap index \"%s\" cannot hold more than %d distinct values",
+						RelationGetRelationName(index), (int) MAX_DISTINCT)));
+
+	/* the NULL value of a packed dictionary has no key to store */
+	if (meta->keylen > 0 && isnull)
 	{
-		buffer = ReadBuffer(index, blkno);
-		LockBuffer(buffer, BUFFER_LOCK_SHARE);
-		page = BufferGetPage(buffer);
-		maxoff = PageGetMaxOffsetNumber(page);
+		gxstate = GenericXLogStart(index);
+		meta = BitmapPageGetMeta(GenericXLogRegisterBuffer(gxstate, metabuf, 0));
+		ItemPointerSetInvalid(tid);
+	}
+	else
+	{
+		/* packed keys are addressed by position, their space is not reused */
+		if (meta->keylen == 0)
+		{
+			itup = bm_form_val_tuple(index, attno, value, isnull);
+			buffer = bm_find_val_space(index, meta, IndexTupleSize(itup), &freeBlk);
+		}
 
-		for (OffsetNumber off = FirstOffsetNumber; off <= maxoff; off = OffsetNumberNext(off))
+		if (buffer == InvalidBuffer)
 		{
-			ItemId		itid = PageGetItemId(page, off);
-			IndexTuple	idxtuple = (IndexTuple) PageGetItem(page, itid);
+			buffer = ReadBuffer(index, meta->valTailBlk);
+			LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+		}
 
-			if (bm_vals_equal(index, values, isnull, idxtuple))
-			{
-				UnlockReleaseBuffer(buffer);
-				return idx;
-			}
+		gxstate = GenericXLogStart(index);
+		meta = BitmapPageGetMeta(GenericXLogRegisterBuffer(gxstate, metabuf, 0));
+		meta->valFreeBlk = freeBlk;
+		page = GenericXLogRegisterBuffer(gxstate, buffer, 0);
+
+		Assert(BitmapPageGetOpaque(page)->pgtype == BITMAP_PAGE_VALUE);
 
-			idx++;
+		if (meta->keylen > 0 ?
+			BitmapPageGetOpaque(page)->maxoff >= BITMAP_PACKED_KEYS(meta->keylen) :
+			PageGetFreeSpace(page) < (IndexTupleSize(itup) + sizeof(ItemIdData)))
+		{
+			nbuffer = bm_newbuffer_locked(index);
+			BitmapPageGetOpaque(page)->nextBlk = BufferGetBlockNumber(nbuffer);
+			page = GenericXLogRegisterBuffer(gxstate, nbuffer, GENERIC_XLOG_FULL_IMAGE);
+			bm_init_page(page, BITMAP_PAGE_VALUE);
+			meta->valTailBlk = BufferGetBlockNumber(nbuffer);
 		}
 
-		opaque = BitmapPageGetOpaque(page);
-		blkno = opaque->nextBlk;
-		UnlockReleaseBuffer(buffer);
+		if (meta->keylen > 0)
+		{
+			BitmapPageOpaque opaque = BitmapPageGetOpaque(page);
+
+			bm_packed_store(BitmapPageGetKeys(page) + opaque->maxoff * meta->keylen,
+							meta->keylen, bm_packed_key(index, value));
+			off = ++opaque->maxoff;
+			((PageHeader) page)->pd_lower = BitmapPageGetKeys(page) - (char *) page +
+				off * meta->keylen;
+		}
+		else
+		{
+			/* line pointers of deleted value tuples are taken first */
+			off = PageAddItem(page, (Item) itup, IndexTupleSize(itup), InvalidOffsetNumber,
+							  false, false);
+			if (off == InvalidOffsetNumber)
+				elog(ERROR, "failed to add item to index value page");
+		}
+
+		ItemPointerSet(tid, BufferGetBlockNumber(nbuffer != InvalidBuffer ? nbuffer : buffer),
+					   off);
 	}
 
-	return -1;
+	if (dirbuf != InvalidBuffer)
+	{
+		BitmapDirEntry *entry;
+
+		/* version was bumped when the ordinal was reclaimed */
+		entry = &BitmapPageGetDir(GenericXLogRegisterBuffer(gxstate, dirbuf, 0))
+			[valIndex % BITMAP_DIR_ENTRIES];
+		entry->flags &= ~BITMAP_DIR_FREE;
+		*version = entry->version;
+		meta->nfree--;
+		meta->freeDirno = valIndex / BITMAP_DIR_ENTRIES;
+	}
+	else
+	{
+		/* ordinals past the high water mark were never reclaimed */
+		valIndex = meta->nvalues++;
+		*version = 0;
+	}
+
+	/* values of sliced and segmented indexes have no chain to count them */
+	if (!BitmapMetaValueChains(meta))
+		meta->ndistinct++;
+
+	GenericXLogFinish(gxstate);
+	if (nbuffer != InvalidBuffer)
+		UnlockReleaseBuffer(nbuffer);
+	if (buffer != InvalidBuffer)
+		UnlockReleaseBuffer(buffer);
+	if (dirbuf != InvalidBuffer)
+		UnlockReleaseBuffer(dirbuf);
+
+	return valIndex;
 }
 
 Buffer
@@ -225,7 +595,8 @@ bm_newbuffer_locked(Relation index)
 		{
 			page = BufferGetPage(buffer);
 
-			if (BitmapPageDeleted(page))
+			/* extents left unused by their chain are handed out as well */
+			if (PageIsNew(page) || BitmapPageDeleted(page))
 				return buffer;
 
 			LockBuffer(buffer, BUFFER_LOCK_UNLOCK);
@@ -244,6 +615,86 @@ bm_newbuffer_locked(Relation index)
 	return buffer;
 }
 
+/*
+ * Extending the relation is not logged, while the extent reserved in the
+ * first page of a chain is. Log the last page of the extent, so that replay
+ * extends the relation over all of it.
+ */
+static void
+bm_log_extent_end(Relation index, Buffer buffer)
+{
+	if (RelationNeedsWAL(index))
+	{
+		LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+		START_CRIT_SECTION();
+		MarkBufferDirty(buffer);
+		log_newpage_buffer(buffer, false);
+		END_CRIT_SECTION();
+		LockBuffer(buffer, BUFFER_LOCK_UNLOCK);
+	}
+	ReleaseBuffer(buffer);
+}
+
+/*
+ * Get a new page for a chain from the extent it reserved, given by the
+ * fields of its first page or of the build state. A used up extent is
+ * replaced by extending the relation by extentPages blocks at once, the
+ * first is returned and the others reserved. Reserved pages stay new until
+ * they are used, so they can go to the free space map if the chain goes.
+ */
+Buffer
+bm_extent_newbuffer(Relation index, BlockNumber *extentBlk, uint16 *extentLeft)
+{
+	int			npages = bm_dict_get_cache(index)->extentPages;
+	Buffer		buffer;
+	Buffer		last = InvalidBuffer;
+	uint32		extended = 1;
+
+	if (*extentLeft > 0)
+	{
+		buffer = ReadBuffer(index, (*extentBlk)++);
+		LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+		(*extentLeft)--;
+		return buffer;
+	}
+
+	if (npages <= 1)
+		return bm_newbuffer_locked(index);
+
+#if PG_VERSION_NUM >= 160000
+	{
+		Buffer		buffers[BITMAP_MAX_EXTENT_PAGES];
+
+		ExtendBufferedRelBy(BMR_REL(index), MAIN_FORKNUM, NULL, EB_LOCK_FIRST,
+							npages, buffers, &extended);
+		buffer = buffers[0];
+		for (uint32 i = 1; i + 1 < extended; i++)
+			ReleaseBuffer(buffers[i]);
+		if (extended > 1)
+			last = buffers[extended - 1];
+	}
+#else
+	LockRelationForExtension(index, ExclusiveLock);
+	buffer = ReadBuffer(index, P_NEW);
+	LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+	for (; extended < npages; extended++)
+	{
+		if (last != InvalidBuffer)
+			ReleaseBuffer(last);
+		last = ReadBuffer(index, P_NEW);
+	}
+	UnlockRelationForExtension(index, ExclusiveLock);
+#endif
+
+	if (last != InvalidBuffer)
+		bm_log_extent_end(index, last);
+
+	*extentBlk = BufferGetBlockNumber(buffer) + 1;
+	*extentLeft = extended - 1;
+
+	return buffer;
+}
+
 void
 bm_init_page(Page page, uint16 pgtype)
 {
@@ -253,6 +704,10 @@ bm_init_page(Page page, uint16 pgtype)
 	opaque = BitmapPageGetOpaque(page);
 	opaque->maxoff = 0;
 	opaque->nextBlk = InvalidBlockNumber;
+	opaque->skipBlk = InvalidBlockNumber;
+	opaque->tailBlk = InvalidBlockNumber;
+	opaque->extentBlk = InvalidBlockNumber;
+	opaque->extentLeft = 0;
 	opaque->flags &= ~BITMAP_PAGE_DELETED;
 	opaque->pgtype = pgtype;
 }
@@ -263,10 +718,25 @@ bm_init_metapage(Relation index, ForkNumber fork)
 	Buffer		metabuf;
 	Page		metapage;
 	BitmapMetaPageData *meta;
+	BitmapOptions *opts = (BitmapOptions *) index->rd_options;
 	size_t		i;
 
 	GenericXLogState *state;
 
+	/* slices encode the ordinals of a single dictionary */
+	if (opts && opts->sliced && IndexRelationGetNumberOfKeyAttributes(index) > 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("sliced bitmap indexes support a single key column")));
+	if (opts && opts->sliced && opts->segmentBlocks > 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("sliced bitmap indexes cannot be segmented")));
+	if (opts && opts->stripes > 1 && (opts->sliced || opts->segmentBlocks > 0))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("sliced or segmented bitmap indexes cannot be striped")));
+
 	metabuf = ReadBufferExtended(index, fork, P_NEW, RBM_NORMAL, NULL);
 	LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
 	Assert(BufferGetBlockNumber(metabuf) == BITMAP_METAPAGE_BLKNO);
@@ -278,12 +748,47 @@ bm_init_metapage(Relation index, ForkNumber fork)
 	bm_init_page(metapage, BITMAP_PAGE_META);
 	meta = BitmapPageGetMeta(metapage);
 	meta->magic = BITMAP_MAGIC_NUMBER;
+	meta->version = BITMAP_FORMAT_VERSION;
 	meta->ndistinct = 0;
-	for (i = 0; i < MAX_DISTINCT; i++)
-		meta->startBlk[i] = InvalidBlockNumber;
+	meta->nvalues = 0;
+	meta->valTailBlk = BITMAP_VALPAGE_START_BLKNO;
 
-	((PageHeader) metapage)->pd_lower += offsetof(BitmapMetaPageData, startBlk) + \
-		sizeof(BlockNumber) * MAX_DISTINCT;
+	/*
+	 * Values are hashed when every opclass has a hash support function,
+	 * bucket pages are created by the first insertion into a bucket.
+	 */
+	meta->nbuckets = bm_hash_supported(index) ? 1 : 0;
+	meta->keylen = meta->nbuckets > 0 ? bm_packed_keylen(index) : 0;
+	for (i = 0; i < BITMAP_MAX_BUCKETS; i++)
+		meta->bucketBlk[i] = InvalidBlockNumber;
+
+	/* later changes of the options need a rebuild to take effect */
+	meta->binWidth = opts ? opts->binWidth : 0;
+	meta->binUnit = opts ? opts->binUnit : BITMAP_BIN_NONE;
+	meta->sliced = opts ? opts->sliced : false;
+	meta->segBlocks = opts ? opts->segmentBlocks : 0;
+	meta->nstripes = opts ? opts->stripes : 1;
+	meta->extentPages = opts ? opts->extentPages : 1;
+	meta->fastupdate = opts ? opts->fastupdate : false;
+	meta->pendingLimit = opts ? opts->pendingListLimit : 4096;
+	meta->pendingHead = InvalidBlockNumber;
+	meta->pendingTail = InvalidBlockNumber;
+	meta->npendingPages = 0;
+	meta->npending = 0;
+	for (i = 0; i < BITMAP_SLICES; i++)
+		meta->sliceBlk[i] = InvalidBlockNumber;
+
+	/* first directory page is created along with the meta page */
+	meta->ndirpages = 1;
+	meta->nfree = 0;
+	meta->freeDirno = 0;
+	meta->valFreeBlk = InvalidBlockNumber;
+	meta->dirBlk[0] = BITMAP_DIRPAGE_START_BLKNO;
+	for (i = 1; i < BITMAP_MAX_DIRPAGES; i++)
+		meta->dirBlk[i] = InvalidBlockNumber;
+
+	((PageHeader) metapage)->pd_lower += offsetof(BitmapMetaPageData, dirBlk) + \
+		sizeof(BlockNumber) * BITMAP_MAX_DIRPAGES;
 
 	Assert(((PageHeader) metapage)->pd_lower <= ((PageHeader) metapage)->pd_upper);
 
@@ -316,47 +821,146 @@ bm_init_valuepage(Relation index, ForkNumber fork)
 	UnlockReleaseBuffer(buffer);
 }
 
+/* initialize a directory page with no chain heads */
 void
-bm_flush_cached(Relation index, BitmapBuildState * state)
+bm_init_dir(Page page)
 {
-	BitmapPageOpaque opaque;
-	Page		page,
-				prepage,
-				bufpage;
-	Buffer		buffer,
-				prevbuff = InvalidBuffer;
-	GenericXLogState *xlogstate;
-
-	for (size_t i = 0; i < state->ndistinct; i++)
+	BitmapDirEntry *dir;
+
+	bm_init_page(page, BITMAP_PAGE_DIR);
+	dir = BitmapPageGetDir(page);
+	for (int i = 0; i < BITMAP_DIR_ENTRIES; i++)
 	{
-		bufpage = (Page) state->blocks[i];
-		opaque = BitmapPageGetOpaque(bufpage);
+		dir[i].startBlk = InvalidBlockNumber;
+		dir[i].version = 0;
+		dir[i].flags = 0;
+	}
 
-		if (opaque->maxoff > 0)
-		{
-			buffer = bm_newbuffer_locked(index);
-			xlogstate = GenericXLogStart(index);
+	((PageHeader) page)->pd_lower += sizeof(BitmapDirEntry) * BITMAP_DIR_ENTRIES;
 
-			if (state->prevBlks[i] != InvalidBlockNumber)
-			{
-				prevbuff = ReadBuffer(index, state->prevBlks[i]);
-				LockBuffer(prevbuff, BUFFER_LOCK_EXCLUSIVE);
-				prepage = GenericXLogRegisterBuffer(xlogstate, prevbuff, 0);
+	Assert(((PageHeader) page)->pd_lower <= ((PageHeader) page)->pd_upper);
+}
 
-				BitmapPageGetOpaque(prepage)->nextBlk = BufferGetBlockNumber(buffer);
-			}
+void
+bm_init_dirpage(Relation index, ForkNumber fork)
+{
+	Buffer		buffer;
+	Page		page;
+	GenericXLogState *state;
+
+	buffer = ReadBufferExtended(index, fork, P_NEW, RBM_NORMAL, NULL);
+	LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+	Assert(BufferGetBlockNumber(buffer) == BITMAP_DIRPAGE_START_BLKNO);
+
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, buffer,
+									 GENERIC_XLOG_FULL_IMAGE);
+	bm_init_dir(page);
+
+	GenericXLogFinish(state);
+	UnlockReleaseBuffer(buffer);
+}
 
-			if (state->startBlks[i] == InvalidBlockNumber)
-				state->startBlks[i] = BufferGetBlockNumber(buffer);
+/*
+ * Store chain heads of values or segments built by bmbuild into directory
+ * pages, allocating directory pages past the first one as needed.
+ */
+void
+bm_build_dir(Relation index, BlockNumber *startBlks, uint32 nvalues)
+{
+	Buffer		metabuf,
+				buffer;
+	Page		page;
+	BitmapMetaPageData *meta;
+	BitmapDirEntry *dir;
+	GenericXLogState *metastate,
+			   *state;
 
-			page = GenericXLogRegisterBuffer(xlogstate, buffer, GENERIC_XLOG_FULL_IMAGE);
-			memcpy(page, bufpage, BLCKSZ);
-			GenericXLogFinish(xlogstate);
+	metabuf = ReadBuffer(index, BITMAP_METAPAGE_BLKNO);
+	LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
+	metastate = GenericXLogStart(index);
+	meta = BitmapPageGetMeta(GenericXLogRegisterBuffer(metastate, metabuf, 0));
 
-			if (prevbuff != InvalidBuffer)
-				UnlockReleaseBuffer(prevbuff);
+	for (uint32 dirno = 0; dirno * BITMAP_DIR_ENTRIES < nvalues; dirno++)
+	{
+		uint32		first = dirno * BITMAP_DIR_ENTRIES;
+		uint32		n = Min(BITMAP_DIR_ENTRIES, nvalues - first);
 
-			UnlockReleaseBuffer(buffer);
+		state = GenericXLogStart(index);
+		if (dirno < meta->ndirpages)
+		{
+			buffer = ReadBuffer(index, meta->dirBlk[dirno]);
+			LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+			page = GenericXLogRegisterBuffer(state, buffer, 0);
 		}
+		else
+		{
+			buffer = bm_newbuffer_locked(index);
+			page = GenericXLogRegisterBuffer(state, buffer, GENERIC_XLOG_FULL_IMAGE);
+			bm_init_dir(page);
+			meta->dirBlk[dirno] = BufferGetBlockNumber(buffer);
+			meta->ndirpages++;
+		}
+
+		dir = BitmapPageGetDir(page);
+		for (uint32 i = 0; i < n; i++)
+			dir[i].startBlk = startBlks[first + i];
+
+		GenericXLogFinish(state);
+		UnlockReleaseBuffer(buffer);
 	}
+
+	/* segmented indexes count values as they are added */
+	if (BitmapMetaValueChains(meta))
+		meta->ndistinct = nvalues;
+	GenericXLogFinish(metastate);
+	UnlockReleaseBuffer(metabuf);
+}
+
+/* store the first pages of slices built by bmbuild in the meta page */
+void
+bm_build_slices(Relation index, BlockNumber *startBlks, int nslices)
+{
+	Buffer		metabuf;
+	BitmapMetaPageData *meta;
+	GenericXLogState *state;
+
+	metabuf = ReadBuffer(index, BITMAP_METAPAGE_BLKNO);
+	LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
+	state = GenericXLogStart(index);
+	meta = BitmapPageGetMeta(GenericXLogRegisterBuffer(state, metabuf, 0));
+
+	for (int k = 0; k < nslices; k++)
+		meta->sliceBlk[k] = startBlks[k];
+
+	GenericXLogFinish(state);
+	UnlockReleaseBuffer(metabuf);
+}
+
+/* copy the first pages of the slices of a sliced index */
+void
+bm_get_slice_heads(Relation index, BlockNumber *heads)
+{
+	Buffer		buffer;
+
+	buffer = ReadBuffer(index, BITMAP_METAPAGE_BLKNO);
+	LockBuffer(buffer, BUFFER_LOCK_SHARE);
+	memcpy(heads, BitmapPageGetMeta(BufferGetPage(buffer))->sliceBlk,
+		   sizeof(BlockNumber) * BITMAP_SLICES);
+	UnlockReleaseBuffer(buffer);
+}
+
+/* copy chain heads stored in a directory page */
+void
+bm_read_dir(Relation index, BlockNumber dirBlk, BlockNumber *blocks)
+{
+	Buffer		buffer;
+	BitmapDirEntry *dir;
+
+	buffer = ReadBuffer(index, dirBlk);
+	LockBuffer(buffer, BUFFER_LOCK_SHARE);
+	dir = BitmapPageGetDir(BufferGetPage(buffer));
+	for (int i = 0; i < BITMAP_DIR_ENTRIES; i++)
+		blocks[i] = dir[i].startBlk;
+	UnlockReleaseBuffer(buffer);
 }
@@ -0,0 +1,445 @@
+#include <postgres.h>
+
+#include <access/genam.h>
+#include <access/generic_xlog.h>
+#include <access/xlog.h>
+#include <catalog/pg_class.h>
+#include <miscadmin.h>
+#include <storage/bufmgr.h>
+#include <storage/indexfsm.h>
+#include <storage/lmgr.h>
+#include <utils/acl.h>
+#include <utils/memutils.h>
+#include <utils/rel.h>
+
+#include "bitmap.h"
+
+/*
+ * Pending list of fastupdate indexes. Inserts append an entry per column to
+ * the last pending page under the meta page lock, after checking in the
+ * directory that the ordinal of each entry is current, and vacuum does not
+ * reclaim ordinals while entries are pending. Merges are serialized by a
+ * heavyweight lock on the meta page. A merge seals the last page so that
+ * inserts start a new one, adds the entries up to it to the chains sorted by
+ * value and heap tuple, and only then unlinks their pages. Scans read the
+ * list before the chains, so they see every entry in one or the other.
+ */
+
+/* whether inserts go to the pending list */
+bool
+bm_fastupdate(Relation index)
+{
+	return bm_dict_get_cache(index)->fastupdate;
+}
+
+/* sort entries by value, then heap tuple */
+static int
+bm_pending_cmp(const void *a, const void *b)
+{
+	BitmapPendingEntry *ea = (BitmapPendingEntry *) a;
+	BitmapPendingEntry *eb = (BitmapPendingEntry *) b;
+
+	if (ea->valindex != eb->valindex)
+		return ea->valindex < eb->valindex ? -1 : 1;
+	if (ea->version != eb->version)
+		return ea->version < eb->version ? -1 : 1;
+
+	return ItemPointerCompare(&ea->tid, &eb->tid);
+}
+
+static int
+bm_ordinal_cmp(const void *a, const void *b)
+{
+	int			ia = *(const int *) a;
+	int			ib = *(const int *) b;
+
+	return ia < ib ? -1 : ia > ib ? 1 : 0;
+}
+
+/*
+ * Whether the ordinal of an entry is current, checked with the meta page
+ * locked. A directory page not created yet has no reclaimed entries.
+ */
+static bool
+bm_pending_current(Relation index, BitmapMetaPageData *meta, BitmapPendingEntry *entry)
+{
+	int			dirno = entry->valindex / BITMAP_DIR_ENTRIES;
+	Buffer		buffer;
+	BitmapDirEntry *dir;
+	bool		current;
+
+	if (dirno >= meta->ndirpages)
+		return true;
+
+	buffer = ReadBuffer(index, meta->dirBlk[dirno]);
+	LockBuffer(buffer, BUFFER_LOCK_SHARE);
+	dir = &BitmapPageGetDir(BufferGetPage(buffer))[entry->valindex % BITMAP_DIR_ENTRIES];
+	current = dir->version == entry->version && !(dir->flags & BITMAP_DIR_FREE);
+	UnlockReleaseBuffer(buffer);
+
+	return current;
+}
+
+/*
+ * Append the entries of a heap tuple to the pending list, all on one page.
+ * A sealed or full last page gets a new page after it. The insert that
+ * makes the list reach pendingLimit merges it, unless a merge is running.
+ */
+void
+bm_pending_insert(Relation index, Datum *values, bool *isnull, ItemPointer tid)
+{
+	int			ncols = IndexRelationGetNumberOfKeyAttributes(index);
+	BitmapPendingEntry entries[INDEX_MAX_KEYS];
+	Datum		vals[INDEX_MAX_KEYS];
+	Buffer		metabuf,
+				tailbuf = InvalidBuffer,
+				nbuffer = InvalidBuffer;
+	Page		page = NULL;
+	BitmapMetaPageData *meta;
+	BitmapPageOpaque opaque;
+	GenericXLogState *gxstate;
+	bool		merge;
+
+	for (int attno = 1; attno <= ncols; attno++)
+	{
+		BitmapPendingEntry *entry = &entries[attno - 1];
+
+		vals[attno - 1] = isnull[attno - 1] ? (Datum) 0 :
+			bm_bin_value(index, attno, values[attno - 1]);
+		entry->valindex = bm_dict_lookup(index, attno, vals[attno - 1], isnull[attno - 1],
+										 true, &entry->version);
+		entry->tid = *tid;
+	}
+
+	metabuf = ReadBuffer(index, BITMAP_METAPAGE_BLKNO);
+	for (;;)
+	{
+		int			stale = -1;
+
+		LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
+		meta = BitmapPageGetMeta(BufferGetPage(metabuf));
+		for (int i = 0; i < ncols && stale < 0; i++)
+		{
+			if (!bm_pending_current(index, meta, &entries[i]))
+				stale = i;
+		}
+
+		if (stale < 0)
+			break;
+
+		/* ordinal was reclaimed by vacuum after it was cached */
+		LockBuffer(metabuf, BUFFER_LOCK_UNLOCK);
+		bm_dict_forget(index, stale + 1, vals[stale], isnull[stale]);
+		entries[stale].valindex = bm_dict_lookup(index, stale + 1, vals[stale], isnull[stale],
+												 true, &entries[stale].version);
+	}
+
+	if (meta->pendingTail != InvalidBlockNumber)
+	{
+		tailbuf = ReadBuffer(index, meta->pendingTail);
+		LockBuffer(tailbuf, BUFFER_LOCK_EXCLUSIVE);
+	}
+
+	gxstate = GenericXLogStart(index);
+	meta = BitmapPageGetMeta(GenericXLogRegisterBuffer(gxstate, metabuf, 0));
+	if (tailbuf != InvalidBuffer)
+		page = GenericXLogRegisterBuffer(gxstate, tailbuf, 0);
+
+	if (page == NULL || (BitmapPageGetOpaque(page)->flags & BITMAP_PAGE_SEALED) ||
+		BitmapPageGetOpaque(page)->maxoff + ncols > BITMAP_PENDING_ENTRIES)
+	{
+		Page		npage;
+
+		nbuffer = bm_newbuffer_locked(index);
+		npage = GenericXLogRegisterBuffer(gxstate, nbuffer, GENERIC_XLOG_FULL_IMAGE);
+		bm_init_page(npage, BITMAP_PAGE_PENDING);
+
+		if (page != NULL)
+			BitmapPageGetOpaque(page)->nextBlk = BufferGetBlockNumber(nbuffer);
+		else
+			meta->pendingHead = BufferGetBlockNumber(nbuffer);
+		meta->pendingTail = BufferGetBlockNumber(nbuffer);
+		meta->npendingPages++;
+		page = npage;
+	}
+
+	opaque = BitmapPageGetOpaque(page);
+	memcpy(&BitmapPageGetPending(page)[opaque->maxoff], entries,
+		   sizeof(BitmapPendingEntry) * ncols);
+	opaque->maxoff += ncols;
+	((PageHeader) page)->pd_lower += sizeof(BitmapPendingEntry) * ncols;
+	meta->npending += ncols;
+
+	merge = (uint64) meta->npendingPages * (BLCKSZ / 1024) >= meta->pendingLimit;
+
+	GenericXLogFinish(gxstate);
+	if (nbuffer != InvalidBuffer)
+		UnlockReleaseBuffer(nbuffer);
+	if (tailbuf != InvalidBuffer)
+		UnlockReleaseBuffer(tailbuf);
+	UnlockReleaseBuffer(metabuf);
+
+	if (merge)
+		bm_pending_merge(index, false);
+}
+
+/*
+ * Merge the pending list into the chains and return the number of entries
+ * merged. The heap tuples of a value in a heap block make one bitmap tuple.
+ * Without wait nothing is merged if another merge is running.
+ */
+int64
+bm_pending_merge(Relation index, bool wait)
+{
+	Buffer		metabuf,
+				buffer;
+	Page		page;
+	BitmapMetaPageData *meta;
+	GenericXLogState *gxstate;
+	BlockNumber headBlk,
+				tailBlk,
+				nextBlk,
+				blkno;
+	BitmapPendingEntry *entries;
+	BitmapTuple *tup;
+	int64		nentries = 0,
+				maxentries;
+	uint32		npages = 0;
+	MemoryContext cxt,
+				oldCxt;
+
+	if (wait)
+		LockPage(index, BITMAP_METAPAGE_BLKNO, ExclusiveLock);
+	else if (!ConditionalLockPage(index, BITMAP_METAPAGE_BLKNO, ExclusiveLock))
+		return 0;
+
+	/* inserts wait for the meta page, none is halfway once it is locked */
+	metabuf = ReadBuffer(index, BITMAP_METAPAGE_BLKNO);
+	LockBuffer(metabuf, BUFFER_LOCK_SHARE);
+	meta = BitmapPageGetMeta(BufferGetPage(metabuf));
+	headBlk = meta->pendingHead;
+	tailBlk = meta->pendingTail;
+	maxentries = meta->npending;
+
+	if (headBlk == InvalidBlockNumber)
+	{
+		UnlockReleaseBuffer(metabuf);
+		UnlockPage(index, BITMAP_METAPAGE_BLKNO, ExclusiveLock);
+		return 0;
+	}
+
+	buffer = ReadBuffer(index, tailBlk);
+	LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+	gxstate = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(gxstate, buffer, 0);
+	BitmapPageGetOpaque(page)->flags |= BITMAP_PAGE_SEALED;
+	GenericXLogFinish(gxstate);
+	UnlockReleaseBuffer(buffer);
+	UnlockReleaseBuffer(metabuf);
+
+	cxt = AllocSetContextCreate(CurrentMemoryContext, "bitmap pending merge",
+								ALLOCSET_DEFAULT_SIZES);
+	oldCxt = MemoryContextSwitchTo(cxt);
+	entries = MemoryContextAllocHuge(cxt, sizeof(BitmapPendingEntry) * Max(maxentries, 1));
+
+	for (blkno = headBlk;;)
+	{
+		BitmapPageOpaque opaque;
+
+		buffer = ReadBuffer(index, blkno);
+		LockBuffer(buffer, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buffer);
+		opaque = BitmapPageGetOpaque(page);
+
+		if (nentries + opaque->maxoff > maxentries)
+			elog(ERROR, "pending list of bitmap index \"%s\" has more entries than counted",
+				 RelationGetRelationName(index));
+
+		memcpy(entries + nentries, BitmapPageGetPending(page),
+			   sizeof(BitmapPendingEntry) * opaque->maxoff);
+		nentries += opaque->maxoff;
+		npages++;
+
+		nextBlk = opaque->nextBlk;
+		UnlockReleaseBuffer(buffer);
+		if (blkno == tailBlk)
+			break;
+		blkno = nextBlk;
+	}
+
+	qsort(entries, nentries, sizeof(BitmapPendingEntry), bm_pending_cmp);
+
+	tup = palloc(BITMAP_TUPLE_MAX_SIZE);
+	for (int64 i = 0; i < nentries;)
+	{
+		BitmapPendingEntry *first = &entries[i];
+		BlockNumber heapblk = ItemPointerGetBlockNumber(&first->tid);
+		uint8		offsets[MAX_HEAP_TUPLE_PER_PAGE];
+		int			n = 0;
+
+		CHECK_FOR_INTERRUPTS();
+
+		for (; i < nentries && entries[i].valindex == first->valindex &&
+			 entries[i].version == first->version &&
+			 ItemPointerGetBlockNumber(&entries[i].tid) == heapblk; i++)
+		{
+			uint8		offset = ItemPointerGetOffsetNumber(&entries[i].tid) - 1;
+
+			if (n == 0 || offsets[n - 1] != offset)
+				offsets[n++] = offset;
+		}
+
+		bm_tuple_encode(heapblk, BITMAP_NO_KEY, offsets, n, tup);
+		if (!bm_insert_value(index, first->valindex, first->version, tup))
+			elog(ERROR, "ordinal %d of a pending entry was reclaimed", first->valindex);
+	}
+
+	/* unlink the merged pages, entries appended since are on later ones */
+	metabuf = ReadBuffer(index, BITMAP_METAPAGE_BLKNO);
+	LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
+	buffer = ReadBuffer(index, tailBlk);
+	LockBuffer(buffer, BUFFER_LOCK_SHARE);
+	nextBlk = BitmapPageGetOpaque(BufferGetPage(buffer))->nextBlk;
+	UnlockReleaseBuffer(buffer);
+
+	gxstate = GenericXLogStart(index);
+	meta = BitmapPageGetMeta(GenericXLogRegisterBuffer(gxstate, metabuf, 0));
+	meta->pendingHead = nextBlk;
+	if (nextBlk == InvalidBlockNumber)
+		meta->pendingTail = InvalidBlockNumber;
+	meta->npendingPages -= npages;
+	meta->npending -= nentries;
+	GenericXLogFinish(gxstate);
+	UnlockReleaseBuffer(metabuf);
+
+	/* scans walk the list under the meta page lock and no longer reach them */
+	for (blkno = headBlk; blkno != nextBlk;)
+	{
+		BlockNumber next;
+
+		buffer = ReadBuffer(index, blkno);
+		LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+		gxstate = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(gxstate, buffer, 0);
+		next = BitmapPageGetOpaque(page)->nextBlk;
+		BitmapPageSetDeleted(page);
+		GenericXLogFinish(gxstate);
+		UnlockReleaseBuffer(buffer);
+
+		RecordFreeIndexPage(index, blkno);
+		blkno = next;
+	}
+
+	UnlockPage(index, BITMAP_METAPAGE_BLKNO, ExclusiveLock);
+
+	MemoryContextSwitchTo(oldCxt);
+	MemoryContextDelete(cxt);
+
+	return nentries;
+}
+
+/*
+ * Add the pending heap tuples of some values to a bitmap, those of every
+ * value if n is negative. The meta page stays share locked while the list
+ * is read, so that no merge unlinks its pages meanwhile.
+ */
+void
+bm_pending_to_tbm(Relation index, int *valindexes, int n, TIDBitmap *tbm,
+				  bool recheck)
+{
+	Buffer		metabuf,
+				buffer;
+	BlockNumber blkno;
+	int		   *sorted = NULL;
+
+	if (n == 0)
+		return;
+
+	if (n > 0)
+	{
+		sorted = palloc(sizeof(int) * n);
+		memcpy(sorted, valindexes, sizeof(int) * n);
+		qsort(sorted, n, sizeof(int), bm_ordinal_cmp);
+	}
+
+	metabuf = ReadBuffer(index, BITMAP_METAPAGE_BLKNO);
+	LockBuffer(metabuf, BUFFER_LOCK_SHARE);
+	blkno = BitmapPageGetMeta(BufferGetPage(metabuf))->pendingHead;
+
+	while (blkno != InvalidBlockNumber)
+	{
+		Page		page;
+		BitmapPendingEntry *entries;
+
+		buffer = ReadBuffer(index, blkno);
+		LockBuffer(buffer, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buffer);
+		entries = BitmapPageGetPending(page);
+
+		for (int i = 0; i < BitmapPageGetOpaque(page)->maxoff; i++)
+		{
+			if (n < 0 || bsearch(&entries[i].valindex, sorted, n, sizeof(int),
+								 bm_ordinal_cmp) != NULL)
+				tbm_add_tuples(tbm, &entries[i].tid, 1, recheck);
+		}
+
+		blkno = BitmapPageGetOpaque(page)->nextBlk;
+		UnlockReleaseBuffer(buffer);
+	}
+
+	UnlockReleaseBuffer(metabuf);
+
+	if (sorted != NULL)
+		pfree(sorted);
+}
+
+PG_FUNCTION_INFO_V1(bm_pending_flush);
+
+/* -------------------------------------
+ * Merge the pending list of a fastupdate index into its chains, returns
+ * the number of entries merged
+ *
+ * Usage: SELECT bm_pending_flush('index_name')
+ */
+
+Datum
+bm_pending_flush(PG_FUNCTION_ARGS)
+{
+	Oid			indexoid = PG_GETARG_OID(0);
+	Relation	index;
+	int64		nmerged = 0;
+
+	if (RecoveryInProgress())
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("recovery is in progress"),
+				 errhint("Pending list cannot be merged during recovery.")));
+
+	index = index_open(indexoid, RowExclusiveLock);
+
+	if (index->rd_indam->ambuild != bmbuild)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("\"%s\" is not a %s index",
+						RelationGetRelationName(index), "bitmap")));
+
+	if (RELATION_IS_OTHER_TEMP(index))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("cannot access temporary indexes of other sessions")));
+
+#if PG_VERSION_NUM >= 160000
+	if (!object_ownercheck(RelationRelationId, indexoid, GetUserId()))
+#else
+	if (!pg_class_ownercheck(indexoid, GetUserId()))
+#endif
+		aclcheck_error(ACLCHECK_NOT_OWNER, OBJECT_INDEX,
+					   RelationGetRelationName(index));
+
+	if (bm_fastupdate(index))
+		nmerged = bm_pending_merge(index, true);
+
+	index_close(index, RowExclusiveLock);
+
+	PG_RETURN_INT64(nmerged);
+}
@@ -1,37 +1,579 @@
 #include <postgres.h>
 
 #include <access/relscan.h>
+#include <miscadmin.h>
 #include <storage/bufmgr.h>
+#include <utils/datum.h>
+#include <utils/rel.h>
 
 #include "bitmap.h"
 
+/* comparison keys are answered from the dictionary, not from a single chain */
+#define BM_RANGE_KEY(skey) \
+	(!((skey)->sk_flags & (SK_SEARCHNULL | SK_SEARCHNOTNULL)) && \
+	 (skey)->sk_strategy != BITMAP_EQUAL_STRATEGY)
+
 static void
 reset_scan_for_next_page(BitmapScanOpaque so)
 {
 	so->offset = 0;
 	so->maxoffset = 0;
-	so->htupidx = 0;
+	so->htupidx = -1;
+	so->runidx = 0;
 }
 
 static void
 init_scan_opaque(BitmapScanOpaque so)
 {
+	so->started = false;
 	so->keyIndex = -1;
-	so->curPage = NULL;
 	so->curBlk = InvalidBlockNumber;
+	so->tbm = NULL;
+	so->iterator = NULL;
+	so->tbmres = NULL;
+	so->tbmoff = 0;
 	reset_scan_for_next_page(so);
 }
 
+static void
+free_scan_bitmap(BitmapScanOpaque so)
+{
+	if (so->iterator)
+		tbm_end_iterate(so->iterator);
+	if (so->tbm)
+		tbm_free(so->tbm);
+	so->iterator = NULL;
+	so->tbm = NULL;
+}
+
+/*
+ * Find a key value resolved by an earlier rescan and move it to the front,
+ * -1 if it is not cached. Datums are compared by image, so values equal
+ * under another image are just looked up in the dictionary.
+ */
+static int
+bm_scan_cached_key(IndexScanDesc scan, AttrNumber attno, Datum value,
+				   bool isnull, uint16 *version)
+{
+	BitmapScanOpaque so = (BitmapScanOpaque) scan->opaque;
+	Form_pg_attribute att = TupleDescAttr(RelationGetDescr(scan->indexRelation), attno - 1);
+	BitmapScanKeyEntry entry;
+
+	for (int k = 0; k < so->nkeys; k++)
+	{
+		if (so->keys[k].attno != attno || so->keys[k].isnull != isnull ||
+			(!isnull && !datumIsEqual(value, so->keys[k].value,
+									  att->attbyval, att->attlen)))
+			continue;
+
+		entry = so->keys[k];
+		memmove(&so->keys[1], &so->keys[0], sizeof(BitmapScanKeyEntry) * k);
+		so->keys[0] = entry;
+
+		*version = entry.version;
+		return entry.valindex;
+	}
+
+	return -1;
+}
+
+/* drop the least recently used key once the cache is full */
+static void
+bm_scan_drop_key(IndexScanDesc scan, int k)
+{
+	BitmapScanOpaque so = (BitmapScanOpaque) scan->opaque;
+	TupleDesc	tupdesc = RelationGetDescr(scan->indexRelation);
+	BitmapScanKeyEntry *entry = &so->keys[k];
+
+	if (!entry->isnull && !TupleDescAttr(tupdesc, entry->attno - 1)->attbyval)
+		pfree(DatumGetPointer(entry->value));
+
+	so->nkeys--;
+	memmove(&so->keys[k], &so->keys[k + 1], sizeof(BitmapScanKeyEntry) * (so->nkeys - k));
+}
+
+static void
+bm_scan_cache_key(IndexScanDesc scan, AttrNumber attno, Datum value,
+				  bool isnull, int valindex, uint16 version)
+{
+	BitmapScanOpaque so = (BitmapScanOpaque) scan->opaque;
+	Form_pg_attribute att = TupleDescAttr(RelationGetDescr(scan->indexRelation), attno - 1);
+	BitmapScanKeyEntry *entry = &so->keys[0];
+	MemoryContext oldCxt;
+
+	if (so->nkeys == BITMAP_SCAN_KEYS)
+		bm_scan_drop_key(scan, so->nkeys - 1);
+
+	memmove(&so->keys[1], &so->keys[0], sizeof(BitmapScanKeyEntry) * so->nkeys);
+	so->nkeys++;
+
+	oldCxt = MemoryContextSwitchTo(so->scanCxt);
+	entry->attno = attno;
+	entry->isnull = isnull;
+	entry->value = isnull ? (Datum) 0 : datumCopy(value, att->attbyval, att->attlen);
+	MemoryContextSwitchTo(oldCxt);
+
+	entry->valindex = valindex;
+	entry->version = version;
+}
+
+/*
+ * Resolve a column value to its ordinal and the first bitmap page of its
+ * chain, false if the value is not indexed.
+ */
+static bool
+bm_value_head(Relation index, AttrNumber attno, Datum value, bool isnull,
+			  int *valindex, uint16 *version, BlockNumber *startBlk)
+{
+	for (;;)
+	{
+		*valindex = bm_dict_lookup(index, attno, value, isnull, false, version);
+		if (*valindex < 0)
+			return false;
+
+		if (bm_get_start_blk(index, *valindex, *version, startBlk))
+			return true;
+
+		/* ordinal was reclaimed by vacuum after it was cached */
+		bm_dict_forget(index, attno, value, isnull);
+	}
+}
+
+/*
+ * Resolve an equality or IS NULL scan key to the first bitmap page of the
+ * chain of its value, false if the value is not indexed. The inner side of a
+ * nested loop is rescanned for every outer row, often with the same few keys,
+ * so the ordinals of recent keys are kept across rescans. Chain heads move
+ * when vacuum frees pages and are read from the directory each time.
+ */
+static bool
+bm_scan_key_head(IndexScanDesc scan, ScanKey skey, BlockNumber *startBlk)
+{
+	BitmapScanOpaque so = (BitmapScanOpaque) scan->opaque;
+	Relation	index = scan->indexRelation;
+	AttrNumber	attno = skey->sk_attno;
+	bool		isnull = (skey->sk_flags & SK_ISNULL) != 0;
+	Datum		value;
+	uint16		version;
+
+	/* a NULL argument of a strict operator matches nothing */
+	if (isnull && !(skey->sk_flags & SK_SEARCHNULL))
+		return false;
+
+	value = isnull ? (Datum) 0 : bm_bin_value(index, attno, skey->sk_argument);
+
+	so->keyIndex = bm_scan_cached_key(scan, attno, value, isnull, &version);
+	if (so->keyIndex >= 0)
+	{
+		if (bm_get_start_blk(index, so->keyIndex, version, startBlk))
+			return true;
+
+		/* reclaimed by vacuum since an earlier rescan */
+		bm_scan_drop_key(scan, 0);
+		bm_dict_forget(index, attno, value, isnull);
+	}
+
+	if (!bm_value_head(index, attno, value, isnull, &so->keyIndex, &version, startBlk))
+		return false;
+
+	bm_scan_cache_key(scan, attno, value, isnull, so->keyIndex, version);
+	return true;
+}
+
+/* add the heap tuples of a chain to a bitmap, returns their number */
+static int64
+bm_chain_to_tbm(Relation index, BlockNumber blkno, TIDBitmap *tbm,
+				bool recheck, ItemPointer tids)
+{
+	int64		ntids = 0;
+	Buffer		buffer;
+	Page		page;
+	BitmapPageOpaque opaque;
+	BitmapTuple *itup;
+
+	while (blkno != InvalidBlockNumber)
+	{
+		buffer = ReadBuffer(index, blkno);
+		LockBuffer(buffer, BUFFER_LOCK_SHARE);
+
+		page = BufferGetPage(buffer);
+		opaque = BitmapPageGetOpaque(page);
+
+		itup = BitmapPageFirstTuple(page);
+		for (OffsetNumber offset = 1; offset <= opaque->maxoff; offset++)
+		{
+			int			count = bm_tuple_to_tids(itup, tids);
+
+			/* a run adds the offsets decoded once to each of its heap blocks */
+			for (int r = 0; r <= itup->run; r++)
+			{
+				for (int i = 0; r > 0 && i < count; i++)
+					ItemPointerSetBlockNumber(&tids[i], itup->heapblk + r);
+
+				tbm_add_tuples(tbm, tids, count, recheck);
+				ntids += count;
+			}
+			itup = BitmapTupleNext(itup);
+		}
+
+		blkno = opaque->nextBlk;
+		UnlockReleaseBuffer(buffer);
+	}
+
+	return ntids;
+}
+
+/* add the heap tuples of a value to a bitmap, those of every stripe if striped */
+static int64
+bm_value_to_tbm(Relation index, BlockNumber startBlk, TIDBitmap *tbm,
+				bool recheck, ItemPointer tids)
+{
+	BlockNumber heads[BITMAP_MAX_STRIPES];
+	int64		ntids = 0;
+	int			n;
+
+	if (startBlk == InvalidBlockNumber || !bm_striped(index))
+		return bm_chain_to_tbm(index, startBlk, tbm, recheck, tids);
+
+	n = bm_stripe_heads(index, startBlk, heads);
+	for (int k = 0; k < n; k++)
+		ntids += bm_chain_to_tbm(index, heads[k], tbm, recheck, tids);
+
+	return ntids;
+}
+
+/* add every indexed heap tuple to a bitmap */
+static void
+bm_all_to_tbm(Relation index, TIDBitmap *tbm, ItemPointer tids)
+{
+	BitmapMetaPageData *meta = bm_get_meta(index);
+	BlockNumber *blocks = palloc(sizeof(BlockNumber) * BITMAP_DIR_ENTRIES);
+
+	if (bm_fastupdate(index))
+		bm_pending_to_tbm(index, NULL, -1, tbm, true);
+
+	for (int dirno = 0; dirno < meta->ndirpages; dirno++)
+	{
+		bm_read_dir(index, meta->dirBlk[dirno], blocks);
+
+		for (int i = 0; i < BITMAP_DIR_ENTRIES; i++)
+			bm_value_to_tbm(index, blocks[i], tbm, true, tids);
+	}
+
+	/* every heap tuple of a sliced index is in some slice */
+	for (int k = 0; k < BITMAP_SLICES; k++)
+		bm_chain_to_tbm(index, meta->sliceBlk[k], tbm, true, tids);
+
+	pfree(blocks);
+	pfree(meta);
+}
+
+/* whether a column value satisfies a comparison with the key argument */
+static bool
+bm_range_match(int32 cmp, StrategyNumber strategy)
+{
+	switch (strategy)
+	{
+		case BITMAP_LESS_STRATEGY:
+			return cmp < 0;
+		case BITMAP_LESS_EQUAL_STRATEGY:
+			return cmp <= 0;
+		case BITMAP_GREATER_EQUAL_STRATEGY:
+			return cmp >= 0;
+		case BITMAP_GREATER_STRATEGY:
+			return cmp > 0;
+		default:
+			elog(ERROR, "unrecognized strategy number: %d", strategy);
+	}
+
+	return false;
+}
+
+/*
+ * Add the chains of the column values a comparison key matches. Value pages
+ * are walked and each match resolved through the dictionary, so the cost
+ * follows the number of distinct values. Binned columns compare bins, where
+ * a strict comparison matches the bin of its argument too. The matches are
+ * collected and read once the value pages are walked, so that the pending
+ * list and the segments of a segmented index are read once for all of them.
+ */
+static void
+bm_range_to_tbm(IndexScanDesc scan, ScanKey skey, TIDBitmap *tbm,
+				bool recheck, ItemPointer tids)
+{
+	Relation	index = scan->indexRelation;
+	AttrNumber	attno = skey->sk_attno;
+	int			keylen = bm_dict_get_cache(index)->keylen;
+	FmgrInfo   *cmpproc = index_getprocinfo(index, attno, BITMAP_EQUAL_PROC);
+	Datum		arg = bm_bin_value(index, attno, skey->sk_argument);
+	StrategyNumber strategy = skey->sk_strategy;
+	Page		page = (Page) palloc(sizeof(PGAlignedBlock));
+	BlockNumber blkno = BITMAP_VALPAGE_START_BLKNO;
+	int		   *matches = NULL;
+	BlockNumber *heads = NULL;
+	int			nmatches = 0,
+				maxmatches = 0;
+
+	if (bm_binned(index, attno))
+	{
+		if (strategy == BITMAP_LESS_STRATEGY)
+			strategy = BITMAP_LESS_EQUAL_STRATEGY;
+		else if (strategy == BITMAP_GREATER_STRATEGY)
+			strategy = BITMAP_GREATER_EQUAL_STRATEGY;
+	}
+
+	while (blkno != InvalidBlockNumber)
+	{
+		Buffer		buffer = ReadBuffer(index, blkno);
+		int			nvals;
+
+		/* values are resolved with the page lock released */
+		LockBuffer(buffer, BUFFER_LOCK_SHARE);
+		memcpy(page, BufferGetPage(buffer), BLCKSZ);
+		UnlockReleaseBuffer(buffer);
+
+		Assert(BitmapPageGetOpaque(page)->pgtype == BITMAP_PAGE_VALUE);
+
+		nvals = keylen > 0 ? BitmapPageGetOpaque(page)->maxoff : PageGetMaxOffsetNumber(page);
+		for (int i = 0; i < nvals; i++)
+		{
+			Datum		value;
+			bool		isnull = false;
+			int			valindex;
+			uint16		version;
+			BlockNumber startBlk;
+
+			if (keylen > 0)
+				value = bm_packed_datum(keylen,
+										bm_packed_load(BitmapPageGetKeys(page) + i * keylen, keylen));
+			else
+			{
+				ItemId		itemid = PageGetItemId(page, i + 1);
+				IndexTuple	itup;
+
+				if (!ItemIdIsUsed(itemid))
+					continue;
+
+				itup = (IndexTuple) PageGetItem(page, itemid);
+				if (BitmapValTupleGetAttno(itup) != attno)
+					continue;
+
+				value = index_getattr(itup, attno, RelationGetDescr(index), &isnull);
+			}
+
+			if (isnull ||
+				!bm_range_match(DatumGetInt32(FunctionCall2Coll(cmpproc,
+																index->rd_indcollation[attno - 1],
+																value, arg)),
+								strategy))
+				continue;
+
+			if (!bm_value_head(index, attno, value, false, &valindex, &version, &startBlk))
+				continue;
+
+			if (nmatches == maxmatches)
+			{
+				maxmatches = Max(maxmatches * 2, 64);
+				matches = matches == NULL ? palloc(sizeof(int) * maxmatches) :
+					repalloc(matches, sizeof(int) * maxmatches);
+				heads = heads == NULL ? palloc(sizeof(BlockNumber) * maxmatches) :
+					repalloc(heads, sizeof(BlockNumber) * maxmatches);
+			}
+			matches[nmatches] = valindex;
+			heads[nmatches++] = startBlk;
+		}
+
+		blkno = BitmapPageGetOpaque(page)->nextBlk;
+	}
+
+	if (nmatches > 0)
+	{
+		if (bm_fastupdate(index))
+			bm_pending_to_tbm(index, matches, nmatches, tbm, recheck);
+
+		if (bm_segmented(index))
+			bm_segments_to_tbm(index, matches, nmatches, tbm, recheck);
+		else
+		{
+			for (int j = 0; j < nmatches; j++)
+			{
+				if (bm_sliced(index))
+					bm_slices_to_tbm(index, matches[j], tbm, recheck);
+				else
+					bm_value_to_tbm(index, heads[j], tbm, recheck, tids);
+			}
+		}
+
+		pfree(matches);
+		pfree(heads);
+	}
+
+	pfree(page);
+}
+
+/*
+ * Intersect the matches of the scan keys, NULL if some key value is not
+ * indexed. IS NOT NULL keys only make the result lossy: they are left to the
+ * recheck, and without any other key every indexed tuple is returned.
+ */
+static TIDBitmap *
+bm_scan_intersect(IndexScanDesc scan)
+{
+	BitmapScanOpaque so = (BitmapScanOpaque) scan->opaque;
+	Relation	index = scan->indexRelation;
+	ScanKey		keys[INDEX_MAX_KEYS];
+	BlockNumber heads[INDEX_MAX_KEYS];
+	int			ords[INDEX_MAX_KEYS];
+	int			nkeys = 0;
+	TIDBitmap  *result = NULL;
+	ItemPointer tids;
+	MemoryContext oldCxt;
+
+	/* resolve equality keys first, one missing value means no match */
+	for (int i = 0; i < scan->numberOfKeys; i++)
+	{
+		ScanKey		skey = &scan->keyData[i];
+
+		if (skey->sk_flags & SK_SEARCHNOTNULL)
+			continue;
+
+		if (BM_RANGE_KEY(skey))
+		{
+			if (skey->sk_flags & SK_ISNULL)
+				return NULL;
+		}
+		else if (!bm_scan_key_head(scan, skey, &heads[nkeys]))
+			return NULL;
+
+		ords[nkeys] = so->keyIndex;
+		keys[nkeys++] = skey;
+	}
+
+	tids = palloc0(sizeof(ItemPointerData) * MAX_HEAP_TUPLE_PER_PAGE);
+
+	oldCxt = MemoryContextSwitchTo(so->scanCxt);
+	result = tbm_create(work_mem * 1024L, NULL);
+	MemoryContextSwitchTo(oldCxt);
+
+	if (nkeys == 0)
+		bm_all_to_tbm(index, result, tids);
+
+	for (int i = 0; i < nkeys && (i == 0 || !tbm_is_empty(result)); i++)
+	{
+		TIDBitmap  *tbm = i == 0 ? result : tbm_create(work_mem * 1024L, NULL);
+
+		/* pending entries go first, a merge moves them to the chains */
+		if (!BM_RANGE_KEY(keys[i]) && bm_fastupdate(index))
+			bm_pending_to_tbm(index, &ords[i], 1, tbm, so->recheck);
+
+		if (BM_RANGE_KEY(keys[i]))
+			bm_range_to_tbm(scan, keys[i], tbm, so->recheck, tids);
+		else if (bm_sliced(index))
+			bm_slices_to_tbm(index, ords[i], tbm, so->recheck);
+		else if (bm_segmented(index))
+			bm_segments_to_tbm(index, &ords[i], 1, tbm, so->recheck);
+		else
+			bm_value_to_tbm(index, heads[i], tbm, so->recheck, tids);
+
+		if (tbm != result)
+		{
+			tbm_intersect(result, tbm);
+			tbm_free(tbm);
+		}
+	}
+
+	pfree(tids);
+	return result;
+}
+
+/*
+ * Resolve the scan keys, false if nothing can match. A single equality key
+ * is read straight from its chain, other keys and the keys of sliced,
+ * segmented, striped or fastupdate indexes are merged into a bitmap.
+ */
+static bool
+bm_scan_start(IndexScanDesc scan)
+{
+	BitmapScanOpaque so = (BitmapScanOpaque) scan->opaque;
+	ScanKey		skey = scan->keyData;
+
+	so->started = true;
+	so->recheck = false;
+
+	/* binned keys match whole bins */
+	for (int i = 0; i < scan->numberOfKeys; i++)
+	{
+		if (scan->keyData[i].sk_flags & SK_SEARCHNOTNULL ||
+			(!(scan->keyData[i].sk_flags & SK_SEARCHNULL) &&
+			 bm_binned(scan->indexRelation, scan->keyData[i].sk_attno)))
+			so->recheck = true;
+	}
+
+	if (scan->numberOfKeys == 1 && !bm_sliced(scan->indexRelation) &&
+		!bm_segmented(scan->indexRelation) && !bm_striped(scan->indexRelation) &&
+		!bm_fastupdate(scan->indexRelation) &&
+		!(skey->sk_flags & SK_SEARCHNOTNULL) && !BM_RANGE_KEY(skey))
+		return bm_scan_key_head(scan, skey, &so->curBlk);
+
+	so->tbm = bm_scan_intersect(scan);
+	return so->tbm != NULL;
+}
+
+/* next heap tuple of the intersected bitmap */
+static bool
+bm_scan_next_tid(IndexScanDesc scan)
+{
+	BitmapScanOpaque so = (BitmapScanOpaque) scan->opaque;
+	TBMIterateResult *res;
+
+	if (so->iterator == NULL)
+		so->iterator = tbm_begin_iterate(so->tbm);
+
+	for (;;)
+	{
+		if (so->tbmres == NULL)
+		{
+			so->tbmres = tbm_iterate(so->iterator);
+			so->tbmoff = 0;
+			if (so->tbmres == NULL)
+				return false;
+		}
+
+		res = so->tbmres;
+
+		/* lossy pages return every possible offset, for the heap to skip */
+		if (res->ntuples >= 0 ? so->tbmoff < res->ntuples :
+			so->tbmoff < MaxHeapTuplesPerPage)
+		{
+			OffsetNumber offset = res->ntuples >= 0 ?
+				res->offsets[so->tbmoff] : so->tbmoff + 1;
+
+			so->tbmoff++;
+			ItemPointerSet(&scan->xs_heaptid, res->blockno, offset);
+			scan->xs_recheck = res->recheck || res->ntuples < 0;
+			return true;
+		}
+
+		so->tbmres = NULL;
+	}
+}
+
 IndexScanDesc
 bmbeginscan(Relation r, int nkeys, int norderbys)
 {
 	IndexScanDesc scan;
 	BitmapScanOpaque so;
 
+	/* heap tuples buffered by inserts of this backend are found as well */
+	bm_insert_flush_index(r);
+
 	scan = RelationGetIndexScan(r, nkeys, norderbys);
 
 	so = (BitmapScanOpaque) palloc0(sizeof(BitmapScanOpaqueData));
 	init_scan_opaque(so);
+	so->curPage = NULL;
+	so->scanCxt = CurrentMemoryContext;
+	so->nkeys = 0;
 	scan->opaque = so;
 
 	return scan;
@@ -43,6 +585,7 @@ bmrescan(IndexScanDesc scan, ScanKey scankey, int nscankeys,
 {
 	BitmapScanOpaque so = (BitmapScanOpaque) scan->opaque;
 
+	free_scan_bitmap(so);
 	init_scan_opaque(so);
 
 	if (scankey && scan->numberOfKeys > 0)
@@ -57,6 +600,7 @@ bmendscan(IndexScanDesc scan)
 {
 	BitmapScanOpaque so = (BitmapScanOpaque) scan->opaque;
 
+	free_scan_bitmap(so);
 	if (so->curPage)
 		pfree(so->curPage);
 }
@@ -66,52 +610,27 @@ bmgettuple(IndexScanDesc scan, ScanDirection dir)
 {
 	BitmapScanOpaque so = (BitmapScanOpaque) scan->opaque;
 	Relation	index = scan->indexRelation;
-	Datum		values[INDEX_MAX_KEYS];
-	bool		isnull[INDEX_MAX_KEYS];
 	Buffer		buffer;
-	BitmapMetaPageData *meta;
 	BitmapPageOpaque opaque;
 	int32		htupidx;
 	BitmapTuple *itup;
-	int			i;
 	ItemPointerData ipd;
 
-	scan->xs_recheck = false;
-
-	if (so->keyIndex < 0)
+	if (!so->started)
 	{
-		ScanKey		skey = scan->keyData;
-
-		memset(isnull, 0, sizeof(bool) * INDEX_MAX_KEYS);
-
-		for (i = 0; i < scan->numberOfKeys; i++)
-		{
-			isnull[i] = false;
-			if (skey->sk_flags & SK_ISNULL)
-			{
-				isnull[i] = true;
-				continue;
-			}
-			values[i] = skey->sk_argument;
-			skey++;
-		}
-
-		meta = bm_get_meta(index);
-		if (meta->ndistinct > 0)
-		{
-			so->keyIndex = bm_get_val_index(index, values, isnull);
-		}
-
-		if (so->keyIndex < 0)
+		if (!bm_scan_start(scan))
 			return false;
 
-		so->curBlk = meta->startBlk[so->keyIndex];
 		if (so->curPage == NULL)
 		{
 			so->curPage = (Page) palloc(sizeof(PGAlignedBlock));
 		}
 	}
 
+	if (so->tbm)
+		return bm_scan_next_tid(scan);
+
+	scan->xs_recheck = so->recheck;
 
 	while (so->curBlk != InvalidBlockNumber)
 	{
@@ -125,24 +644,37 @@ bmgettuple(IndexScanDesc scan, ScanDirection dir)
 			opaque = BitmapPageGetOpaque(so->curPage);
 			so->maxoffset = opaque->maxoff;
 			so->offset = 1;
+			so->curTup = BitmapPageFirstTuple(so->curPage);
 		}
 
-		itup = BitmapPageGetTuple(so->curPage, so->offset);
-		htupidx = bm_tuple_next_htpid(itup, &ipd, so->htupidx + 1);
-
-		if (htupidx >= 0)
+		if (so->offset <= so->maxoffset)
 		{
-			so->htupidx = htupidx;
-			scan->xs_heaptid = ipd;
-			scan->xs_heap_continue = true;
-			return true;
-		}
+			itup = so->curTup;
+			htupidx = bm_tuple_next_htpid(itup, &ipd, so->htupidx + 1);
 
-		so->htupidx = 0;
-		if (so->offset < so->maxoffset)
-		{
-			so->offset++;
-			continue;
+			if (htupidx >= 0)
+			{
+				so->htupidx = htupidx;
+				ItemPointerSetBlockNumber(&ipd, itup->heapblk + so->runidx);
+				scan->xs_heaptid = ipd;
+				scan->xs_heap_continue = true;
+				return true;
+			}
+
+			so->htupidx = -1;
+			if (so->runidx < itup->run)
+			{
+				so->runidx++;
+				continue;
+			}
+
+			so->runidx = 0;
+			if (so->offset < so->maxoffset)
+			{
+				so->offset++;
+				so->curTup = BitmapTupleNext(itup);
+				continue;
+			}
 		}
 
 		opaque = BitmapPageGetOpaque(so->curPage);
@@ -159,71 +691,30 @@ bmgetbitmap(IndexScanDesc scan, TIDBitmap *tbm)
 {
 	int64		ntids = 0;
 	BitmapScanOpaque so = (BitmapScanOpaque) scan->opaque;
-	BitmapMetaPageData *meta;
-	Relation	index = scan->indexRelation;
-	int			i;
-	Datum		values[INDEX_MAX_KEYS];
-	bool		isnull[INDEX_MAX_KEYS];
-	Page		page;
-	Buffer		buffer;
-	BitmapPageOpaque opaque;
-	OffsetNumber offset,
-				maxoffset;
-	BitmapTuple *itup;
-	ItemPointer tids = palloc0(sizeof(ItemPointerData) * MAX_HEAP_TUPLE_PER_PAGE);
-
-	if (so->keyIndex < 0)
-	{
-		ScanKey		skey = scan->keyData;
-
-		memset(isnull, 0, sizeof(bool) * INDEX_MAX_KEYS);
-
-		for (i = 0; i < scan->numberOfKeys; i++)
-		{
-			if (skey->sk_flags & SK_ISNULL)
-			{
-				isnull[i] = true;
-				continue;
-			}
-			values[i] = skey->sk_argument;
-			skey++;
-		}
-
-		meta = bm_get_meta(index);
-		if (meta->ndistinct > 0)
-		{
-			so->keyIndex = bm_get_val_index(index, values, isnull);
-		}
+	ItemPointer tids;
 
-		/* keys are not indexed */
-		if (so->keyIndex < 0)
-			return 0;
-
-		so->curBlk = meta->startBlk[so->keyIndex];
-	}
+	/* keys are not indexed */
+	if (!bm_scan_start(scan))
+		return 0;
 
-	while (so->curBlk != InvalidBlockNumber)
+	if (so->tbm)
 	{
-		buffer = ReadBuffer(index, so->curBlk);
-		LockBuffer(buffer, BUFFER_LOCK_SHARE);
-
-		page = BufferGetPage(buffer);
-		opaque = BitmapPageGetOpaque(page);
-		maxoffset = opaque->maxoff;
-
-		for (offset = 1; offset <= maxoffset; offset++)
-		{
-			int			count = 0;
+		TBMIterateResult *res;
 
-			itup = BitmapPageGetTuple(page, offset);
-			count = bm_tuple_to_tids(itup, tids);
-			tbm_add_tuples(tbm, tids, count, false);
-			ntids += count;
-		}
+		/* count the exact tuples, lossy pages are left out */
+		so->iterator = tbm_begin_iterate(so->tbm);
+		while ((res = tbm_iterate(so->iterator)) != NULL)
+			ntids += Max(res->ntuples, 0);
 
-		so->curBlk = opaque->nextBlk;
-		UnlockReleaseBuffer(buffer);
+		tbm_union(tbm, so->tbm);
+		free_scan_bitmap(so);
+		return ntids;
 	}
 
+	tids = palloc0(sizeof(ItemPointerData) * MAX_HEAP_TUPLE_PER_PAGE);
+	ntids = bm_chain_to_tbm(scan->indexRelation, so->curBlk, tbm, so->recheck, tids);
+	so->curBlk = InvalidBlockNumber;
+	pfree(tids);
+
 	return ntids;
 }
@@ -0,0 +1,113 @@
+#include <postgres.h>
+
+#include <storage/bufmgr.h>
+#include <utils/rel.h>
+
+#include "bitmap.h"
+
+/*
+ * Segmented indexes. The bitmaps of all values for a range of heap blocks
+ * share one chain, its head in the directory entry of the segment, so that
+ * inserts into a heap block touch a single chain and a scan for several
+ * values reads every bitmap page once. Bitmap tuples are keyed with the
+ * ordinal of their value.
+ */
+
+/* whether heap tuples go to the chain of their segment */
+bool
+bm_segmented(Relation index)
+{
+	return bm_dict_get_cache(index)->segBlocks > 0;
+}
+
+/* segment of a heap block, which has to fit in the directory */
+int
+bm_segment_no(Relation index, BlockNumber heapblk)
+{
+	BlockNumber segno = heapblk / bm_dict_get_cache(index)->segBlocks;
+
+	if (segno >= MAX_DISTINCT)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("bitmap index \"%s\" cannot hold more than %d segments",
+						RelationGetRelationName(index), (int) MAX_DISTINCT),
+				 errhint("Rebuild the index with a larger segment_blocks.")));
+
+	return (int) segno;
+}
+
+static int
+bm_ordinal_cmp(const void *a, const void *b)
+{
+	int			x = *(const int *) a;
+	int			y = *(const int *) b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Add the heap tuples of some values of a segmented index to a bitmap. All
+ * segments are read in one pass and the tuples keyed with one of the
+ * ordinals taken.
+ */
+void
+bm_segments_to_tbm(Relation index, int *valindexes, int n, TIDBitmap *tbm,
+				   bool recheck)
+{
+	BitmapMetaPageData *meta = bm_get_meta(index);
+	BlockNumber *blocks = palloc(sizeof(BlockNumber) * BITMAP_DIR_ENTRIES);
+	ItemPointerData tids[MAX_HEAP_TUPLE_PER_PAGE];
+	int		   *ords = palloc(sizeof(int) * n);
+
+	memcpy(ords, valindexes, sizeof(int) * n);
+	qsort(ords, n, sizeof(int), bm_ordinal_cmp);
+
+	for (int dirno = 0; dirno < meta->ndirpages; dirno++)
+	{
+		bm_read_dir(index, meta->dirBlk[dirno], blocks);
+
+		for (int i = 0; i < BITMAP_DIR_ENTRIES; i++)
+		{
+			BlockNumber blkno = blocks[i];
+
+			while (blkno != InvalidBlockNumber)
+			{
+				Buffer		buffer = ReadBuffer(index, blkno);
+				Page		page;
+				BitmapPageOpaque opaque;
+				BitmapTuple *itup;
+
+				LockBuffer(buffer, BUFFER_LOCK_SHARE);
+				page = BufferGetPage(buffer);
+				opaque = BitmapPageGetOpaque(page);
+
+				itup = BitmapPageFirstTuple(page);
+				for (OffsetNumber offset = 1; offset <= opaque->maxoff; offset++)
+				{
+					int32		key = BitmapTupleKey(itup);
+					int			count;
+
+					if (bsearch(&key, ords, n, sizeof(int), bm_ordinal_cmp) != NULL)
+					{
+						count = bm_tuple_to_tids(itup, tids);
+						for (int r = 0; r <= itup->run; r++)
+						{
+							for (int j = 0; r > 0 && j < count; j++)
+								ItemPointerSetBlockNumber(&tids[j], itup->heapblk + r);
+
+							tbm_add_tuples(tbm, tids, count, recheck);
+						}
+					}
+					itup = BitmapTupleNext(itup);
+				}
+
+				blkno = opaque->nextBlk;
+				UnlockReleaseBuffer(buffer);
+			}
+		}
+	}
+
+	pfree(ords);
+	pfree(blocks);
+	pfree(meta);
+}
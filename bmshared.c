@@ -0,0 +1,402 @@
+#include <postgres.h>
+
+#include <access/xlog.h>
+#include <fmgr.h>
+#include <miscadmin.h>
+#include <storage/ipc.h>
+#include <storage/lwlock.h>
+#include <storage/shmem.h>
+#include <utils/guc.h>
+#include <utils/hsearch.h>
+#include <utils/rel.h>
+
+#include "bitmap.h"
+
+/*
+ * Cache of dictionary ordinals and chain heads shared by all backends, so
+ * that backends with a cold relcache resolve keys without reading the meta,
+ * directory and dictionary pages. It is only available when the library is
+ * preloaded and bitmap.shared_cache_size is set.
+ *
+ * Dictionary entries map the image of a column value to its ordinal and
+ * its version. An ordinal only stands for another value once vacuum has
+ * reclaimed it and bumped its version, so backends find stale entries by
+ * checking the version against the directory and drop them. Chain head
+ * entries are keyed by ordinal and version and written by backends holding
+ * the directory page lock, either after reading the head or after changing
+ * it, so they always match the page. Entries of an index are dropped when it
+ * is built again, and unused entries are evicted clock style when the cache
+ * is full.
+ */
+
+#define BM_SHARED_PARTITIONS 16
+#define BM_SHARED_IMAGE_LEN 32
+#define BM_SHARED_TRANCHE "bitmap shared cache"
+
+#if PG_VERSION_NUM >= 160000
+#define BM_RELNUMBER(rel) ((rel)->rd_locator.relNumber)
+#else
+#define BM_RELNUMBER(rel) ((rel)->rd_node.relNode)
+#endif
+
+typedef struct BitmapSharedKey
+{
+	Oid			dbid;
+	Oid			relid;
+	Oid			relnumber;
+	int32		valindex;		/* chain head of the ordinal, minus the column
+								 * number for a value */
+	uint32		version;		/* version of the ordinal of a chain head */
+	uint32		len;			/* length of the value image */
+	char		image[BM_SHARED_IMAGE_LEN];
+} BitmapSharedKey;
+
+typedef struct BitmapSharedEntry
+{
+	BitmapSharedKey key;
+	uint32		value;			/* ordinal of the value or chain head block */
+	uint16		version;		/* version of the ordinal of a value */
+	pg_atomic_uint32 used;		/* referenced since the last eviction pass */
+} BitmapSharedEntry;
+
+static int	bm_shared_cache_size = 0;
+static HTAB *bm_shared_hash = NULL;
+static LWLockPadded *bm_shared_locks = NULL;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+
+static Size
+bm_shared_memsize(void)
+{
+	return hash_estimate_size(bm_shared_cache_size, sizeof(BitmapSharedEntry));
+}
+
+static void
+bm_shared_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+
+	RequestAddinShmemSpace(bm_shared_memsize());
+	RequestNamedLWLockTranche(BM_SHARED_TRANCHE, BM_SHARED_PARTITIONS);
+}
+
+static void
+bm_shared_startup(void)
+{
+	HASHCTL		info;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	info.keysize = sizeof(BitmapSharedKey);
+	info.entrysize = sizeof(BitmapSharedEntry);
+	info.num_partitions = BM_SHARED_PARTITIONS;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	bm_shared_hash = ShmemInitHash("bitmap shared cache",
+								   bm_shared_cache_size, bm_shared_cache_size,
+								   &info,
+								   HASH_ELEM | HASH_BLOBS | HASH_PARTITION | HASH_FIXED_SIZE);
+	bm_shared_locks = GetNamedLWLockTranche(BM_SHARED_TRANCHE);
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/* define the cache size setting and reserve the cache when preloaded */
+void
+bm_shared_init(void)
+{
+	DefineCustomIntVariable("bitmap.shared_cache_size",
+							"Number of dictionary values and chain heads cached in shared memory.",
+							"Zero disables the cache, which needs the library in shared_preload_libraries.",
+							&bm_shared_cache_size,
+							0, 0, INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL, NULL, NULL);
+
+#if PG_VERSION_NUM >= 150000
+	MarkGUCPrefixReserved("bitmap");
+#else
+	EmitWarningsOnPlaceholders("bitmap");
+#endif
+
+	if (!process_shared_preload_libraries_in_progress || bm_shared_cache_size == 0)
+		return;
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = bm_shared_request;
+#else
+	bm_shared_request();
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = bm_shared_startup;
+}
+
+/*
+ * Pages replayed on a standby do not maintain the cache and temporary
+ * indexes are private, skip both.
+ */
+static inline bool
+bm_shared_enabled(Relation index)
+{
+	return bm_shared_hash != NULL &&
+		!RelationUsesLocalBuffers(index) &&
+		!RecoveryInProgress();
+}
+
+static void
+bm_shared_init_key(BitmapSharedKey *key, Relation index, int32 valindex,
+				   uint16 version)
+{
+	/* keys are hashed as blobs, padding and unused image must be zero */
+	memset(key, 0, sizeof(BitmapSharedKey));
+	key->dbid = MyDatabaseId;
+	key->relid = RelationGetRelid(index);
+	key->relnumber = BM_RELNUMBER(index);
+	key->valindex = valindex;
+	key->version = version;
+}
+
+/*
+ * Serialize a column value into the key image. Equal images imply equal
+ * values, the reverse need not hold as values found under another image just
+ * get one more entry. Returns false if the image does not fit.
+ */
+static bool
+bm_shared_image(BitmapSharedKey *key, Relation index, int attno, Datum value,
+				bool isnull)
+{
+	Form_pg_attribute att = TupleDescAttr(RelationGetDescr(index), attno - 1);
+	const void *data;
+	uint32		len;
+
+	key->image[0] = isnull;
+	key->len = 1;
+	if (isnull)
+		return true;
+
+	if (att->attbyval)
+	{
+		data = &value;
+		len = sizeof(Datum);
+	}
+	else if (att->attlen > 0)
+	{
+		data = DatumGetPointer(value);
+		len = att->attlen;
+	}
+	else if (att->attlen == -1)
+	{
+		struct varlena *v = PG_DETOAST_DATUM_PACKED(value);
+
+		data = VARDATA_ANY(v);
+		len = VARSIZE_ANY_EXHDR(v);
+	}
+	else
+	{
+		data = DatumGetCString(value);
+		len = strlen(data) + 1;
+	}
+
+	if (len > BM_SHARED_IMAGE_LEN - key->len)
+		return false;
+	memcpy(key->image + key->len, data, len);
+	key->len += len;
+
+	return true;
+}
+
+static bool
+bm_shared_get(BitmapSharedKey *key, uint32 *value, uint16 *version)
+{
+	uint32		hashcode = get_hash_value(bm_shared_hash, key);
+	LWLock	   *lock = &bm_shared_locks[hashcode % BM_SHARED_PARTITIONS].lock;
+	BitmapSharedEntry *entry;
+
+	LWLockAcquire(lock, LW_SHARED);
+	entry = hash_search_with_hash_value(bm_shared_hash, key, hashcode, HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		*value = entry->value;
+		if (version != NULL)
+			*version = entry->version;
+
+		/* only write the shared line when the bit is clear */
+		if (pg_atomic_read_u32(&entry->used) == 0)
+			pg_atomic_write_u32(&entry->used, 1);
+	}
+	LWLockRelease(lock);
+
+	return entry != NULL;
+}
+
+/*
+ * Make room in a full cache: entries unused since the previous pass are
+ * removed, the others are marked unused.
+ */
+static void
+bm_shared_evict(void)
+{
+	HASH_SEQ_STATUS status;
+	BitmapSharedEntry *entry;
+
+	for (int i = 0; i < BM_SHARED_PARTITIONS; i++)
+		LWLockAcquire(&bm_shared_locks[i].lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&status, bm_shared_hash);
+	while ((entry = hash_seq_search(&status)) != NULL)
+	{
+		if (pg_atomic_read_u32(&entry->used) == 0)
+			hash_search(bm_shared_hash, &entry->key, HASH_REMOVE, NULL);
+		else
+			pg_atomic_write_u32(&entry->used, 0);
+	}
+
+	for (int i = BM_SHARED_PARTITIONS - 1; i >= 0; i--)
+		LWLockRelease(&bm_shared_locks[i].lock);
+}
+
+static void
+bm_shared_set(BitmapSharedKey *key, uint32 value, uint16 version)
+{
+	uint32		hashcode = get_hash_value(bm_shared_hash, key);
+	LWLock	   *lock = &bm_shared_locks[hashcode % BM_SHARED_PARTITIONS].lock;
+	BitmapSharedEntry *entry;
+	bool		found;
+
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		LWLockAcquire(lock, LW_EXCLUSIVE);
+		entry = hash_search_with_hash_value(bm_shared_hash, key, hashcode,
+											HASH_ENTER_NULL, &found);
+		if (entry != NULL)
+		{
+			entry->value = value;
+			entry->version = version;
+			if (!found)
+				pg_atomic_init_u32(&entry->used, 0);
+			LWLockRelease(lock);
+			return;
+		}
+		LWLockRelease(lock);
+
+		/* full, a value not cached is just looked up the slow way */
+		if (attempt == 0)
+			bm_shared_evict();
+	}
+}
+
+int
+bm_shared_get_val(Relation index, int attno, Datum value, bool isnull,
+				  uint16 *version)
+{
+	BitmapSharedKey key;
+	uint32		valindex;
+
+	if (!bm_shared_enabled(index))
+		return -1;
+
+	bm_shared_init_key(&key, index, -attno, 0);
+	if (!bm_shared_image(&key, index, attno, value, isnull) ||
+		!bm_shared_get(&key, &valindex, version))
+		return -1;
+
+	return valindex;
+}
+
+void
+bm_shared_set_val(Relation index, int attno, Datum value, bool isnull,
+				  int valindex, uint16 version)
+{
+	BitmapSharedKey key;
+
+	if (!bm_shared_enabled(index))
+		return;
+
+	bm_shared_init_key(&key, index, -attno, 0);
+	if (bm_shared_image(&key, index, attno, value, isnull))
+		bm_shared_set(&key, valindex, version);
+}
+
+/* drop the entry of a value whose ordinal turned out to be reclaimed */
+void
+bm_shared_forget_val(Relation index, int attno, Datum value, bool isnull)
+{
+	BitmapSharedKey key;
+	uint32		hashcode;
+	LWLock	   *lock;
+
+	if (!bm_shared_enabled(index))
+		return;
+
+	bm_shared_init_key(&key, index, -attno, 0);
+	if (!bm_shared_image(&key, index, attno, value, isnull))
+		return;
+
+	hashcode = get_hash_value(bm_shared_hash, &key);
+	lock = &bm_shared_locks[hashcode % BM_SHARED_PARTITIONS].lock;
+
+	LWLockAcquire(lock, LW_EXCLUSIVE);
+	hash_search_with_hash_value(bm_shared_hash, &key, hashcode, HASH_REMOVE, NULL);
+	LWLockRelease(lock);
+}
+
+bool
+bm_shared_get_head(Relation index, int valindex, uint16 version,
+				   BlockNumber *startBlk)
+{
+	BitmapSharedKey key;
+
+	if (!bm_shared_enabled(index))
+		return false;
+
+	bm_shared_init_key(&key, index, valindex, version);
+	return bm_shared_get(&key, startBlk, NULL);
+}
+
+/* the caller holds the directory page of the ordinal locked */
+void
+bm_shared_set_head(Relation index, int valindex, uint16 version,
+				   BlockNumber startBlk)
+{
+	BitmapSharedKey key;
+
+	if (!bm_shared_enabled(index))
+		return;
+
+	bm_shared_init_key(&key, index, valindex, version);
+	bm_shared_set(&key, startBlk, 0);
+}
+
+/* drop every entry of an index whose pages are created anew */
+void
+bm_shared_forget(Relation index)
+{
+	HASH_SEQ_STATUS status;
+	BitmapSharedEntry *entry;
+
+	if (!bm_shared_enabled(index))
+		return;
+
+	for (int i = 0; i < BM_SHARED_PARTITIONS; i++)
+		LWLockAcquire(&bm_shared_locks[i].lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&status, bm_shared_hash);
+	while ((entry = hash_seq_search(&status)) != NULL)
+	{
+		if (entry->key.dbid == MyDatabaseId &&
+			entry->key.relid == RelationGetRelid(index))
+			hash_search(bm_shared_hash, &entry->key, HASH_REMOVE, NULL);
+	}
+
+	for (int i = BM_SHARED_PARTITIONS - 1; i >= 0; i--)
+		LWLockRelease(&bm_shared_locks[i].lock);
+}
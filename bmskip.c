@@ -0,0 +1,257 @@
+#include <postgres.h>
+
+#include <access/generic_xlog.h>
+#include <storage/bufmgr.h>
+#include <storage/indexfsm.h>
+
+#include "bitmap.h"
+
+/*
+ * Skip directories. A chain of many bitmap pages keeps the range of heap
+ * blocks of each page in skip pages hung off its first page, so that an
+ * insert into an old heap block goes straight to the page holding it
+ * instead of walking the chain. Ranges may be wider than the tuples of the
+ * page but never narrower. Inserts and vacuum hold the first page of the
+ * chain exclusively locked while they use or change the directory, which
+ * also keeps pages from being freed while an entry points to them.
+ */
+
+/* range of heap blocks of the tuples of a bitmap page */
+static void
+bm_skip_range(Page page, BlockNumber *minBlk, BlockNumber *maxBlk)
+{
+	int			maxoff = BitmapPageGetOpaque(page)->maxoff;
+	BitmapTuple *last;
+
+	if (maxoff == 0)
+	{
+		*minBlk = InvalidBlockNumber;
+		*maxBlk = 0;
+		return;
+	}
+
+	/* tuples are sorted and do not overlap */
+	last = (BitmapTuple *) (PageGetContents(page) + BitmapPageGetSlots(page)[maxoff - 1]);
+	*minBlk = BitmapPageFirstTuple(page)->heapblk;
+	*maxBlk = BitmapTupleLastBlock(last);
+}
+
+/*
+ * Find the bitmap page to add a heap block to: the page whose range covers
+ * it, or else the page with the highest heap blocks, where new heap blocks
+ * go.
+ */
+BlockNumber
+bm_skip_find(Relation index, BlockNumber skipBlk, BlockNumber heapblk)
+{
+	BlockNumber found = InvalidBlockNumber,
+				maxBlk = 0;
+
+	while (skipBlk != InvalidBlockNumber)
+	{
+		Buffer		buffer = ReadBuffer(index, skipBlk);
+		Page		page;
+		BitmapSkipEntry *entries;
+
+		LockBuffer(buffer, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buffer);
+		entries = BitmapPageGetSkip(page);
+
+		for (int i = 0; i < BitmapPageGetOpaque(page)->maxoff; i++)
+		{
+			if (entries[i].minBlk <= heapblk && heapblk <= entries[i].maxBlk)
+			{
+				found = entries[i].blkno;
+				UnlockReleaseBuffer(buffer);
+				return found;
+			}
+
+			if (found == InvalidBlockNumber ||
+				(entries[i].minBlk <= entries[i].maxBlk && entries[i].maxBlk >= maxBlk))
+			{
+				found = entries[i].blkno;
+				maxBlk = entries[i].maxBlk;
+			}
+		}
+
+		skipBlk = BitmapPageGetOpaque(page)->nextBlk;
+		UnlockReleaseBuffer(buffer);
+	}
+
+	return found;
+}
+
+/*
+ * Widen the range of a bitmap page to a heap block added to it. Pages not
+ * in the directory yet, new ones or those vacuum moved tuples to, are added.
+ */
+void
+bm_skip_cover(Relation index, BlockNumber skipBlk, BlockNumber blkno,
+			  BlockNumber heapblk)
+{
+	Buffer		buffer = InvalidBuffer,
+				nbuffer = InvalidBuffer;
+	Page		page;
+	BitmapSkipEntry *entry;
+	GenericXLogState *state;
+
+	while (skipBlk != InvalidBlockNumber)
+	{
+		buffer = ReadBuffer(index, skipBlk);
+		LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+		page = BufferGetPage(buffer);
+
+		for (int i = 0; i < BitmapPageGetOpaque(page)->maxoff; i++)
+		{
+			entry = &BitmapPageGetSkip(page)[i];
+			if (entry->blkno != blkno)
+				continue;
+
+			if (entry->minBlk > heapblk || heapblk > entry->maxBlk)
+			{
+				state = GenericXLogStart(index);
+				entry = &BitmapPageGetSkip(GenericXLogRegisterBuffer(state, buffer, 0))[i];
+				if (entry->minBlk > entry->maxBlk)
+					entry->minBlk = entry->maxBlk = heapblk;
+				else
+				{
+					entry->minBlk = Min(entry->minBlk, heapblk);
+					entry->maxBlk = Max(entry->maxBlk, heapblk);
+				}
+				GenericXLogFinish(state);
+			}
+
+			UnlockReleaseBuffer(buffer);
+			return;
+		}
+
+		skipBlk = BitmapPageGetOpaque(page)->nextBlk;
+		if (skipBlk != InvalidBlockNumber)
+			UnlockReleaseBuffer(buffer);
+	}
+
+	/* buffer is the last skip page */
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, buffer, 0);
+	if (BitmapPageGetOpaque(page)->maxoff >= BITMAP_SKIP_ENTRIES)
+	{
+		nbuffer = bm_newbuffer_locked(index);
+		BitmapPageGetOpaque(page)->nextBlk = BufferGetBlockNumber(nbuffer);
+		page = GenericXLogRegisterBuffer(state, nbuffer, GENERIC_XLOG_FULL_IMAGE);
+		bm_init_page(page, BITMAP_PAGE_SKIP);
+	}
+
+	entry = &BitmapPageGetSkip(page)[BitmapPageGetOpaque(page)->maxoff++];
+	entry->blkno = blkno;
+	entry->minBlk = entry->maxBlk = heapblk;
+	((PageHeader) page)->pd_lower += sizeof(BitmapSkipEntry);
+
+	GenericXLogFinish(state);
+	if (nbuffer != InvalidBuffer)
+		UnlockReleaseBuffer(nbuffer);
+	UnlockReleaseBuffer(buffer);
+}
+
+/*
+ * Write the skip directory of a chain, its first bitmap page exclusively
+ * locked by the caller, and point that page to it. Deleted bitmap pages are
+ * left out. The skip pages from oldSkipBlk on are freed once the chain no
+ * longer points to them.
+ */
+void
+bm_skip_build(Relation index, Buffer headbuf, BlockNumber oldSkipBlk)
+{
+	BlockNumber headBlk = BufferGetBlockNumber(headbuf),
+				blkno = headBlk,
+				firstBlk;
+	BitmapSkipEntry *entries;
+	int			n = 0,
+				maxentries = BITMAP_SKIP_MIN_PAGES;
+	Buffer		buffer,
+				nbuffer;
+	Page		page;
+	GenericXLogState *state;
+
+	entries = palloc(sizeof(BitmapSkipEntry) * maxentries);
+	while (blkno != InvalidBlockNumber)
+	{
+		buffer = headbuf;
+		if (blkno != headBlk)
+		{
+			buffer = ReadBuffer(index, blkno);
+			LockBuffer(buffer, BUFFER_LOCK_SHARE);
+		}
+		page = BufferGetPage(buffer);
+
+		if (!BitmapPageDeleted(page))
+		{
+			if (n == maxentries)
+			{
+				maxentries *= 2;
+				entries = repalloc(entries, sizeof(BitmapSkipEntry) * maxentries);
+			}
+			entries[n].blkno = blkno;
+			bm_skip_range(page, &entries[n].minBlk, &entries[n].maxBlk);
+			n++;
+		}
+
+		blkno = BitmapPageGetOpaque(page)->nextBlk;
+		if (buffer != headbuf)
+			UnlockReleaseBuffer(buffer);
+	}
+
+	Assert(n > 0);
+
+	/* each skip page is written once the page after it is allocated */
+	buffer = bm_newbuffer_locked(index);
+	firstBlk = BufferGetBlockNumber(buffer);
+	for (int first = 0; first < n; first += BITMAP_SKIP_ENTRIES)
+	{
+		int			count = Min(n - first, BITMAP_SKIP_ENTRIES);
+
+		nbuffer = first + count < n ? bm_newbuffer_locked(index) : InvalidBuffer;
+
+		state = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(state, buffer, GENERIC_XLOG_FULL_IMAGE);
+		bm_init_page(page, BITMAP_PAGE_SKIP);
+		memcpy(BitmapPageGetSkip(page), entries + first, sizeof(BitmapSkipEntry) * count);
+		BitmapPageGetOpaque(page)->maxoff = count;
+		((PageHeader) page)->pd_lower += sizeof(BitmapSkipEntry) * count;
+		if (nbuffer != InvalidBuffer)
+			BitmapPageGetOpaque(page)->nextBlk = BufferGetBlockNumber(nbuffer);
+		GenericXLogFinish(state);
+
+		UnlockReleaseBuffer(buffer);
+		buffer = nbuffer;
+	}
+
+	state = GenericXLogStart(index);
+	page = GenericXLogRegisterBuffer(state, headbuf, 0);
+	BitmapPageGetOpaque(page)->skipBlk = firstBlk;
+	GenericXLogFinish(state);
+
+	bm_skip_free(index, oldSkipBlk);
+	pfree(entries);
+}
+
+/* free the skip pages of a chain that no longer points to them */
+void
+bm_skip_free(Relation index, BlockNumber skipBlk)
+{
+	while (skipBlk != InvalidBlockNumber)
+	{
+		Buffer		buffer = ReadBuffer(index, skipBlk);
+		GenericXLogState *state;
+		Page		page;
+
+		LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+		state = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(state, buffer, 0);
+		BitmapPageSetDeleted(page);
+		GenericXLogFinish(state);
+
+		RecordFreeIndexPage(index, skipBlk);
+		skipBlk = BitmapPageGetOpaque(BufferGetPage(buffer))->nextBlk;
+		UnlockReleaseBuffer(buffer);
+	}
+}
@@ -0,0 +1,214 @@
+#include <postgres.h>
+
+#include <miscadmin.h>
+#include <port/pg_bitutils.h>
+#include <storage/bufmgr.h>
+#include <utils/hsearch.h>
+#include <utils/memutils.h>
+
+#include "bitmap.h"
+
+/*
+ * Sliced indexes. Every value costs a bit in the slices instead of a chain,
+ * so the index size follows the number of bits of the ordinals rather than
+ * the number of values. A value is found by combining the slices per heap
+ * block: those of the bits set in its code are intersected and those of the
+ * other bits subtracted.
+ */
+
+#define BM_SLICE_OR 0
+#define BM_SLICE_AND 1
+#define BM_SLICE_ANDNOT 2
+
+/* heap tuples of a heap block matching the slices combined so far */
+typedef struct BitmapSliceEntry
+{
+	BlockNumber heapblk;
+	int			round;			/* last slice intersected that had the block */
+	bits32		bm[MAX_BITS_32];
+	bits32		found[MAX_BITS_32]; /* heap tuples of the block in that slice */
+} BitmapSliceEntry;
+
+/* whether heap tuples go to slices rather than to a chain per value */
+bool
+bm_sliced(Relation index)
+{
+	return bm_dict_get_cache(index)->sliced;
+}
+
+/*
+ * Combine the heap tuples of a slice with those of its heap blocks seen so
+ * far. Once the first slice has entered maxblocks heap blocks, its further
+ * heap blocks go to the bitmap as lossy pages, which keeps the memory of the
+ * hash within work_mem.
+ */
+static void
+bm_slice_apply(Relation index, BlockNumber blkno, HTAB *blocks, int op, int round,
+			   long maxblocks, TIDBitmap *tbm)
+{
+	Buffer		buffer;
+	Page		page;
+	BitmapPageOpaque opaque;
+	BitmapTuple *itup;
+
+	while (blkno != InvalidBlockNumber)
+	{
+		buffer = ReadBuffer(index, blkno);
+		LockBuffer(buffer, BUFFER_LOCK_SHARE);
+
+		page = BufferGetPage(buffer);
+		opaque = BitmapPageGetOpaque(page);
+
+		itup = BitmapPageFirstTuple(page);
+		for (OffsetNumber offset = 1; offset <= opaque->maxoff; offset++)
+		{
+			uint8		offsets[MAX_HEAP_TUPLE_PER_PAGE];
+			bits32		bm[MAX_BITS_32] = {0};
+			int			n = bm_tuple_offsets(itup, offsets);
+
+			for (int i = 0; i < n; i++)
+				bm[offsets[i] / 32] |= 0x1 << (offsets[i] % 32);
+
+			for (int r = 0; r <= itup->run; r++)
+			{
+				BlockNumber heapblk = itup->heapblk + r;
+				BitmapSliceEntry *entry;
+				bool		found;
+				HASHACTION	action = HASH_FIND;
+
+				if (op == BM_SLICE_OR && hash_get_num_entries(blocks) < maxblocks)
+					action = HASH_ENTER;
+
+				entry = hash_search(blocks, &heapblk, action, &found);
+				if (entry == NULL)
+				{
+					if (op == BM_SLICE_OR)
+						tbm_add_page(tbm, heapblk);
+					continue;
+				}
+
+				if (op == BM_SLICE_OR && !found)
+				{
+					entry->round = round;
+					memset(entry->bm, 0, sizeof(entry->bm));
+				}
+				else if (op == BM_SLICE_AND && entry->round != round)
+				{
+					entry->round = round;
+					memset(entry->found, 0, sizeof(entry->found));
+				}
+
+				for (int i = 0; i < MAX_BITS_32; i++)
+				{
+					if (op == BM_SLICE_OR)
+						entry->bm[i] |= bm[i];
+					else if (op == BM_SLICE_AND)
+						entry->found[i] |= bm[i];
+					else
+						entry->bm[i] &= ~bm[i];
+				}
+			}
+
+			itup = BitmapTupleNext(itup);
+		}
+
+		blkno = opaque->nextBlk;
+		UnlockReleaseBuffer(buffer);
+	}
+
+	/* heap blocks not in an intersected slice drop out */
+	if (op == BM_SLICE_AND)
+	{
+		HASH_SEQ_STATUS status;
+		BitmapSliceEntry *entry;
+
+		hash_seq_init(&status, blocks);
+		while ((entry = hash_seq_search(&status)) != NULL)
+		{
+			if (entry->round != round)
+				hash_search(blocks, &entry->heapblk, HASH_REMOVE, NULL);
+			else
+			{
+				for (int i = 0; i < MAX_BITS_32; i++)
+					entry->bm[i] &= entry->found[i];
+			}
+		}
+	}
+}
+
+/*
+ * Add the heap tuples of a value of a sliced index to a bitmap. Its code
+ * has a bit set, whose slice gives the heap blocks the value may be in.
+ * Other slices are only read for those heap blocks.
+ */
+void
+bm_slices_to_tbm(Relation index, int valindex, TIDBitmap *tbm, bool recheck)
+{
+	BlockNumber heads[BITMAP_SLICES];
+	uint32		code = BitmapSliceCode(valindex);
+	HASHCTL		ctl;
+	HTAB	   *blocks;
+	HASH_SEQ_STATUS status;
+	BitmapSliceEntry *entry;
+	ItemPointerData tids[MAX_HEAP_TUPLE_PER_PAGE];
+	long		maxblocks = Max(work_mem * 1024L / (long) sizeof(BitmapSliceEntry), 1);
+	int			round = 0;
+
+	bm_get_slice_heads(index, heads);
+
+	/* a slice without a chain has no heap tuples, nor has the value */
+	for (int k = 0; k < BITMAP_SLICES; k++)
+	{
+		if ((code & (1U << k)) && heads[k] == InvalidBlockNumber)
+			return;
+	}
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(BlockNumber);
+	ctl.entrysize = sizeof(BitmapSliceEntry);
+	ctl.hcxt = CurrentMemoryContext;
+	blocks = hash_create("bitmap slices", 1024, &ctl,
+						 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	for (int k = 0; k < BITMAP_SLICES; k++)
+	{
+		if (!(code & (1U << k)))
+			continue;
+
+		bm_slice_apply(index, heads[k], blocks,
+					   round == 0 ? BM_SLICE_OR : BM_SLICE_AND, round, maxblocks, tbm);
+		round++;
+	}
+
+	/* slices of bits no ordinal has set yet have no chain */
+	for (int k = 0; k < BITMAP_SLICES; k++)
+	{
+		if (!(code & (1U << k)) && heads[k] != InvalidBlockNumber &&
+			hash_get_num_entries(blocks) > 0)
+			bm_slice_apply(index, heads[k], blocks, BM_SLICE_ANDNOT, round,
+						   maxblocks, tbm);
+	}
+
+	hash_seq_init(&status, blocks);
+	while ((entry = hash_seq_search(&status)) != NULL)
+	{
+		int			n = 0;
+
+		for (int i = 0; i < MAX_BITS_32; i++)
+		{
+			bits32		bits = entry->bm[i];
+
+			while (bits)
+			{
+				ItemPointerSet(&tids[n++], entry->heapblk,
+							   i * 32 + pg_rightmost_one_pos32(bits) + 1);
+				bits &= bits - 1;
+			}
+		}
+
+		if (n > 0)
+			tbm_add_tuples(tbm, tids, n, recheck);
+	}
+
+	hash_destroy(blocks);
+}
@@ -0,0 +1,295 @@
+#include <postgres.h>
+
+#include <access/tupdesc.h>
+#include <access/xloginsert.h>
+#include <access/xlogrecord.h>
+#include <catalog/pg_operator.h>
+#include <catalog/pg_type.h>
+#include <executor/tuptable.h>
+#include <miscadmin.h>
+#include <storage/bufmgr.h>
+#include <storage/smgr.h>
+#include <utils/rel.h>
+#include <utils/tuplesort.h>
+
+#include "bitmap.h"
+
+/*
+ * Sorted builds. The heap scan feeds the chain, heap tuple and key of every
+ * bit to a tuplesort bounded by maintenance_work_mem, instead of keeping a
+ * staging page per chain. The chains are the values, the slices of sliced
+ * indexes or the segments of segmented ones, whose bits are keyed by the
+ * ordinal of their value. Sorted by chain and heap tuple, the chains are
+ * then written one after the other on consecutive pages, each linked to the
+ * next as it is allocated, so that build memory does not depend on the
+ * number of chains and scans read them sequentially.
+ *
+ * Chain pages bypass shared buffers: they are written to the relation in
+ * batches, logged as full page images unless the relation skips WAL, and
+ * synced once at the end. Block numbers are handed out here, as nothing
+ * else extends the relation meanwhile: the dictionary is complete once the
+ * heap is scanned, and each flush asserts the relation is as long as the
+ * blocks written.
+ */
+
+#if PG_VERSION_NUM < 150000
+#define TUPLESORT_NONE false
+#endif
+
+#if PG_VERSION_NUM >= 160000
+#define BM_LOCATOR(rel) (&(rel)->rd_locator)
+#else
+#define BM_LOCATOR(rel) (&(rel)->rd_node)
+#endif
+
+/* pages logged and written at once, as many as a record may hold */
+#define BITMAP_BULK_PAGES XLR_MAX_BLOCK_ID
+
+typedef struct BitmapBulkState
+{
+	Relation	index;
+	bool		useWal;
+	BlockNumber nblocks;		/* blocks handed out */
+	BlockNumber written;		/* blocks the relation was extended by */
+	int			npending;
+	BlockNumber blknos[BITMAP_BULK_PAGES];
+	PGAlignedBlock pages[BITMAP_BULK_PAGES];
+} BitmapBulkState;
+
+/* pages of the chain being written */
+typedef struct BitmapBuildChain
+{
+	Page		head;			/* first page once full, kept to record the last */
+	Page		page;			/* page being filled */
+	BlockNumber startBlk;
+	BlockNumber blkno;			/* block of the page being filled */
+} BitmapBuildChain;
+
+void
+bm_sort_begin(BitmapBuildState *state)
+{
+	TupleDesc	desc = CreateTemplateTupleDesc(4);
+	AttrNumber	attnums[4] = {1, 2, 3, 4};
+	Oid			sortops[4] = {Int4LessOperator, Int8LessOperator,
+	Int4LessOperator, Int4LessOperator};
+	Oid			collations[4] = {InvalidOid, InvalidOid, InvalidOid, InvalidOid};
+	bool		nullsfirst[4] = {false, false, false, false};
+
+	TupleDescInitEntry(desc, 1, "chain", INT4OID, -1, 0);
+	TupleDescInitEntry(desc, 2, "heapblk", INT8OID, -1, 0);
+	TupleDescInitEntry(desc, 3, "key", INT4OID, -1, 0);
+	TupleDescInitEntry(desc, 4, "offset", INT4OID, -1, 0);
+
+	state->sortstate = tuplesort_begin_heap(desc, 4, attnums, sortops, collations,
+											nullsfirst, maintenance_work_mem,
+											NULL, TUPLESORT_NONE);
+	state->sortslot = MakeSingleTupleTableSlot(desc, &TTSOpsMinimalTuple);
+}
+
+/* add the bit of a heap tuple to a chain of a sorted build */
+void
+bm_sort_add(BitmapBuildState *state, int chain, int32 key, ItemPointer tid)
+{
+	TupleTableSlot *slot = state->sortslot;
+
+	if (chain >= state->ndistinct)
+		state->ndistinct = chain + 1;
+
+	ExecClearTuple(slot);
+	slot->tts_values[0] = Int32GetDatum(chain);
+	slot->tts_values[1] = Int64GetDatum(ItemPointerGetBlockNumber(tid));
+	slot->tts_values[2] = Int32GetDatum(key);
+	slot->tts_values[3] = Int32GetDatum(ItemPointerGetOffsetNumber(tid));
+	memset(slot->tts_isnull, 0, sizeof(bool) * 4);
+	ExecStoreVirtualTuple(slot);
+
+	tuplesort_puttupleslot(state->sortstate, slot);
+}
+
+/* hand out the next block of the relation */
+static BlockNumber
+bm_bulk_reserve(BitmapBulkState *bulk)
+{
+	return bulk->nblocks++;
+}
+
+/*
+ * Log and write the pending pages. Blocks handed out but not written yet,
+ * first pages of chains, are filled with zeroes until they are.
+ */
+static void
+bm_bulk_flush(BitmapBulkState *bulk)
+{
+	static PGAlignedBlock zero;
+	Page		pages[BITMAP_BULK_PAGES];
+
+	if (bulk->npending == 0)
+		return;
+
+	Assert(RelationGetNumberOfBlocks(bulk->index) == bulk->written);
+
+	for (int i = 0; i < bulk->npending; i++)
+		pages[i] = bulk->pages[i].data;
+
+	if (bulk->useWal)
+		log_newpages(BM_LOCATOR(bulk->index), MAIN_FORKNUM, bulk->npending,
+					 bulk->blknos, pages, true);
+
+	for (int i = 0; i < bulk->npending; i++)
+	{
+		BlockNumber blkno = bulk->blknos[i];
+
+		PageSetChecksumInplace(pages[i], blkno);
+
+		while (bulk->written < blkno)
+			smgrextend(RelationGetSmgr(bulk->index), MAIN_FORKNUM, bulk->written++,
+					   zero.data, true);
+		if (blkno < bulk->written)
+			smgrwrite(RelationGetSmgr(bulk->index), MAIN_FORKNUM, blkno, pages[i], true);
+		else
+			smgrextend(RelationGetSmgr(bulk->index), MAIN_FORKNUM, bulk->written++,
+					   pages[i], true);
+	}
+
+	bulk->npending = 0;
+}
+
+static void
+bm_bulk_write(BitmapBulkState *bulk, BlockNumber blkno, Page page)
+{
+	if (bulk->npending == BITMAP_BULK_PAGES)
+		bm_bulk_flush(bulk);
+
+	bulk->blknos[bulk->npending] = blkno;
+	memcpy(bulk->pages[bulk->npending].data, page, BLCKSZ);
+	bulk->npending++;
+}
+
+/*
+ * Add a bit to the chain being written, its first page is allocated with the
+ * first bit. A full page is written once the block of the next is known,
+ * except the first page, which waits for the chain to end.
+ */
+static void
+bm_chain_add(BitmapBulkState *bulk, BitmapBuildChain *chain, BitmapTuple *btup)
+{
+	bool		inserted;
+
+	if (chain->page == NULL)
+	{
+		chain->page = palloc(BLCKSZ);
+		bm_init_page(chain->page, BITMAP_PAGE_INDEX);
+		chain->startBlk = chain->blkno = bm_bulk_reserve(bulk);
+	}
+
+	if (!bm_page_add_tup(chain->page, btup, &inserted))
+	{
+		BlockNumber blkno = bm_bulk_reserve(bulk);
+
+		BitmapPageGetOpaque(chain->page)->nextBlk = blkno;
+		if (chain->head == NULL)
+		{
+			chain->head = chain->page;
+			chain->page = palloc(BLCKSZ);
+		}
+		else
+			bm_bulk_write(bulk, chain->blkno, chain->page);
+		chain->blkno = blkno;
+
+		bm_init_page(chain->page, BITMAP_PAGE_INDEX);
+		if (!bm_page_add_tup(chain->page, btup, &inserted))
+			elog(ERROR, "could not add new tuple to empty page");
+	}
+}
+
+/* write the last pages of a chain, the first recording the last */
+static void
+bm_chain_end(BitmapBulkState *bulk, BitmapBuildChain *chain)
+{
+	if (chain->head != NULL)
+	{
+		BitmapPageGetOpaque(chain->head)->tailBlk = chain->blkno;
+		bm_bulk_write(bulk, chain->blkno, chain->page);
+		bm_bulk_write(bulk, chain->startBlk, chain->head);
+		pfree(chain->head);
+	}
+	else
+		bm_bulk_write(bulk, chain->startBlk, chain->page);
+
+	pfree(chain->page);
+	chain->head = chain->page = NULL;
+}
+
+/*
+ * Write the chains of a sorted build. Returns the first pages of the chains,
+ * invalid for chains without heap tuples.
+ */
+BlockNumber *
+bm_sort_build(Relation index, BitmapBuildState *state)
+{
+	TupleTableSlot *slot = state->sortslot;
+	BitmapBulkState *bulk = palloc(sizeof(BitmapBulkState));
+	BitmapBuildChain chain = {0};
+	BlockNumber *startBlks;
+	int			cur = -1;
+
+	startBlks = palloc(sizeof(BlockNumber) * Max(state->ndistinct, 1));
+	memset(startBlks, 0xFF, sizeof(BlockNumber) * state->ndistinct);
+
+	bulk->index = index;
+	bulk->useWal = RelationNeedsWAL(index);
+	bulk->nblocks = bulk->written = RelationGetNumberOfBlocks(index);
+	bulk->npending = 0;
+
+	tuplesort_performsort(state->sortstate);
+
+	while (tuplesort_gettupleslot(state->sortstate, true, false, slot, NULL))
+	{
+		bool		isnull;
+		int			c = DatumGetInt32(slot_getattr(slot, 1, &isnull));
+		BlockNumber heapblk = (BlockNumber) DatumGetInt64(slot_getattr(slot, 2, &isnull));
+		int32		key = DatumGetInt32(slot_getattr(slot, 3, &isnull));
+		OffsetNumber offset = (OffsetNumber) DatumGetInt32(slot_getattr(slot, 4, &isnull));
+		ItemPointerData tid;
+		BitmapTuple *btup;
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (c != cur)
+		{
+			if (cur >= 0)
+				bm_chain_end(bulk, &chain);
+			cur = c;
+		}
+
+		ItemPointerSet(&tid, heapblk, offset);
+		btup = bitmap_form_tuple(&tid, key);
+		bm_chain_add(bulk, &chain, btup);
+		if (startBlks[c] == InvalidBlockNumber)
+			startBlks[c] = chain.startBlk;
+		pfree(btup);
+	}
+	if (cur >= 0)
+		bm_chain_end(bulk, &chain);
+
+	bm_bulk_flush(bulk);
+
+	/*
+	 * The pages are not in shared buffers, where a checkpoint would write
+	 * them, so a checkpoint past their records would lose them on a crash.
+	 * Unlogged indexes skip WAL but need the sync too: a crash resets them
+	 * from their init fork, but after a clean shutdown they are kept as they
+	 * are, and its checkpoint does not sync pages written here. Permanent
+	 * indexes skipping WAL are synced at commit, temporary ones never are.
+	 */
+	if (bulk->useWal || index->rd_rel->relpersistence == RELPERSISTENCE_UNLOGGED)
+		smgrimmedsync(RelationGetSmgr(index), MAIN_FORKNUM);
+
+	tuplesort_end(state->sortstate);
+	ExecDropSingleTupleTableSlot(slot);
+	state->sortstate = NULL;
+	state->sortslot = NULL;
+	pfree(bulk);
+
+	return startBlks;
+}
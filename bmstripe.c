@@ -0,0 +1,92 @@
+#include <postgres.h>
+
+#include <access/generic_xlog.h>
+#include <storage/bufmgr.h>
+#include <utils/rel.h>
+
+#include "bitmap.h"
+
+/*
+ * Striped indexes. The chain of a value is split in stripes by heap block,
+ * each with its own first page, so that sessions inserting the same value
+ * into different heap blocks do not queue on one chain. Scans merge the
+ * stripes of a value, a heap block may be in any of them.
+ */
+
+/* whether values have a chain per stripe */
+bool
+bm_striped(Relation index)
+{
+	return bm_dict_get_cache(index)->nstripes > 1;
+}
+
+/* stripe taking the heap tuples of a heap block */
+int
+bm_stripe_no(Relation index, BlockNumber heapblk)
+{
+	return heapblk % bm_dict_get_cache(index)->nstripes;
+}
+
+/* initialize a stripe page with no stripe started */
+void
+bm_init_stripes(Page page, int nstripes)
+{
+	BlockNumber *heads;
+
+	bm_init_page(page, BITMAP_PAGE_STRIPE);
+	heads = BitmapPageGetStripes(page);
+	for (int k = 0; k < nstripes; k++)
+		heads[k] = InvalidBlockNumber;
+
+	BitmapPageGetOpaque(page)->maxoff = nstripes;
+	((PageHeader) page)->pd_lower += sizeof(BlockNumber) * nstripes;
+}
+
+/* read the first pages of the stripes of a value, returns their number */
+int
+bm_stripe_heads(Relation index, BlockNumber stripeBlk, BlockNumber *heads)
+{
+	Buffer		buffer;
+	Page		page;
+	int			n;
+
+	buffer = ReadBuffer(index, stripeBlk);
+	LockBuffer(buffer, BUFFER_LOCK_SHARE);
+	page = BufferGetPage(buffer);
+	n = BitmapPageGetOpaque(page)->maxoff;
+	memcpy(heads, BitmapPageGetStripes(page), sizeof(BlockNumber) * n);
+	UnlockReleaseBuffer(buffer);
+
+	return n;
+}
+
+/*
+ * Give every chain built by bmbuild a stripe page, replacing its head in
+ * startBlks. The build puts all heap tuples in the first stripe, inserts
+ * spread over the others.
+ */
+void
+bm_build_stripes(Relation index, BlockNumber *startBlks, uint32 nvalues)
+{
+	int			nstripes = bm_dict_get_cache(index)->nstripes;
+
+	for (uint32 i = 0; i < nvalues; i++)
+	{
+		Buffer		buffer;
+		Page		page;
+		GenericXLogState *state;
+
+		if (startBlks[i] == InvalidBlockNumber)
+			continue;
+
+		buffer = bm_newbuffer_locked(index);
+		state = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(state, buffer, GENERIC_XLOG_FULL_IMAGE);
+		bm_init_stripes(page, nstripes);
+		BitmapPageGetStripes(page)[0] = startBlks[i];
+		GenericXLogFinish(state);
+
+		startBlks[i] = BufferGetBlockNumber(buffer);
+		UnlockReleaseBuffer(buffer);
+	}
+}
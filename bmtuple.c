@@ -1,86 +1,246 @@
 #include <postgres.h>
 
+#include <access/genam.h>
 #include <access/itup.h>
+#include <port/pg_bitutils.h>
 #include <utils/rel.h>
 #include <utils/datum.h>
 
 #include "bitmap.h"
 
+/* form the bitmap tuple of a single heap tuple, keyed unless BITMAP_NO_KEY */
 BitmapTuple *
-bitmap_form_tuple(ItemPointer ctid)
+bitmap_form_tuple(ItemPointer ctid, int32 key)
 {
-	BitmapTuple *tuple = palloc0(sizeof(BitmapTuple));
-	OffsetNumber offset = ctid->ip_posid - 1;
+	BitmapTuple *tuple = palloc(BITMAP_TUPLE_MAX_SIZE);
+	uint8		offset = ItemPointerGetOffsetNumber(ctid) - 1;
 
-	tuple->heapblk = BlockIdGetBlockNumber(&ctid->ip_blkid);
-	tuple->bm[offset / 32] |= 0x1 << (offset % 32);
+	bm_tuple_encode(ItemPointerGetBlockNumber(ctid), key, &offset, 1, tuple);
 
 	return tuple;
 }
 
+/* decode the sorted zero based offsets of a bitmap tuple, returns their number */
 int
-bm_tuple_to_tids(BitmapTuple * tup, ItemPointer tids)
+bm_tuple_offsets(BitmapTuple * tup, uint8 *offsets)
 {
-	int			i;
+	uint8	   *data = BitmapTuplePayload(tup);
 	int			n = 0;
 
-	for (i = 0; i < MAX_HEAP_TUPLE_PER_PAGE; i++)
+	switch (BitmapTupleType(tup))
 	{
-		if (0x1 << (i % 32) & (tup->bm[i / 32]))
+		case BITMAP_CONTAINER_ARRAY:
+			memcpy(offsets, data, tup->count);
+			return tup->count;
+		case BITMAP_CONTAINER_FULL:
+			for (int i = 0; i < tup->count; i++)
+				offsets[i] = i;
+			return tup->count;
+		case BITMAP_CONTAINER_INVERSE:
+			for (int i = 0, j = 1; n < tup->count; i++)
+			{
+				if (j <= data[0] && data[j] == i)
+					j++;
+				else
+					offsets[n++] = i;
+			}
+			return n;
+		default:
+			for (int i = 0; i < BITMAP_BITS_BYTES; i++)
+			{
+				uint32		bits = data[i];
+
+				while (bits)
+				{
+					offsets[n++] = i * 8 + pg_rightmost_one_pos32(bits);
+					bits &= bits - 1;
+				}
+			}
+			return n;
+	}
+}
+
+/*
+ * Encode sorted zero based offsets in the smallest container and return the
+ * size of the tuple. Offsets 0 to n - 1 make a full container, few offsets
+ * an array, offsets with few gaps an inverse array and others a bitset. tup
+ * must have BITMAP_TUPLE_MAX_SIZE bytes. Tuples of segmented indexes are
+ * keyed with the ordinal of their value.
+ */
+Size
+bm_tuple_encode(BlockNumber heapblk, int32 key, uint8 *offsets, int n,
+				BitmapTuple * tup)
+{
+	uint8	   *data;
+
+	Assert(n > 0 && n <= MAX_HEAP_TUPLE_PER_PAGE);
+
+	/* padding is zeroed for the WAL page deltas */
+	memset(tup, 0, BITMAP_TUPLE_MAX_SIZE);
+	tup->heapblk = heapblk;
+	tup->count = n;
+
+	if (key != BITMAP_NO_KEY)
+	{
+		memcpy(tup->data, &key, sizeof(int32));
+		data = tup->data + sizeof(int32);
+	}
+	else
+		data = tup->data;
+
+	if (offsets[n - 1] == n - 1)
+		tup->type = BITMAP_CONTAINER_FULL;
+	else if (n <= BITMAP_BITS_BYTES && n <= offsets[n - 1] + 1 - n)
+	{
+		tup->type = BITMAP_CONTAINER_ARRAY;
+		memcpy(data, offsets, n);
+	}
+	else if (offsets[n - 1] + 1 - n < BITMAP_BITS_BYTES)
+	{
+		/* dominant values list the heap tuples they miss */
+		int			nmissing = 0;
+
+		tup->type = BITMAP_CONTAINER_INVERSE;
+		for (int i = 0, j = 0; i <= offsets[n - 1]; i++)
 		{
-			tids[n].ip_blkid.bi_hi = tup->heapblk >> 16;
-			tids[n].ip_blkid.bi_lo = tup->heapblk & 0xffff;
-			tids[n].ip_posid = i + 1;
-			n++;
+			if (offsets[j] == i)
+				j++;
+			else
+				data[++nmissing] = i;
 		}
+		data[0] = nmissing;
+	}
+	else
+	{
+		tup->type = BITMAP_CONTAINER_BITS;
+		for (int i = 0; i < n; i++)
+			data[offsets[i] / 8] |= 1 << (offsets[i] % 8);
 	}
 
+	if (key != BITMAP_NO_KEY)
+		tup->type |= BITMAP_TUPLE_KEYED;
+
+	return BitmapTupleSize(tup);
+}
+
+/* whether two tuples hold the same offsets and key, encodings are canonical */
+bool
+bm_tuple_same_offsets(BitmapTuple * a, BitmapTuple * b)
+{
+	return a->type == b->type && a->count == b->count &&
+		memcmp(a->data, b->data, BitmapTupleSize(a) - offsetof(BitmapTuple, data)) == 0;
+}
+
+/* heap tuples of the first heap block of a tuple */
+int
+bm_tuple_to_tids(BitmapTuple * tup, ItemPointer tids)
+{
+	uint8		offsets[MAX_HEAP_TUPLE_PER_PAGE];
+	int			n = bm_tuple_offsets(tup, offsets);
+
+	for (int i = 0; i < n; i++)
+		ItemPointerSet(&tids[i], tup->heapblk, offsets[i] + 1);
+
 	return n;
 }
 
+/* find the first heap tuple at zero based offset start or after, -1 if none */
 int
 bm_tuple_next_htpid(BitmapTuple * tup, ItemPointer tid, int start)
 {
-	int			i;
+	uint8	   *data = BitmapTuplePayload(tup);
+	int			i = -1;
 
-	for (i = start; i < MAX_HEAP_TUPLE_PER_PAGE; i++)
+	switch (BitmapTupleType(tup))
 	{
-		if (0x1 << (i % 32) & (tup->bm[i / 32]))
-		{
-			tid->ip_blkid.bi_hi = tup->heapblk >> 16;
-			tid->ip_blkid.bi_lo = tup->heapblk & 0xffff;
-			tid->ip_posid = i + 1;
-			return i;
-		}
+		case BITMAP_CONTAINER_ARRAY:
+			for (int j = 0; j < tup->count; j++)
+			{
+				if (data[j] >= start)
+				{
+					i = data[j];
+					break;
+				}
+			}
+			break;
+		case BITMAP_CONTAINER_FULL:
+			if (start < tup->count)
+				i = start;
+			break;
+		case BITMAP_CONTAINER_INVERSE:
+			for (int j = start, k = 1; j < tup->count + data[0]; j++)
+			{
+				while (k <= data[0] && data[k] < j)
+					k++;
+				if (k > data[0] || data[k] != j)
+				{
+					i = j;
+					break;
+				}
+			}
+			break;
+		default:
+			for (int j = start; j < BITMAP_BITS_BYTES * 8; j++)
+			{
+				if (data[j / 8] & (1 << (j % 8)))
+				{
+					i = j;
+					break;
+				}
+			}
+			break;
 	}
 
-	return -1;
-}
+	if (i >= 0)
+		ItemPointerSet(tid, tup->heapblk, i + 1);
 
+	return i;
+}
 
-bool
-bm_vals_equal(Relation index, Datum *cmpVals, bool *cmpIsnull, IndexTuple itup)
+/* form the value tuple of a column value */
+IndexTuple
+bm_form_val_tuple(Relation index, int attno, Datum value, bool isnull)
 {
 	Datum		values[INDEX_MAX_KEYS];
-	bool		isnull[INDEX_MAX_KEYS];
-	TupleDesc	tupDesc = RelationGetDescr(index);
-	int			nattrs = tupDesc->natts;
-
-	index_deform_tuple(itup, tupDesc, values, isnull);
-
-	for (int i = 0; i < nattrs; i++)
-	{
-		Form_pg_attribute att = TupleDescAttr(tupDesc, i);
+	bool		isnulls[INDEX_MAX_KEYS];
+	IndexTuple	itup;
 
-		if (isnull[i] != cmpIsnull[i])
-			return false;
+	memset(isnulls, true, sizeof(isnulls));
+	values[attno - 1] = value;
+	isnulls[attno - 1] = isnull;
 
-		if (isnull[i])
-			continue;
+	itup = index_form_tuple(RelationGetDescr(index), values, isnulls);
+	BitmapValTupleSetAttno(itup, attno);
 
-		if (!datumIsEqual(cmpVals[i], values[i], att->attbyval, att->attlen))
-			return false;
-	}
+	return itup;
+}
 
-	return true;
+bool
+bm_vals_equal(Relation index, int attno, Datum value, bool isnull, IndexTuple itup)
+{
+	Form_pg_attribute att = TupleDescAttr(RelationGetDescr(index), attno - 1);
+	Datum		itupValue;
+	bool		itupIsnull;
+
+	if (BitmapValTupleGetAttno(itup) != attno)
+		return false;
+
+	itupValue = index_getattr(itup, attno, RelationGetDescr(index), &itupIsnull);
+	if (itupIsnull != isnull)
+		return false;
+
+	if (isnull)
+		return true;
+
+	/*
+	 * Values hashed by the opclass are compared by it too, so that equal
+	 * values with different images stay one value. Others compare their
+	 * images, which looks through compression and toasting.
+	 */
+	if (OidIsValid(index_getprocid(index, attno, BITMAP_HASH_PROC)))
+		return DatumGetInt32(FunctionCall2Coll(index_getprocinfo(index, attno, BITMAP_EQUAL_PROC),
+											   index->rd_indcollation[attno - 1],
+											   value, itupValue)) == 0;
+
+	return datum_image_eq(value, itupValue, att->attbyval, att->attlen);
 }
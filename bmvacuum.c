@@ -7,6 +7,240 @@
 
 #include "bitmap.h"
 
+/*
+ * Encode the tuples of a bitmap page again into contents without the heap
+ * tuples the callback reports dead. Tuples may grow, as a full container
+ * losing a heap tuple turns into an inverse array, and runs split where
+ * their heap blocks lose different heap tuples. Consecutive heap blocks
+ * left with the same offsets join a run again. Returns the offset of the
+ * first tuple left out for lack of room, past maxoff if all fit, with left
+ * pointing at it and heapblk set to its first heap block left out. removed
+ * counts the heap tuples removed from the tuples that fit.
+ */
+OffsetNumber
+bm_vacuum_tuples(Page page, IndexBulkDeleteCallback callback, void *callback_state,
+				 char *contents, Size *used, int *ntups, double *removed,
+				 BitmapTuple **left, BlockNumber *heapblk)
+{
+	BitmapPageOpaque opaque = BitmapPageGetOpaque(page);
+	BitmapTuple *itup;
+	BitmapTuple *prev = NULL;
+	OffsetNumber off;
+	Size		avail;
+
+	*used = 0;
+	*ntups = 0;
+	*removed = 0;
+	*heapblk = InvalidBlockNumber;
+
+	/* room for tuples and their slots as bm_page_add_tup counts it */
+	avail = ((PageHeader) page)->pd_special - sizeof(ItemIdData) -
+		(PageGetContents(page) - page);
+
+	itup = BitmapPageFirstTuple(page);
+	for (off = FirstOffsetNumber; off <= opaque->maxoff; off++)
+	{
+		uint8		offsets[MAX_HEAP_TUPLE_PER_PAGE];
+		int			n = bm_tuple_offsets(itup, offsets);
+
+		for (*heapblk = itup->heapblk; *heapblk <= BitmapTupleLastBlock(itup); (*heapblk)++)
+		{
+			uint8		keep[MAX_HEAP_TUPLE_PER_PAGE];
+			uint32		buf[BITMAP_TUPLE_MAX_SIZE / sizeof(uint32)];
+			BitmapTuple *tup = (BitmapTuple *) buf;
+			int			nkeep = 0;
+			Size		size;
+
+			for (int i = 0; i < n; i++)
+			{
+				ItemPointerData tid;
+
+				ItemPointerSet(&tid, *heapblk, offsets[i] + 1);
+				if (!callback(&tid, callback_state))
+					keep[nkeep++] = offsets[i];
+			}
+
+			*removed += n - nkeep;
+
+			/* a heap block losing all its heap tuples goes away */
+			if (nkeep == 0)
+				continue;
+
+			size = bm_tuple_encode(*heapblk, BitmapTupleKey(itup), keep, nkeep, tup);
+			if (prev != NULL && !BitmapTupleKeyed(tup) &&
+				BitmapTupleLastBlock(prev) + 1 == *heapblk &&
+				prev->run < BITMAP_MAX_RUN && bm_tuple_same_offsets(prev, tup))
+			{
+				prev->run++;
+				continue;
+			}
+
+			if (*used + size + sizeof(uint16) * (*ntups + 1) > avail)
+			{
+				*removed -= n - nkeep;
+				break;
+			}
+
+			prev = (BitmapTuple *) (contents + *used);
+			memcpy(prev, tup, size);
+			(*ntups)++;
+			*used += size;
+		}
+
+		if (*heapblk <= BitmapTupleLastBlock(itup))
+			break;
+
+		itup = BitmapTupleNext(itup);
+	}
+
+	*left = itup;
+	return off;
+}
+
+/* replace the tuples of a bitmap page by those bm_vacuum_tuples encoded */
+void
+bm_vacuum_apply(Page page, char *contents, Size used, int ntups)
+{
+	memcpy(PageGetContents(page), contents, used);
+	((PageHeader) page)->pd_lower = (PageGetContents(page) - page) + used;
+	BitmapPageGetOpaque(page)->maxoff = ntups;
+	bm_page_set_slots(page);
+	if (ntups == 0)
+		BitmapPageSetDeleted(page);
+}
+
+/* dead heap tuples reported by the vacuum callback, kept for compact WAL */
+typedef struct BitmapDeadTids
+{
+	IndexBulkDeleteCallback callback;
+	void	   *callback_state;
+	ItemPointerData tids[BITMAP_XLOG_MAX_DEAD];
+	int			n;
+} BitmapDeadTids;
+
+static bool
+bm_collect_dead(ItemPointer tid, void *state)
+{
+	BitmapDeadTids *dead = (BitmapDeadTids *) state;
+
+	if (!dead->callback(tid, dead->callback_state))
+		return false;
+
+	if (dead->n < BITMAP_XLOG_MAX_DEAD)
+		dead->tids[dead->n] = *tid;
+	dead->n++;
+
+	return true;
+}
+
+/*
+ * Remove deleted heap tuples from the bitmap pages of a value. Tuples that
+ * no longer fit are moved as they are to a new page linked after the page,
+ * and vacuumed there. Pages rewritten in place are logged by their dead heap
+ * tuples when compact WAL records are enabled.
+ */
+static void
+bm_bulkdelete_chain(Relation index, BlockNumber blkno,
+					IndexBulkDeleteResult *stats,
+					IndexBulkDeleteCallback callback,
+					void *callback_state)
+{
+	PGAlignedBlock contents;
+	BitmapDeadTids *dead = palloc(sizeof(BitmapDeadTids));
+	Buffer		buffer,
+				nbuffer;
+	Page		page,
+				npage;
+	GenericXLogState *gxlogState;
+	BitmapPageOpaque opaque,
+				nopaque;
+
+	dead->callback = callback;
+	dead->callback_state = callback_state;
+
+	while (blkno != InvalidBlockNumber)
+	{
+		BitmapTuple *itup;
+		BlockNumber heapblk;
+		OffsetNumber off;
+		Size		used,
+					len;
+		int			ntups;
+		double		removed;
+
+		vacuum_delay_point();
+
+		buffer = ReadBuffer(index, blkno);
+		LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+		page = BufferGetPage(buffer);
+		opaque = BitmapPageGetOpaque(page);
+
+		dead->n = 0;
+		off = bm_vacuum_tuples(page, bm_collect_dead, dead, contents.data, &used,
+							   &ntups, &removed, &itup, &heapblk);
+
+		if (removed == 0 && off > opaque->maxoff)
+		{
+			blkno = opaque->nextBlk;
+			UnlockReleaseBuffer(buffer);
+			continue;
+		}
+
+		if (off > opaque->maxoff && dead->n <= BITMAP_XLOG_MAX_DEAD &&
+			bm_xlog_enabled(index))
+		{
+			bm_xlog_vacuum(buffer, contents.data, used, ntups, dead->tids, dead->n);
+			stats->tuples_removed += removed;
+			blkno = opaque->nextBlk;
+			UnlockReleaseBuffer(buffer);
+			continue;
+		}
+
+		gxlogState = GenericXLogStart(index);
+		page = GenericXLogRegisterBuffer(gxlogState, buffer, 0);
+		opaque = BitmapPageGetOpaque(page);
+		nbuffer = InvalidBuffer;
+
+		if (off <= opaque->maxoff)
+		{
+			Page		oldpage = BufferGetPage(buffer);
+			BitmapTuple *first;
+
+			nbuffer = bm_newbuffer_locked(index);
+			npage = GenericXLogRegisterBuffer(gxlogState, nbuffer, GENERIC_XLOG_FULL_IMAGE);
+			bm_init_page(npage, BITMAP_PAGE_INDEX);
+			nopaque = BitmapPageGetOpaque(npage);
+
+			/*
+			 * itup is the first tuple left out, on the unmodified page. Its
+			 * heap blocks from heapblk on are left.
+			 */
+			len = (oldpage + ((PageHeader) oldpage)->pd_lower) - (char *) itup;
+			first = (BitmapTuple *) PageGetContents(npage);
+			memcpy(first, itup, len);
+			first->run = BitmapTupleLastBlock(itup) - heapblk;
+			first->heapblk = heapblk;
+			((PageHeader) npage)->pd_lower += len;
+			nopaque->maxoff = opaque->maxoff - off + 1;
+			bm_page_set_slots(npage);
+			nopaque->nextBlk = opaque->nextBlk;
+			opaque->nextBlk = BufferGetBlockNumber(nbuffer);
+		}
+
+		bm_vacuum_apply(page, contents.data, used, ntups);
+
+		stats->tuples_removed += removed;
+		blkno = opaque->nextBlk;
+
+		GenericXLogFinish(gxlogState);
+		if (nbuffer != InvalidBuffer)
+			UnlockReleaseBuffer(nbuffer);
+		UnlockReleaseBuffer(buffer);
+	}
+
+	pfree(dead);
+}
+
 IndexBulkDeleteResult *
 bmbulkdelete(IndexVacuumInfo *info,
 			 IndexBulkDeleteResult *stats,
@@ -14,213 +248,469 @@ bmbulkdelete(IndexVacuumInfo *info,
 			 void *callback_state)
 {
 	Relation	index = info->index;
-	Buffer		buffer;
-	BlockNumber blkno;
-	BitmapState state;
 	BitmapMetaPageData *meta;
-	Page		page;
-
-	GenericXLogState *gxlogState;
-	BitmapPageOpaque opaque;
-	ItemPointer tids = palloc0(sizeof(ItemPointerData) * MAX_HEAP_TUPLE_PER_PAGE);
+	BlockNumber *blocks;
 
 	if (stats == NULL)
 		stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
 
-	buffer = ReadBuffer(index, BITMAP_METAPAGE_BLKNO);
-	LockBuffer(buffer, BUFFER_LOCK_SHARE);
-	meta = BitmapPageGetMeta(BufferGetPage(buffer));
+	/* dead heap tuples may still be pending, their entries go to the chains */
+	if (bm_fastupdate(index))
+		bm_pending_merge(index, true);
 
-	state.ndistinct = meta->ndistinct;
-	if (state.ndistinct == 0)
-	{
-		UnlockReleaseBuffer(buffer);
+	meta = bm_get_meta(index);
+	if (meta->ndistinct == 0)
 		return stats;
-	}
 
-	state.blocks = palloc(sizeof(BlockNumber) * state.ndistinct);
-	memcpy(state.blocks, meta->startBlk, sizeof(BlockNumber) * state.ndistinct);
-	UnlockReleaseBuffer(buffer);
+	blocks = palloc(sizeof(BlockNumber) * BITMAP_DIR_ENTRIES);
 
-	for (int i = 0; i < state.ndistinct; i++)
+	for (int dirno = 0; dirno < meta->ndirpages; dirno++)
 	{
-		blkno = state.blocks[i];
-		while (blkno != InvalidBlockNumber)
+		bm_read_dir(index, meta->dirBlk[dirno], blocks);
+
+		for (int i = 0; i < BITMAP_DIR_ENTRIES; i++)
 		{
-			BitmapTuple *itup,
-					   *itupPtr,
-					   *itupEnd;
-			OffsetNumber maxoff;
+			BlockNumber heads[BITMAP_MAX_STRIPES];
+			int			n = 1;
 
-			bool		hasDelete = false;
+			if (blocks[i] == InvalidBlockNumber)
+				continue;
 
-			vacuum_delay_point();
+			heads[0] = blocks[i];
+			if (bm_striped(index))
+				n = bm_stripe_heads(index, blocks[i], heads);
 
-			buffer = ReadBuffer(index, blkno);
-			LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
-			gxlogState = GenericXLogStart(index);
-			page = GenericXLogRegisterBuffer(gxlogState, buffer, 0);
-			opaque = BitmapPageGetOpaque(page);
+			for (int k = 0; k < n; k++)
+			{
+				if (heads[k] != InvalidBlockNumber)
+					bm_bulkdelete_chain(index, heads[k], stats, callback,
+										callback_state);
+			}
+		}
+	}
 
-			maxoff = opaque->maxoff;
-			itup = itupPtr = BitmapPageGetTuple(page, FirstOffsetNumber);
-			itupEnd = BitmapPageGetTuple(page, OffsetNumberNext(maxoff));
+	for (int k = 0; k < BITMAP_SLICES; k++)
+	{
+		if (meta->sliceBlk[k] != InvalidBlockNumber)
+			bm_bulkdelete_chain(index, meta->sliceBlk[k], stats, callback,
+								callback_state);
+	}
 
-			while (itup < itupEnd)
-			{
-				int			count = 0;
-				int			delsTuple = 0;
+	return stats;
+}
 
-				count = bm_tuple_to_tids(itup, tids);
-				for (int n = 0; n < count; n++)
-				{
-					if (callback(&tids[n], callback_state))
-					{
-						int			idx = tids[n].ip_posid - 1;
-
-						itup->bm[idx / 32] &= ~(0x1 << (idx % 32));
-						delsTuple++;
-						hasDelete = true;
-						stats->tuples_removed += 1;
-					}
-				}
+/*
+ * unlink pages emptied by bulkdelete from the chain of a value and return
+ * its new first page. The first page stays locked like on inserts, the skip
+ * directory, last page and extent are written again before the unlinked
+ * pages are freed, moving to the new first page if the old one went.
+ */
+static BlockNumber
+bm_cleanup_chain(Relation index, BlockNumber startBlk, IndexBulkDeleteResult *stats)
+{
+	BlockNumber preblk = InvalidBlockNumber,
+				blkno = startBlk,
+				nextblk,
+				skipBlk,
+				extentBlk;
+	BlockNumber *freed = NULL;
+	Buffer		headbuf,
+				buffer,
+				prevbuf;
+	Page		page,
+				prepage;
+	GenericXLogState *gxlogState;
+	int			nfreed = 0,
+				npages = 0;
+	uint16		extentLeft;
+	bool		rebuild;
+
+	headbuf = ReadBuffer(index, startBlk);
+	LockBuffer(headbuf, BUFFER_LOCK_EXCLUSIVE);
+	skipBlk = BitmapPageGetOpaque(BufferGetPage(headbuf))->skipBlk;
+	extentBlk = BitmapPageGetOpaque(BufferGetPage(headbuf))->extentBlk;
+	extentLeft = BitmapPageGetOpaque(BufferGetPage(headbuf))->extentLeft;
+
+	while (blkno != InvalidBlockNumber)
+	{
+		vacuum_delay_point();
 
-				/* all tuples deleted in a single index tuple, del index tuple */
-				if (delsTuple == count)
-				{
-					opaque->maxoff--;
-				}
-				else
-				{
-					if (itupPtr != itup)
-						memmove((Pointer) itupPtr, (Pointer) itup, sizeof(BitmapTuple));
-					itupPtr++;
-				}
-				itup++;
-			}
+		buffer = headbuf;
+		if (blkno != BufferGetBlockNumber(headbuf))
+		{
+			buffer = ReadBuffer(index, blkno);
+			LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+		}
+		page = BufferGetPage(buffer);
+		nextblk = BitmapPageGetOpaque(page)->nextBlk;
 
-			if (itupPtr != itup)
+		if (BitmapPageDeleted(page))
+		{
+			stats->pages_free++;
+			/* remove deleted page from the list */
+			if (preblk != InvalidBlockNumber)
 			{
-				if (opaque->maxoff == 0)
+				prevbuf = headbuf;
+				if (preblk != BufferGetBlockNumber(headbuf))
 				{
-					BitmapPageSetDeleted(page);
+					prevbuf = ReadBuffer(index, preblk);
+					LockBuffer(prevbuf, BUFFER_LOCK_EXCLUSIVE);
 				}
-				((PageHeader) page)->pd_lower = (Pointer) itupPtr - page;
-			}
-			blkno = opaque->nextBlk;
 
-			if (hasDelete)
-			{
+				gxlogState = GenericXLogStart(index);
+				prepage = GenericXLogRegisterBuffer(gxlogState, prevbuf, 0);
+				BitmapPageGetOpaque(prepage)->nextBlk = nextblk;
+
 				GenericXLogFinish(gxlogState);
+				if (prevbuf != headbuf)
+					UnlockReleaseBuffer(prevbuf);
 			}
 			else
-			{
-				GenericXLogAbort(gxlogState);
-			}
+				/* first page is removed, need to store the update */
+				startBlk = nextblk;
+
+			if (freed == NULL)
+				freed = palloc(sizeof(BlockNumber) * BITMAP_SKIP_MIN_PAGES);
+			else if (nfreed % BITMAP_SKIP_MIN_PAGES == 0)
+				freed = repalloc(freed, sizeof(BlockNumber) * (nfreed + BITMAP_SKIP_MIN_PAGES));
+			freed[nfreed++] = blkno;
+		}
+		else
+		{
+			preblk = blkno;
+			npages++;
+		}
+
+		blkno = nextblk;
+		if (buffer != headbuf)
 			UnlockReleaseBuffer(buffer);
+	}
+
+	/* no entry may point to a page once it can be reused */
+	rebuild = skipBlk != InvalidBlockNumber ? nfreed > 0 : npages >= BITMAP_SKIP_MIN_PAGES;
+	if (startBlk == InvalidBlockNumber)
+	{
+		if (rebuild)
+			bm_skip_free(index, skipBlk);
+	}
+	else
+	{
+		buffer = headbuf;
+		if (startBlk != BufferGetBlockNumber(headbuf))
+		{
+			buffer = ReadBuffer(index, startBlk);
+			LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
 		}
+
+		bm_set_chain_end(index, buffer, preblk, extentBlk, extentLeft);
+		if (rebuild)
+			bm_skip_build(index, buffer, skipBlk);
+
+		if (buffer != headbuf)
+			UnlockReleaseBuffer(buffer);
 	}
 
-	return stats;
+	/* the extent moved to the new first page or goes with the chain */
+	if (startBlk != BufferGetBlockNumber(headbuf) && extentLeft > 0)
+	{
+		bm_set_chain_end(index, headbuf, InvalidBlockNumber, InvalidBlockNumber, 0);
+		for (int i = 0; startBlk == InvalidBlockNumber && i < extentLeft; i++)
+			RecordFreeIndexPage(index, extentBlk + i);
+	}
+
+	for (int i = 0; i < nfreed; i++)
+		RecordFreeIndexPage(index, freed[i]);
+	if (freed != NULL)
+		pfree(freed);
+
+	UnlockReleaseBuffer(headbuf);
+
+	return startBlk;
 }
 
+/*
+ * Clean up the stripes of a value and store their new first pages in its
+ * stripe page. The stripe page stays, even once every stripe is empty, so
+ * striped values keep their ordinals.
+ */
+static void
+bm_cleanup_stripes(Relation index, BlockNumber stripeBlk, IndexBulkDeleteResult *stats)
+{
+	BlockNumber heads[BITMAP_MAX_STRIPES],
+				newheads[BITMAP_MAX_STRIPES];
+	Buffer		buffer;
+	BlockNumber *stripes;
+	GenericXLogState *gxlogState;
+	bool		changed = false;
+	int			n;
 
-IndexBulkDeleteResult *
-bmvacuumcleanup(IndexVacuumInfo *info, IndexBulkDeleteResult *stats)
+	n = bm_stripe_heads(index, stripeBlk, heads);
+	for (int k = 0; k < n; k++)
+	{
+		newheads[k] = heads[k];
+		if (heads[k] != InvalidBlockNumber)
+			newheads[k] = bm_cleanup_chain(index, heads[k], stats);
+		changed |= newheads[k] != heads[k];
+	}
+
+	if (!changed)
+		return;
+
+	buffer = ReadBuffer(index, stripeBlk);
+	LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+	gxlogState = GenericXLogStart(index);
+	stripes = BitmapPageGetStripes(GenericXLogRegisterBuffer(gxlogState, buffer, 0));
+
+	for (int k = 0; k < n; k++)
+	{
+		if (stripes[k] == heads[k])
+			stripes[k] = newheads[k];
+	}
+
+	GenericXLogFinish(gxlogState);
+	UnlockReleaseBuffer(buffer);
+}
+
+/* store chain heads changed by cleanup in a directory page */
+static void
+bm_update_dir(Relation index, int dirno, BlockNumber dirBlk,
+			  BlockNumber *oldBlks, BlockNumber *newBlks)
 {
-	Relation	index = info->index;
-	BlockNumber preblk,
-				blkno;
 	Buffer		mbuffer,
-				buffer,
-				prevbuf;
-	int			nvalues;
-	BlockNumber *blocks;
-	Page		page,
-				prepage;
+				buffer;
 	BitmapMetaPageData *meta;
-	BitmapPageOpaque opaque;
+	BitmapDirEntry *dir;
 	GenericXLogState *gxlogState;
 
-	if (info->analyze_only)
-		return stats;
+	/* meta page first, in the same order as inserts starting a chain */
+	mbuffer = ReadBuffer(index, BITMAP_METAPAGE_BLKNO);
+	LockBuffer(mbuffer, BUFFER_LOCK_EXCLUSIVE);
+	buffer = ReadBuffer(index, dirBlk);
+	LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
 
-	if (stats == NULL)
-		stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
+	gxlogState = GenericXLogStart(index);
+	meta = BitmapPageGetMeta(GenericXLogRegisterBuffer(gxlogState, mbuffer, 0));
+	dir = BitmapPageGetDir(GenericXLogRegisterBuffer(gxlogState, buffer, 0));
+
+	for (int i = 0; i < BITMAP_DIR_ENTRIES; i++)
+	{
+		if (oldBlks[i] == newBlks[i] || dir[i].startBlk != oldBlks[i])
+			continue;
+
+		dir[i].startBlk = newBlks[i];
+		if (newBlks[i] == InvalidBlockNumber && BitmapMetaValueChains(meta))
+			meta->ndistinct--;
+	}
+
+	GenericXLogFinish(gxlogState);
+
+	/* shared chain heads follow the page while it is still locked */
+	dir = BitmapPageGetDir(BufferGetPage(buffer));
+	for (int i = 0; i < BITMAP_DIR_ENTRIES; i++)
+	{
+		if (oldBlks[i] != newBlks[i] && dir[i].startBlk == newBlks[i])
+			bm_shared_set_head(index, dirno * BITMAP_DIR_ENTRIES + i, dir[i].version,
+							   newBlks[i]);
+	}
+
+	UnlockReleaseBuffer(buffer);
+	UnlockReleaseBuffer(mbuffer);
+}
+
+/* store slice heads changed by cleanup in the meta page */
+static void
+bm_update_slices(Relation index, BlockNumber *oldBlks, BlockNumber *newBlks)
+{
+	Buffer		mbuffer;
+	BitmapMetaPageData *meta;
+	GenericXLogState *gxlogState;
 
 	mbuffer = ReadBuffer(index, BITMAP_METAPAGE_BLKNO);
-	LockBuffer(mbuffer, BUFFER_LOCK_SHARE);
-	meta = BitmapPageGetMeta(BufferGetPage(mbuffer));
+	LockBuffer(mbuffer, BUFFER_LOCK_EXCLUSIVE);
+
+	gxlogState = GenericXLogStart(index);
+	meta = BitmapPageGetMeta(GenericXLogRegisterBuffer(gxlogState, mbuffer, 0));
 
-	nvalues = meta->ndistinct;
-	if (nvalues == 0)
+	for (int k = 0; k < BITMAP_SLICES; k++)
 	{
-		UnlockReleaseBuffer(mbuffer);
-		return stats;
+		if (meta->sliceBlk[k] == oldBlks[k])
+			meta->sliceBlk[k] = newBlks[k];
+	}
+
+	GenericXLogFinish(gxlogState);
+	UnlockReleaseBuffer(mbuffer);
+}
+
+/*
+ * Reclaim the ordinals of values left without bitmap pages, so that the
+ * dictionary tracks live values. Their hash entries go and their directory
+ * entries are freed for new values under a new version. The meta page is
+ * held exclusively locked throughout, which inserts need to add a value or
+ * to start a chain. Linear dictionaries keep ordinals in value page order
+ * and are left alone, as are sliced and segmented indexes whose values have
+ * no chains. Striped values keep their stripe page and are not reclaimed.
+ * Nothing is reclaimed while entries are pending, they may be the only heap
+ * tuples of a value without a chain.
+ */
+static void
+bm_reclaim_values(Relation index)
+{
+	Buffer		metabuf,
+				buffer;
+	BitmapMetaPageData *meta;
+	BitmapDirEntry *dir;
+	GenericXLogState *gxlogState;
+	uint32		nvalues,
+				ndirpages;
+	bool	   *reclaim;
+	bool		found = false;
+
+	metabuf = ReadBuffer(index, BITMAP_METAPAGE_BLKNO);
+	LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
+	meta = BitmapPageGetMeta(BufferGetPage(metabuf));
+	nvalues = meta->nvalues;
+	ndirpages = meta->ndirpages;
+
+	if (meta->nbuckets == 0 || nvalues == 0 || !BitmapMetaValueChains(meta) ||
+		meta->pendingHead != InvalidBlockNumber)
+	{
+		UnlockReleaseBuffer(metabuf);
+		return;
 	}
 
-	blocks = palloc(sizeof(BlockNumber) * nvalues);
-	memcpy(blocks, meta->startBlk, sizeof(BlockNumber) * nvalues);
+	reclaim = palloc0(sizeof(bool) * nvalues);
+	for (uint32 dirno = 0; dirno < ndirpages; dirno++)
+	{
+		buffer = ReadBuffer(index, meta->dirBlk[dirno]);
+		LockBuffer(buffer, BUFFER_LOCK_SHARE);
+		dir = BitmapPageGetDir(BufferGetPage(buffer));
+
+		for (uint32 i = 0; i < BITMAP_DIR_ENTRIES; i++)
+		{
+			uint32		valindex = dirno * BITMAP_DIR_ENTRIES + i;
+
+			if (valindex < nvalues && dir[i].startBlk == InvalidBlockNumber &&
+				!(dir[i].flags & BITMAP_DIR_FREE))
+				reclaim[valindex] = found = true;
+		}
 
-	for (int i = 0; i < meta->ndistinct; i++)
+		UnlockReleaseBuffer(buffer);
+	}
+
+	if (found)
 	{
-		blkno = blocks[i];
-		preblk = InvalidBlockNumber;
-		while (blkno != InvalidBlockNumber)
+		/* values can no longer be found before their ordinals are freed */
+		bm_hash_reclaim(index, metabuf, reclaim);
+
+		for (uint32 dirno = 0; dirno < ndirpages; dirno++)
 		{
+			uint32		first = dirno * BITMAP_DIR_ENTRIES;
+			uint32		n = 0;
+
 			vacuum_delay_point();
 
-			buffer = ReadBuffer(index, blkno);
+			buffer = ReadBuffer(index, BitmapPageGetMeta(BufferGetPage(metabuf))->dirBlk[dirno]);
 			LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
-			page = BufferGetPage(buffer);
-			opaque = BitmapPageGetOpaque(page);
 
-			if (BitmapPageDeleted(page))
-			{
-				stats->pages_free++;
-				/* remove deleted page from the list */
-				if (preblk != InvalidBlockNumber)
-				{
-					prevbuf = ReadBuffer(index, preblk);
-					LockBuffer(prevbuf, BUFFER_LOCK_EXCLUSIVE);
+			gxlogState = GenericXLogStart(index);
+			meta = BitmapPageGetMeta(GenericXLogRegisterBuffer(gxlogState, metabuf, 0));
+			dir = BitmapPageGetDir(GenericXLogRegisterBuffer(gxlogState, buffer, 0));
 
-					gxlogState = GenericXLogStart(index);
-					prepage = GenericXLogRegisterBuffer(gxlogState, prevbuf, 0);
-					BitmapPageGetOpaque(prepage)->nextBlk = opaque->nextBlk;
+			for (uint32 i = 0; i < BITMAP_DIR_ENTRIES && first + i < nvalues; i++)
+			{
+				if (!reclaim[first + i])
+					continue;
 
-					GenericXLogFinish(gxlogState);
-					UnlockReleaseBuffer(prevbuf);
-				}
-				else
-					/* first page is removed, need to store the update */
-				{
-					blocks[i] = opaque->nextBlk;
-					if (blocks[i] == InvalidBlockNumber)
-					{
-						nvalues--;
-					}
-				}
-				RecordFreeIndexPage(index, blkno);
+				dir[i].flags |= BITMAP_DIR_FREE;
+				dir[i].version++;
+				n++;
+			}
+			meta->nfree += n;
+			if (n > 0)
+			{
+				/* deleted value tuples left room anywhere on the value pages */
+				meta->freeDirno = Min(meta->freeDirno, dirno);
+				if (meta->keylen == 0)
+					meta->valFreeBlk = BITMAP_VALPAGE_START_BLKNO;
 			}
 
-			preblk = blkno;
-			blkno = opaque->nextBlk;
+			if (n > 0)
+				GenericXLogFinish(gxlogState);
+			else
+				GenericXLogAbort(gxlogState);
 			UnlockReleaseBuffer(buffer);
 		}
 	}
 
-	/* copy changes to meta page */
-	LockBuffer(mbuffer, BUFFER_LOCK_UNLOCK);
-	LockBuffer(mbuffer, BUFFER_LOCK_EXCLUSIVE);
+	pfree(reclaim);
+	UnlockReleaseBuffer(metabuf);
+}
 
-	gxlogState = GenericXLogStart(index);
-	page = GenericXLogRegisterBuffer(gxlogState, mbuffer, 0);
-	meta = BitmapPageGetMeta(page);
-	memcpy(meta->startBlk, blocks, sizeof(BlockNumber) * meta->ndistinct);
-	meta->ndistinct = nvalues;
+IndexBulkDeleteResult *
+bmvacuumcleanup(IndexVacuumInfo *info, IndexBulkDeleteResult *stats)
+{
+	Relation	index = info->index;
+	BitmapMetaPageData *meta;
+	BlockNumber *blocks,
+			   *newblocks;
 
-	GenericXLogFinish(gxlogState);
-	UnlockReleaseBuffer(mbuffer);
+	if (info->analyze_only)
+		return stats;
+
+	if (stats == NULL)
+		stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
+
+	if (bm_fastupdate(index))
+		bm_pending_merge(index, true);
+
+	meta = bm_get_meta(index);
+	blocks = palloc(sizeof(BlockNumber) * BITMAP_DIR_ENTRIES);
+	newblocks = palloc(sizeof(BlockNumber) * BITMAP_DIR_ENTRIES);
+
+	for (int dirno = 0; meta->ndistinct > 0 && dirno < meta->ndirpages; dirno++)
+	{
+		bool		changed = false;
+
+		bm_read_dir(index, meta->dirBlk[dirno], blocks);
+
+		for (int i = 0; i < BITMAP_DIR_ENTRIES; i++)
+		{
+			newblocks[i] = blocks[i];
+			if (blocks[i] == InvalidBlockNumber)
+				continue;
+
+			if (bm_striped(index))
+			{
+				bm_cleanup_stripes(index, blocks[i], stats);
+				continue;
+			}
+
+			newblocks[i] = bm_cleanup_chain(index, blocks[i], stats);
+			changed |= newblocks[i] != blocks[i];
+		}
+
+		if (changed)
+			bm_update_dir(index, dirno, meta->dirBlk[dirno], blocks, newblocks);
+	}
+
+	if (meta->sliced)
+	{
+		bool		changed = false;
+
+		for (int k = 0; k < BITMAP_SLICES; k++)
+		{
+			blocks[k] = meta->sliceBlk[k];
+			newblocks[k] = blocks[k];
+			if (blocks[k] != InvalidBlockNumber)
+				newblocks[k] = bm_cleanup_chain(index, blocks[k], stats);
+			changed |= newblocks[k] != blocks[k];
+		}
+
+		if (changed)
+			bm_update_slices(index, blocks, newblocks);
+	}
+
+	bm_reclaim_values(index);
 
 	IndexFreeSpaceMapVacuum(info->index);
 
@@ -9,6 +9,7 @@
 #include <catalog/pg_opfamily.h>
 #include <catalog/pg_type.h>
 #include <utils/builtins.h>
+#include <utils/fmgroids.h>
 #include <utils/lsyscache.h>
 #include <utils/regproc.h>
 #include <utils/syscache.h>
@@ -96,6 +97,14 @@ bmvalidate(Oid opclassoid)
 				ok = check_amproc_signature(procform->amproc, INT4OID, false,
 											2, 2, opckeytype, opckeytype);
 				break;
+			case BITMAP_HASH_PROC:
+				ok = check_amproc_signature(procform->amproc, INT4OID, false,
+											1, 1, opckeytype);
+				/* timestamptz opclass hashes with timestamp_hash() like hash AM */
+				if (!ok && procform->amproc == F_TIMESTAMP_HASH &&
+					opckeytype == TIMESTAMPTZOID)
+					ok = true;
+				break;
 			default:
 				ereport(INFO,
 						(errcode(ERRCODE_INVALID_OBJECT_DEFINITION),
@@ -0,0 +1,417 @@
+#include <postgres.h>
+
+#include <access/bufmask.h>
+#include <access/rmgr.h>
+#include <access/xlog_internal.h>
+#include <access/xloginsert.h>
+#include <access/xlogutils.h>
+#include <miscadmin.h>
+#include <storage/bufmgr.h>
+#include <utils/guc.h>
+#include <utils/rel.h>
+
+#include "bitmap.h"
+
+/*
+ * WAL records of the bitmap resource manager. Generic WAL records diff a
+ * copy of every page they register and log new pages whole, while these
+ * records only carry what changed: the bitmap tuple added to a page, the
+ * tuple starting a new chain page, or the heap tuples vacuum removed from a
+ * page. Redo applies them with the functions that changed the page, which
+ * only depend on the page, so it comes out the same.
+ *
+ * Custom resource managers need PostgreSQL 15 and must be registered while
+ * shared libraries are preloaded. Records are only written with
+ * bitmap.compact_wal set, once the library is preloaded on the primary and
+ * on every standby, which cannot replay them otherwise. Other changes keep
+ * using generic WAL records.
+ */
+
+/*
+ * Set at build time to an id registered at
+ * https://wiki.postgresql.org/wiki/CustomWALResourceManagers. The default is
+ * the id reserved for development, which other extensions may use as well,
+ * so the resource manager is not registered nor records written with it.
+ */
+#ifndef BITMAP_RMGR_ID
+#define BITMAP_RMGR_ID 128		/* RM_EXPERIMENTAL_ID */
+#endif
+
+#define XLOG_BITMAP_INSERT 0x00		/* tuple added to block 0 */
+#define XLOG_BITMAP_NEW_PAGE 0x10	/* block 0 started with a tuple after block 1,
+									 * block 2 or else 1 the first of the chain */
+#define XLOG_BITMAP_VACUUM 0x20 /* heap tuples removed from block 0 */
+
+typedef struct xl_bitmap_new_page
+{
+	BlockNumber extentBlk;		/* extent left to the chain */
+	uint16		extentLeft;
+	/* bitmap tuple follows */
+} xl_bitmap_new_page;
+
+#define SizeOfBitmapNewPage (offsetof(xl_bitmap_new_page, extentLeft) + sizeof(uint16))
+
+static bool bm_compact_wal = false;
+static bool bm_rmgr_registered = false;
+
+/* whether changes of an index are logged by compact records */
+bool
+bm_xlog_enabled(Relation index)
+{
+	return bm_rmgr_registered && bm_compact_wal && RelationNeedsWAL(index);
+}
+
+/*
+ * Add a bitmap tuple to a locked page unless it is deleted or full, logged
+ * by a record carrying the tuple. Returns whether the page holds the tuple.
+ */
+bool
+bm_xlog_add_tup(Buffer buffer, BitmapTuple *tup)
+{
+	Page		page = BufferGetPage(buffer);
+	bool		done;
+	bool		inserted = false;
+
+	START_CRIT_SECTION();
+
+	done = !BitmapPageDeleted(page) && bm_page_add_tup(page, tup, &inserted);
+	if (inserted)
+	{
+		XLogRecPtr	recptr;
+
+		MarkBufferDirty(buffer);
+
+		XLogBeginInsert();
+		XLogRegisterBuffer(0, buffer, REGBUF_STANDARD);
+		XLogRegisterBufData(0, (char *) tup, BitmapTupleSize(tup));
+		recptr = XLogInsert(BITMAP_RMGR_ID, XLOG_BITMAP_INSERT);
+		PageSetLSN(page, recptr);
+	}
+
+	END_CRIT_SECTION();
+
+	return done;
+}
+
+/* start a chain page with a tuple, linked after the last page */
+static void
+bm_new_page_apply(Page npage, BitmapTuple *tup)
+{
+	bool		inserted;
+
+	bm_init_page(npage, BITMAP_PAGE_INDEX);
+	if (!bm_page_add_tup(npage, tup, &inserted))
+		elog(PANIC, "insert bitmap tuple failed on new page");
+}
+
+/*
+ * Start a new chain page with a tuple after the last page, and record it
+ * with the extent left in the first page of the chain. lastbuf may be the
+ * first page.
+ */
+void
+bm_xlog_new_page(Buffer headbuf, Buffer lastbuf, Buffer nbuffer,
+				 BlockNumber extentBlk, uint16 extentLeft, BitmapTuple *tup)
+{
+	BlockNumber blkno = BufferGetBlockNumber(nbuffer);
+	BitmapPageOpaque headopaque = BitmapPageGetOpaque(BufferGetPage(headbuf));
+	xl_bitmap_new_page xlrec;
+	XLogRecPtr	recptr;
+
+	xlrec.extentBlk = extentBlk;
+	xlrec.extentLeft = extentLeft;
+
+	START_CRIT_SECTION();
+
+	bm_new_page_apply(BufferGetPage(nbuffer), tup);
+	BitmapPageGetOpaque(BufferGetPage(lastbuf))->nextBlk = blkno;
+	headopaque->tailBlk = blkno;
+	headopaque->extentBlk = extentBlk;
+	headopaque->extentLeft = extentLeft;
+
+	MarkBufferDirty(nbuffer);
+	MarkBufferDirty(lastbuf);
+	if (headbuf != lastbuf)
+		MarkBufferDirty(headbuf);
+
+	XLogBeginInsert();
+	XLogRegisterData((char *) &xlrec, SizeOfBitmapNewPage);
+	XLogRegisterData((char *) tup, BitmapTupleSize(tup));
+	XLogRegisterBuffer(0, nbuffer, REGBUF_WILL_INIT);
+	XLogRegisterBuffer(1, lastbuf, REGBUF_STANDARD);
+	if (headbuf != lastbuf)
+		XLogRegisterBuffer(2, headbuf, REGBUF_STANDARD);
+	recptr = XLogInsert(BITMAP_RMGR_ID, XLOG_BITMAP_NEW_PAGE);
+
+	PageSetLSN(BufferGetPage(nbuffer), recptr);
+	PageSetLSN(BufferGetPage(lastbuf), recptr);
+	if (headbuf != lastbuf)
+		PageSetLSN(BufferGetPage(headbuf), recptr);
+
+	END_CRIT_SECTION();
+}
+
+/*
+ * Replace the tuples of a locked page by those bm_vacuum_tuples encoded,
+ * logged by the sorted heap tuples it removed.
+ */
+void
+bm_xlog_vacuum(Buffer buffer, char *contents, Size used, int ntups,
+			   ItemPointer dead, int ndead)
+{
+	Page		page = BufferGetPage(buffer);
+	XLogRecPtr	recptr;
+
+	qsort(dead, ndead, sizeof(ItemPointerData), (int (*) (const void *, const void *)) ItemPointerCompare);
+
+	START_CRIT_SECTION();
+
+	bm_vacuum_apply(page, contents, used, ntups);
+	MarkBufferDirty(buffer);
+
+	XLogBeginInsert();
+	XLogRegisterBuffer(0, buffer, REGBUF_STANDARD);
+	XLogRegisterBufData(0, (char *) dead, sizeof(ItemPointerData) * ndead);
+	recptr = XLogInsert(BITMAP_RMGR_ID, XLOG_BITMAP_VACUUM);
+	PageSetLSN(page, recptr);
+
+	END_CRIT_SECTION();
+}
+
+typedef struct BitmapRedoDead
+{
+	ItemPointer tids;
+	int			n;
+} BitmapRedoDead;
+
+/* vacuum callback of redo, the heap tuples the record lists are dead */
+static bool
+bm_redo_dead(ItemPointer tid, void *state)
+{
+	BitmapRedoDead *dead = (BitmapRedoDead *) state;
+
+	return bsearch(tid, dead->tids, dead->n, sizeof(ItemPointerData),
+				   (int (*) (const void *, const void *)) ItemPointerCompare) != NULL;
+}
+
+static void
+bm_redo_insert(XLogReaderState *record)
+{
+	Buffer		buffer;
+
+	if (XLogReadBufferForRedo(record, 0, &buffer) == BLK_NEEDS_REDO)
+	{
+		Page		page = BufferGetPage(buffer);
+		BitmapTuple *tup = (BitmapTuple *) XLogRecGetBlockData(record, 0, NULL);
+		bool		inserted;
+
+		if (!bm_page_add_tup(page, tup, &inserted))
+			elog(PANIC, "bitmap redo: failed to add tuple");
+
+		PageSetLSN(page, record->EndRecPtr);
+		MarkBufferDirty(buffer);
+	}
+	if (BufferIsValid(buffer))
+		UnlockReleaseBuffer(buffer);
+}
+
+static void
+bm_redo_new_page(XLogReaderState *record)
+{
+	xl_bitmap_new_page *xlrec = (xl_bitmap_new_page *) XLogRecGetData(record);
+	BitmapTuple *tup = (BitmapTuple *) ((char *) xlrec + SizeOfBitmapNewPage);
+	bool		hashead = XLogRecHasBlockRef(record, 2);
+	Buffer		nbuffer,
+				buffer;
+	BlockNumber blkno;
+
+	nbuffer = XLogInitBufferForRedo(record, 0);
+	blkno = BufferGetBlockNumber(nbuffer);
+	bm_new_page_apply(BufferGetPage(nbuffer), tup);
+	PageSetLSN(BufferGetPage(nbuffer), record->EndRecPtr);
+	MarkBufferDirty(nbuffer);
+
+	for (uint8 block_id = 1; block_id <= (hashead ? 2 : 1); block_id++)
+	{
+		if (XLogReadBufferForRedo(record, block_id, &buffer) == BLK_NEEDS_REDO)
+		{
+			Page		page = BufferGetPage(buffer);
+			BitmapPageOpaque opaque = BitmapPageGetOpaque(page);
+
+			if (block_id == 1)
+				opaque->nextBlk = blkno;
+			if (block_id == 2 || !hashead)
+			{
+				opaque->tailBlk = blkno;
+				opaque->extentBlk = xlrec->extentBlk;
+				opaque->extentLeft = xlrec->extentLeft;
+			}
+
+			PageSetLSN(page, record->EndRecPtr);
+			MarkBufferDirty(buffer);
+		}
+		if (BufferIsValid(buffer))
+			UnlockReleaseBuffer(buffer);
+	}
+
+	UnlockReleaseBuffer(nbuffer);
+}
+
+static void
+bm_redo_vacuum(XLogReaderState *record)
+{
+	Buffer		buffer;
+
+	if (XLogReadBufferForRedo(record, 0, &buffer) == BLK_NEEDS_REDO)
+	{
+		Page		page = BufferGetPage(buffer);
+		PGAlignedBlock contents;
+		BitmapRedoDead dead;
+		BitmapTuple *left;
+		BlockNumber heapblk;
+		Size		len,
+					used;
+		int			ntups;
+		double		removed;
+
+		dead.tids = (ItemPointer) XLogRecGetBlockData(record, 0, &len);
+		dead.n = len / sizeof(ItemPointerData);
+
+		if (bm_vacuum_tuples(page, bm_redo_dead, &dead, contents.data, &used, &ntups,
+							 &removed, &left, &heapblk) <= BitmapPageGetOpaque(page)->maxoff)
+			elog(PANIC, "bitmap redo: vacuumed tuples do not fit");
+		bm_vacuum_apply(page, contents.data, used, ntups);
+
+		PageSetLSN(page, record->EndRecPtr);
+		MarkBufferDirty(buffer);
+	}
+	if (BufferIsValid(buffer))
+		UnlockReleaseBuffer(buffer);
+}
+
+static void
+bm_redo(XLogReaderState *record)
+{
+	uint8		info = XLogRecGetInfo(record) & ~XLR_INFO_MASK;
+
+	switch (info)
+	{
+		case XLOG_BITMAP_INSERT:
+			bm_redo_insert(record);
+			break;
+		case XLOG_BITMAP_NEW_PAGE:
+			bm_redo_new_page(record);
+			break;
+		case XLOG_BITMAP_VACUUM:
+			bm_redo_vacuum(record);
+			break;
+		default:
+			elog(PANIC, "bitmap redo: unknown op code %u", info);
+	}
+}
+
+static void
+bm_desc(StringInfo buf, XLogReaderState *record)
+{
+	uint8		info = XLogRecGetInfo(record) & ~XLR_INFO_MASK;
+	Size		len;
+
+	switch (info)
+	{
+		case XLOG_BITMAP_INSERT:
+			if (XLogRecHasBlockData(record, 0))
+				appendStringInfo(buf, "heapblk %u",
+								 ((BitmapTuple *) XLogRecGetBlockData(record, 0, NULL))->heapblk);
+			break;
+		case XLOG_BITMAP_NEW_PAGE:
+			appendStringInfo(buf, "extent %u left %u",
+							 ((xl_bitmap_new_page *) XLogRecGetData(record))->extentBlk,
+							 ((xl_bitmap_new_page *) XLogRecGetData(record))->extentLeft);
+			break;
+		case XLOG_BITMAP_VACUUM:
+			if (XLogRecHasBlockData(record, 0))
+			{
+				XLogRecGetBlockData(record, 0, &len);
+				appendStringInfo(buf, "ndead %zu", len / sizeof(ItemPointerData));
+			}
+			break;
+	}
+}
+
+static const char *
+bm_identify(uint8 info)
+{
+	switch (info & ~XLR_INFO_MASK)
+	{
+		case XLOG_BITMAP_INSERT:
+			return "INSERT";
+		case XLOG_BITMAP_NEW_PAGE:
+			return "NEW_PAGE";
+		case XLOG_BITMAP_VACUUM:
+			return "VACUUM";
+	}
+
+	return NULL;
+}
+
+/* mask what wal_consistency_checking may find different after redo */
+static void
+bm_mask(char *pagedata, BlockNumber blkno)
+{
+	mask_page_lsn_and_checksum(pagedata);
+	mask_unused_space(pagedata);
+}
+
+#if PG_VERSION_NUM >= 150000
+static const RmgrData bm_rmgr = {
+	.rm_name = "bitmap",
+	.rm_redo = bm_redo,
+	.rm_desc = bm_desc,
+	.rm_identify = bm_identify,
+	.rm_mask = bm_mask,
+};
+#endif
+
+/* refuse compact records while their id may be shared with other extensions */
+static bool
+bm_check_compact_wal(bool *newval, void **extra, GucSource source)
+{
+#if PG_VERSION_NUM >= 150000
+	if (*newval && BITMAP_RMGR_ID == RM_EXPERIMENTAL_ID)
+	{
+		GUC_check_errdetail("The bitmap library was built with the experimental resource manager id %d.",
+							RM_EXPERIMENTAL_ID);
+		GUC_check_errhint("Build the library with BITMAP_RMGR_ID set to a registered id.");
+		return false;
+	}
+#endif
+	return true;
+}
+
+/* define the compact WAL setting and register the resource manager when preloaded */
+void
+bm_xlog_init(void)
+{
+	DefineCustomBoolVariable("bitmap.compact_wal",
+							 "Log bitmap page changes by records of the bitmap resource manager.",
+							 "Needs the library in shared_preload_libraries of the primary and of every standby.",
+							 &bm_compact_wal,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 bm_check_compact_wal, NULL, NULL);
+
+#if PG_VERSION_NUM >= 150000
+
+	/*
+	 * The development id is left to other extensions preloaded alongside,
+	 * no record is written with it anyway.
+	 */
+	if (process_shared_preload_libraries_in_progress &&
+		BITMAP_RMGR_ID != RM_EXPERIMENTAL_ID)
+	{
+		RegisterCustomRmgr(BITMAP_RMGR_ID, &bm_rmgr);
+		bm_rmgr_registered = true;
+	}
+#endif
+}
@@ -13,9 +13,10 @@ INSERT INTO test_tbl VALUES (1, 'x'), (0, 'y'), (NULL, 'N');
 
 SELECT * FROM bm_metap('bmidx');
 SELECT * FROM bm_valuep('bmidx', 1);
-SELECT * FROM bm_indexp('bmidx', 2);
-SELECT * FROM bm_indexp('bmidx', 3);
 SELECT * FROM bm_indexp('bmidx', 4);
+SELECT * FROM bm_indexp('bmidx', 5);
+SELECT * FROM bm_indexp('bmidx', 6);
+SELECT * FROM bm_valuep('bmidx', 2);
 
 SET enable_seqscan=off;
 EXPLAIN SELECT * FROM test_tbl WHERE i = 0;
@@ -98,6 +99,340 @@ RESET enable_seqscan;
 RESET enable_bitmapscan;
 RESET enable_indexscan;
 
+-- More distinct values than a single directory page holds
+CREATE TABLE test_many (i int4);
+INSERT INTO test_many SELECT i FROM generate_series(1,3000) i;
+CREATE INDEX bmidx_many ON test_many USING bitmap (i);
+INSERT INTO test_many SELECT i FROM generate_series(2001,5000) i;
+SELECT ndistinct FROM bm_metap('bmidx_many');
+
+SET enable_seqscan=off;
+SELECT count(*) FROM test_many WHERE i = 2500;
+SELECT count(*) FROM test_many WHERE i = 4999;
+
+-- Nested loop rescans of the same keys
+SET enable_hashjoin=off;
+SET enable_mergejoin=off;
+SELECT count(*) FROM (VALUES (1), (2500), (1), (2500), (9999)) v(k)
+JOIN test_many m ON m.i = v.k;
+RESET enable_hashjoin;
+RESET enable_mergejoin;
+RESET enable_seqscan;
+
+-- Packed float keys compare like float equality
+CREATE TABLE test_float (f float8);
+CREATE INDEX bmidx_float ON test_float USING bitmap (f);
+INSERT INTO test_float VALUES (0), ('-0'), ('NaN'), ('NaN'), (1.5), (NULL);
+SELECT ndistinct FROM bm_metap('bmidx_float');
+
+SET enable_seqscan=off;
+SELECT count(*) FROM test_float WHERE f = '-0';
+SELECT count(*) FROM test_float WHERE f = 'NaN';
+RESET enable_seqscan;
+
+-- Vacuum reclaims values left without index tuples
+CREATE TABLE test_gc (t text);
+CREATE INDEX bmidx_gc ON test_gc USING bitmap (t);
+INSERT INTO test_gc VALUES ('a'), ('b'), ('c');
+DELETE FROM test_gc WHERE t = 'b';
+VACUUM test_gc;
+SELECT * FROM bm_valuep('bmidx_gc', 1);
+INSERT INTO test_gc VALUES ('d'), ('b');
+SELECT ndistinct FROM bm_metap('bmidx_gc');
+
+SET enable_seqscan=off;
+SELECT count(*) FROM test_gc WHERE t = 'b';
+SELECT count(*) FROM test_gc WHERE t = 'd';
+RESET enable_seqscan;
+
+-- Multicolumn indexes keep a dictionary per column
+CREATE TABLE test_multi (a int4, b text);
+INSERT INTO test_multi SELECT i % 4, (i % 5)::text FROM generate_series(1,100) i;
+INSERT INTO test_multi VALUES (1, NULL);
+CREATE INDEX bmidx_multi ON test_multi USING bitmap (a, b);
+SELECT ndistinct FROM bm_metap('bmidx_multi');
+
+SET enable_seqscan=off;
+SELECT count(*) FROM test_multi WHERE a = 1;
+SELECT count(*) FROM test_multi WHERE b = '2';
+SELECT count(*) FROM test_multi WHERE a = 1 AND b = '2';
+SELECT count(*) FROM test_multi WHERE a = 1 AND b IS NOT NULL;
+SELECT count(*) FROM test_multi WHERE a = 9 AND b = '2';
+SET enable_bitmapscan=off;
+SELECT count(*) FROM test_multi WHERE a = 1 AND b = '2';
+SELECT count(*) FROM test_multi WHERE b IS NULL;
+RESET enable_bitmapscan;
+RESET enable_seqscan;
+
+-- Binned indexes keep a value per bin and recheck
+CREATE TABLE test_bin (ts timestamp, f float8);
+INSERT INTO test_bin SELECT '2024-01-01'::timestamp + i * interval '1 hour', i / 10.0
+FROM generate_series(0, 239) i;
+CREATE INDEX bmidx_bin_ts ON test_bin USING bitmap (ts) WITH (bin_unit = 'day');
+CREATE INDEX bmidx_bin_f ON test_bin USING bitmap (f) WITH (bin_width = 5);
+SELECT ndistinct FROM bm_metap('bmidx_bin_ts');
+SELECT ndistinct FROM bm_metap('bmidx_bin_f');
+
+SET enable_seqscan=off;
+SELECT count(*) FROM test_bin WHERE ts = '2024-01-03 05:00';
+SELECT count(*) FROM test_bin WHERE ts >= '2024-01-03' AND ts < '2024-01-05';
+SELECT count(*) FROM test_bin WHERE ts > '2024-01-09 12:00';
+SELECT count(*) FROM test_bin WHERE f = 7.5;
+SELECT count(*) FROM test_bin WHERE f < 2.05;
+RESET enable_seqscan;
+
+-- Consecutive heap blocks with the same heap tuples make a run
+CREATE TABLE test_run (i int4);
+CREATE INDEX bmidx_run ON test_run USING bitmap (i);
+INSERT INTO test_run SELECT 7 FROM generate_series(1, 2260);
+SELECT * FROM bm_indexp('bmidx_run', 4);
+DELETE FROM test_run WHERE ctid = '(4,10)';
+VACUUM test_run;
+SELECT * FROM bm_indexp('bmidx_run', 4);
+
+SET enable_seqscan=off;
+SELECT count(*) FROM test_run WHERE i = 7;
+SET enable_bitmapscan=off;
+SELECT count(*) FROM test_run WHERE i = 7;
+RESET enable_bitmapscan;
+RESET enable_seqscan;
+
+-- Dominant values list the heap tuples they miss
+CREATE TABLE test_dom (i int4);
+CREATE INDEX bmidx_dom ON test_dom USING bitmap (i);
+INSERT INTO test_dom SELECT (g % 50 = 0)::int FROM generate_series(1, 452) g;
+SELECT * FROM bm_indexp('bmidx_dom', 4);
+
+SET enable_seqscan=off;
+SELECT count(*) FROM test_dom WHERE i = 0;
+SELECT count(*) FROM test_dom WHERE i = 1;
+SET enable_bitmapscan=off;
+SELECT count(*) FROM test_dom WHERE i = 0;
+RESET enable_bitmapscan;
+RESET enable_seqscan;
+
+-- Sliced indexes keep bit slices of the value ordinals
+CREATE TABLE test_slice (i int4);
+INSERT INTO test_slice SELECT g % 100 FROM generate_series(1, 5000) g;
+CREATE INDEX bmidx_slice ON test_slice USING bitmap (i) WITH (sliced = on);
+INSERT INTO test_slice SELECT g % 100 FROM generate_series(1, 500) g;
+INSERT INTO test_slice VALUES (1000);
+SELECT ndistinct FROM bm_metap('bmidx_slice');
+
+SET enable_seqscan=off;
+SELECT count(*) FROM test_slice WHERE i = 7;
+SELECT count(*) FROM test_slice WHERE i = 1000;
+SELECT count(*) FROM test_slice WHERE i < 3;
+SELECT count(*) FROM test_slice WHERE i IS NOT NULL;
+DELETE FROM test_slice WHERE i = 7;
+VACUUM test_slice;
+SELECT count(*) FROM test_slice WHERE i = 7;
+SELECT count(*) FROM test_slice WHERE i = 8;
+SET enable_bitmapscan=off;
+SELECT count(*) FROM test_slice WHERE i = 8;
+RESET enable_bitmapscan;
+RESET enable_seqscan;
+CREATE INDEX ON test_multi USING bitmap (a, b) WITH (sliced = on);
+
+-- Segmented indexes keep the bitmaps of all values of heap block ranges together
+CREATE TABLE test_seg (a int4, b text);
+INSERT INTO test_seg SELECT g % 10, 'v' || (g % 3) FROM generate_series(1, 3000) g;
+CREATE INDEX bmidx_seg ON test_seg USING bitmap (a, b) WITH (segment_blocks = 4);
+INSERT INTO test_seg SELECT g % 10, 'v' || (g % 3) FROM generate_series(1, 300) g;
+SELECT ndistinct FROM bm_metap('bmidx_seg');
+
+SET enable_seqscan=off;
+SELECT count(*) FROM test_seg WHERE a = 7;
+SELECT count(*) FROM test_seg WHERE b = 'v1';
+SELECT count(*) FROM test_seg WHERE a = 7 AND b = 'v1';
+SELECT count(*) FROM test_seg WHERE a < 3;
+SELECT count(*) FROM test_seg WHERE a IN (1, 2);
+DELETE FROM test_seg WHERE a = 7;
+VACUUM test_seg;
+SELECT count(*) FROM test_seg WHERE a = 7;
+SELECT count(*) FROM test_seg WHERE a = 8;
+SET enable_bitmapscan=off;
+SELECT count(*) FROM test_seg WHERE a = 8;
+RESET enable_bitmapscan;
+RESET enable_seqscan;
+CREATE INDEX ON test_slice USING bitmap (i) WITH (sliced = on, segment_blocks = 8);
+
+-- Bitmap tuples stay sorted by heap block
+CREATE TABLE test_sort (i int4) WITH (fillfactor = 50);
+CREATE INDEX bmidx_sort ON test_sort USING bitmap (i);
+INSERT INTO test_sort SELECT 1 FROM generate_series(1, 300);
+UPDATE test_sort SET i = 2 WHERE ctid = '(2,1)';
+UPDATE test_sort SET i = 2 WHERE ctid = '(0,1)';
+SELECT index, heap_blk, run, container FROM bm_indexp('bmidx_sort', 5);
+
+SET enable_seqscan=off;
+SET enable_bitmapscan=off;
+SELECT count(*) FROM test_sort WHERE i = 2;
+RESET enable_bitmapscan;
+RESET enable_seqscan;
+
+-- Long chains get a skip directory
+CREATE TABLE test_skip (g int4, i int4);
+CREATE INDEX bmidx_skip ON test_skip USING bitmap (i);
+INSERT INTO test_skip SELECT g, (g % 3 = 0)::int FROM generate_series(1, 400000) g;
+DELETE FROM test_skip WHERE g <= 22600 AND i = 1;
+VACUUM test_skip;
+INSERT INTO test_skip SELECT 0, 1 FROM generate_series(1, 1000);
+DELETE FROM test_skip WHERE g > 390000 AND i = 0;
+VACUUM test_skip;
+
+SET enable_seqscan=off;
+SELECT count(*) FROM test_skip WHERE i = 1;
+SELECT count(*) FROM test_skip WHERE i = 0;
+SET enable_bitmapscan=off;
+SELECT count(*) FROM test_skip WHERE i = 1;
+RESET enable_bitmapscan;
+RESET enable_seqscan;
+
+-- Striped indexes spread the chain of a value over stripes
+CREATE TABLE test_stripe (g int4, i int4);
+INSERT INTO test_stripe SELECT g, g % 5 FROM generate_series(1, 5000) g;
+CREATE INDEX bmidx_stripe ON test_stripe USING bitmap (i) WITH (stripes = 4);
+INSERT INTO test_stripe SELECT g, g % 5 FROM generate_series(5001, 10000) g;
+INSERT INTO test_stripe SELECT 0, 7 FROM generate_series(1, 100);
+DELETE FROM test_stripe WHERE i = 3;
+VACUUM test_stripe;
+
+SET enable_seqscan=off;
+SELECT count(*) FROM test_stripe WHERE i = 1;
+SELECT count(*) FROM test_stripe WHERE i = 3;
+SELECT count(*) FROM test_stripe WHERE i = 7;
+SELECT count(*) FROM test_stripe WHERE i < 2;
+SET enable_bitmapscan=off;
+SELECT count(*) FROM test_stripe WHERE i = 1;
+RESET enable_bitmapscan;
+RESET enable_seqscan;
+CREATE INDEX ON test_seg USING bitmap (a) WITH (segment_blocks = 4, stripes = 2);
+
+-- Chains take their pages in extents
+CREATE TABLE test_extent (g int4, i int4);
+INSERT INTO test_extent SELECT g, g % 4 FROM generate_series(1, 100000) g;
+CREATE INDEX bmidx_extent ON test_extent USING bitmap (i) WITH (extent_pages = 8);
+INSERT INTO test_extent SELECT g, g % 4 FROM generate_series(100001, 200000) g;
+DELETE FROM test_extent WHERE i = 2;
+VACUUM test_extent;
+INSERT INTO test_extent SELECT 0, 5 FROM generate_series(1, 10);
+
+SET enable_seqscan=off;
+SELECT count(*) FROM test_extent WHERE i = 1;
+SELECT count(*) FROM test_extent WHERE i = 2;
+SELECT count(*) FROM test_extent WHERE i = 5;
+SET enable_bitmapscan=off;
+SELECT count(*) FROM test_extent WHERE i = 3;
+RESET enable_bitmapscan;
+RESET enable_seqscan;
+
+-- Inserts go to the pending list
+CREATE TABLE test_pending (g int4, i int4);
+INSERT INTO test_pending SELECT g, g % 4 FROM generate_series(1, 1000) g;
+CREATE INDEX bmidx_pending ON test_pending USING bitmap (i) WITH (fastupdate = on);
+INSERT INTO test_pending SELECT g, g % 4 FROM generate_series(1001, 2000) g;
+INSERT INTO test_pending SELECT 0, 7 FROM generate_series(1, 10);
+
+SET enable_seqscan=off;
+SELECT count(*) FROM test_pending WHERE i = 1;
+SELECT count(*) FROM test_pending WHERE i = 7;
+SELECT count(*) FROM test_pending WHERE i >= 2;
+SELECT bm_pending_flush('bmidx_pending');
+SELECT count(*) FROM test_pending WHERE i = 1;
+SELECT bm_pending_flush('bmidx_pending');
+DELETE FROM test_pending WHERE i = 2;
+INSERT INTO test_pending SELECT 0, 2 FROM generate_series(1, 5);
+VACUUM test_pending;
+SELECT count(*) FROM test_pending WHERE i = 2;
+SET enable_bitmapscan=off;
+SELECT count(*) FROM test_pending WHERE i = 3;
+SELECT count(*) FROM test_pending WHERE i = 7;
+RESET enable_bitmapscan;
+RESET enable_seqscan;
+
+-- Inserts of a statement are buffered per heap block
+CREATE TABLE test_coalesce (g int4, i int4);
+CREATE INDEX bmidx_coalesce ON test_coalesce USING bitmap (i);
+INSERT INTO test_coalesce SELECT g, g % 3 FROM generate_series(1, 3000) g;
+CREATE TABLE test_coalesce_seen (n int8);
+CREATE FUNCTION test_coalesce_count() RETURNS trigger LANGUAGE plpgsql AS $$
+BEGIN
+  INSERT INTO test_coalesce_seen SELECT count(*) FROM test_coalesce WHERE i = 1;
+  RETURN NULL;
+END $$;
+CREATE TRIGGER test_coalesce_after AFTER INSERT ON test_coalesce
+  FOR EACH STATEMENT EXECUTE FUNCTION test_coalesce_count();
+
+SET enable_seqscan=off;
+INSERT INTO test_coalesce SELECT g, g % 3 FROM generate_series(1, 300) g;
+SELECT n AS count FROM test_coalesce_seen;
+SELECT count(*) FROM test_coalesce WHERE i = 1;
+SELECT count(*) FROM test_coalesce WHERE i = 2;
+RESET enable_seqscan;
+
+-- Builds sort the heap tuples of every value
+CREATE TABLE test_sorted (g int4, i int4);
+INSERT INTO test_sorted SELECT g, g % 7 FROM generate_series(1, 100000) g;
+SET maintenance_work_mem = '1MB';
+CREATE INDEX bmidx_sorted ON test_sorted USING bitmap (i);
+RESET maintenance_work_mem;
+
+SET enable_seqscan=off;
+SELECT count(*) FROM test_sorted WHERE i = 0;
+SELECT count(*) FROM test_sorted WHERE i = 3;
+SELECT count(*) FROM test_sorted WHERE i >= 5;
+INSERT INTO test_sorted SELECT g, 3 FROM generate_series(1, 100) g;
+SELECT count(*) FROM test_sorted WHERE i = 3;
+RESET enable_seqscan;
+
+-- Ordinals of aborted inserts leave directory pages missing
+CREATE TABLE test_gap (c1 int2, c2 int2, c3 int2, c4 int2, c5 int2, c6 int2, c7 int2, c8 int2, c9 int2, c10 int2, c11 int2, c12 int2, c13 int2, c14 int2, c15 int2, c16 int2, c17 int2, c18 int2, c19 int2, c20 int2, c21 int2, c22 int2, c23 int2, c24 int2, c25 int2, c26 int2, c27 int2, c28 int2, c29 int2, c30 int2, c31 int2, c32 int2);
+CREATE INDEX bmidx_gap ON test_gap USING bitmap (c1, c2, c3, c4, c5, c6, c7, c8, c9, c10, c11, c12, c13, c14, c15, c16, c17, c18, c19, c20, c21, c22, c23, c24, c25, c26, c27, c28, c29, c30, c31, c32);
+INSERT INTO test_gap SELECT v, v, v, v, v, v, v, v, v, v, v, v, v, v, v, v, v, v, v, v, v, v, v, v, v, v, v, v, v, v, v, v
+  FROM (SELECT g + 0 * (1 / (71 - g)) AS v FROM generate_series(1, 71) g) s;
+INSERT INTO test_gap SELECT 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100, 100;
+
+SET enable_seqscan=off;
+SELECT count(*) FROM test_gap WHERE c1 = 100;
+SELECT count(*) FROM test_gap WHERE c32 = 100;
+SELECT count(*) FROM test_gap WHERE c16 = 5;
+RESET enable_seqscan;
+
+-- Sliced scans past work_mem add lossy heap pages
+CREATE TABLE test_slice_lossy (i int4) WITH (fillfactor = 10);
+INSERT INTO test_slice_lossy SELECT g % 5 FROM generate_series(1, 30000) g;
+CREATE INDEX ON test_slice_lossy USING bitmap (i) WITH (sliced = on);
+
+SET enable_seqscan=off;
+SET work_mem = '64kB';
+SELECT count(*) FROM test_slice_lossy WHERE i = 1;
+SELECT count(*) FROM test_slice_lossy WHERE i = 3;
+RESET work_mem;
+RESET enable_seqscan;
+
+-- Values reuse the room vacuum freed on earlier value pages
+CREATE TABLE test_reuse (t text);
+CREATE INDEX bmidx_reuse ON test_reuse USING bitmap (t);
+INSERT INTO test_reuse SELECT repeat('x', 200) || lpad(g::text, 3, '0') FROM generate_series(1, 100) g;
+CREATE TABLE test_reuse_page AS SELECT count(*) AS n FROM bm_valuep('bmidx_reuse', 1);
+DELETE FROM test_reuse WHERE t <= repeat('x', 200) || '030';
+VACUUM test_reuse;
+SELECT count(*) = (SELECT n - 30 FROM test_reuse_page) AS freed FROM bm_valuep('bmidx_reuse', 1);
+INSERT INTO test_reuse SELECT repeat('x', 200) || lpad(g::text, 3, '0') FROM generate_series(101, 120) g;
+SELECT count(*) = (SELECT n - 10 FROM test_reuse_page) AS refilled FROM bm_valuep('bmidx_reuse', 1);
+
+SET enable_seqscan=off;
+SELECT count(*) FROM test_reuse WHERE t = repeat('x', 200) || '110';
+SELECT count(*) FROM test_reuse WHERE t = repeat('x', 200) || '050';
+RESET enable_seqscan;
+
+-- Shared cache needs the library preloaded
+SHOW bitmap.shared_cache_size;
+
+-- Compact WAL records need the library preloaded as well
+SHOW bitmap.compact_wal;
+
 -- Run amvalidator function on our opclasses
 SELECT opcname, amvalidate(opc.oid)
 FROM pg_opclass opc JOIN pg_am am ON am.oid = opcmethod